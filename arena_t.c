@@ -0,0 +1,123 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <string.h>
+#include "arena_t.h"
+
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+#define ARENA_ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT)
+
+static arena_block_t *block_constructor(size_t size) {
+    arena_block_t *block = (arena_block_t *) malloc(sizeof(arena_block_t) + size);
+    if (block == NULL) {
+        perror("arena block malloc");
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static void free_blocks(arena_block_t *block) {
+    while (block != NULL) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+arena_t *arena_constructor(size_t block_size) {
+    assert(block_size > 0);
+
+    arena_t *arena = (arena_t *) calloc(1, sizeof(arena_t));
+    if (arena == NULL) {
+        perror("arena constructor calloc");
+        goto error;
+    }
+
+    arena->block_size = ARENA_ALIGN(block_size);
+    arena->first = block_constructor(arena->block_size);
+    if (arena->first == NULL) goto error;
+    arena->current = arena->first;
+
+    ERRR("Created arena %p (block size: %lu)\n", arena, arena->block_size);
+
+    return arena;
+
+    error:
+    free(arena);
+    return NULL;
+}
+
+/* The memory is valid until the next arena_reset, returns NULL if no block could be allocated */
+void *arena_alloc(arena_t *arena, size_t size) {
+    assert(arena != NULL);
+
+    size = ARENA_ALIGN(size > 0 ? size : 1);
+
+    arena_block_t *block = arena->current;
+    if (block->size - block->used < size) {
+        block = block_constructor(size > arena->block_size ? size : arena->block_size);
+        if (block == NULL) return NULL;
+
+        block->next = arena->current->next;
+        arena->current->next = block;
+        arena->current = block;
+        arena->stats.blocks++;
+    }
+
+    void *p = (char *) block->data + block->used;
+    block->used += size;
+
+    arena->used += size;
+    arena->stats.allocations++;
+    arena->stats.bytes += size;
+    if (arena->used > arena->stats.max_bytes) arena->stats.max_bytes = arena->used;
+
+    return p;
+}
+
+/*
+ * Releases every allocation. Only the first block is kept, grown to what was used since the last reset (up to
+ * ARENA_MAX_RETAINED_SIZE) so that the same amount fits in it the next time
+ */
+void arena_reset(arena_t *arena) {
+    assert(arena != NULL);
+
+    free_blocks(arena->first->next);
+    arena->first->next = NULL;
+
+    if (arena->used > arena->first->size && arena->used <= ARENA_MAX_RETAINED_SIZE) {
+        arena_block_t *block = block_constructor(arena->used);
+        if (block != NULL) { // otherwise the old block is kept
+            free(arena->first);
+            arena->first = block;
+        }
+    }
+
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->used = 0;
+    arena->stats.resets++;
+}
+
+void arena_get_stats(arena_t *arena, arena_stats_t *stats) {
+    assert(arena != NULL);
+    assert(stats != NULL);
+
+    memcpy(stats, &arena->stats, sizeof(arena_stats_t));
+}
+
+void arena_destructor(arena_t *arena) {
+    assert(arena != NULL);
+
+    free_blocks(arena->first);
+    free(arena);
+}
+
+#ifdef __cplusplus
+}
+#endif
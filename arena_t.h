@@ -0,0 +1,53 @@
+#ifndef POET_CODE_ARENA_T_H
+#define POET_CODE_ARENA_T_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "poet_common_definitions.h"
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_MAX_RETAINED_SIZE (1024 * 1024) /* the first block does not grow beyond this between resets */
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size; /* bytes in data */
+    size_t used;
+    max_align_t data[]; /* every allocation is aligned like max_align_t */
+} arena_block_t;
+
+typedef struct {
+    size_t allocations;
+    size_t bytes;      /* bytes given since the creation of the arena */
+    size_t max_bytes;  /* most bytes given between two resets */
+    size_t blocks;     /* blocks allocated after the first one */
+    size_t resets;
+} arena_stats_t;
+
+/*
+ * Bump allocator: the allocations are taken in order from blocks and are only released all at once by arena_reset.
+ * Not thread safe, an arena belongs to whoever owns the data in it (a connection, a thread)
+ */
+typedef struct {
+    arena_block_t *first; /* kept by arena_reset */
+    arena_block_t *current;
+    size_t block_size;
+    size_t used; /* bytes given since the last reset */
+    arena_stats_t stats;
+} arena_t;
+
+arena_t *arena_constructor(size_t block_size);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+void arena_get_stats(arena_t *arena, arena_stats_t *stats);
+void arena_destructor(arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //POET_CODE_ARENA_T_H
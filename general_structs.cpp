@@ -46,29 +46,92 @@ int json_to_node_t(const json_value *json, node_t *node) {
     int state = 1;
     json_value *value = nullptr;
 
-    value = find_value(root, "node_id");
+    value = find_member(root, "node_id");
     state = state && value != nullptr;
     if (state) node->node_id = std::max(value->u.integer, (long) 0);
 
-    value = state ? find_value(root, "sgx_time") : nullptr;
+    value = state ? find_member(root, "sgx_time") : nullptr;
     state = state && value != nullptr;
     if (state) node->sgx_time = std::max(value->u.integer, (long) 0);
 
-    value = state ? find_value(root, "n_leadership") : nullptr;
+    value = state ? find_member(root, "n_leadership") : nullptr;
     state = state && value != nullptr;
     if (state) node->n_leadership = std::max(value->u.integer, (long) 0);
 
-    value = state ? find_value(root, "time_left") : nullptr;
+    value = state ? find_member(root, "time_left") : nullptr;
     state = state && value != nullptr;
     if (state) node->time_left = std::min((long) node->sgx_time, std::max(value->u.integer, (long) 0));
 
-    value = state ? find_value(root, "arrival_time") : nullptr;
+    value = state ? find_member(root, "arrival_time") : nullptr;
     state = state && value != nullptr;
     if (state) node->arrival_time = std::max(value->u.integer, (long) 0);
 
     return state;
 }
 
+/* Writes at most VARINT_MAX_SIZE bytes, 7 bits per byte starting with the lowest ones. Returns the bytes written */
+size_t put_varint(uint8_t *dest, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        dest[len++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    dest[len++] = (uint8_t) value;
+    return len;
+}
+
+/* Advances src past the value, returns 0 if the value is truncated or too long */
+int get_varint(const uint8_t **src, const uint8_t *end, uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; *src < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*src)++;
+        v |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = v;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void put_uint32_le(uint8_t *dest, uint32_t v) {
+    dest[0] = (uint8_t) v;
+    dest[1] = (uint8_t) (v >> 8);
+    dest[2] = (uint8_t) (v >> 16);
+    dest[3] = (uint8_t) (v >> 24);
+}
+
+static uint32_t get_uint32_le(const uint8_t *src) {
+    return (uint32_t) src[0] | (uint32_t) src[1] << 8 | (uint32_t) src[2] << 16 | (uint32_t) src[3] << 24;
+}
+
+/* Writes NODE_RECORD_SIZE bytes, the fields in the order of node_t */
+void put_node_record(uint8_t *dest, const node_t *node) {
+    assert(node != nullptr);
+    put_uint32_le(dest, node->node_id);
+    put_uint32_le(dest + 4, node->arrival_time);
+    put_uint32_le(dest + 8, node->sgx_time);
+    put_uint32_le(dest + 12, node->n_leadership);
+    put_uint32_le(dest + 16, node->time_left);
+}
+
+/* Same checks as json_to_node_t, advances src past the record. Returns 0 if it is truncated */
+int get_node_record(const uint8_t **src, const uint8_t *end, node_t *node) {
+    assert(node != nullptr);
+    if (end - *src < (long) NODE_RECORD_SIZE) return 0;
+
+    const uint8_t *p = *src;
+    node->node_id = get_uint32_le(p);
+    node->arrival_time = get_uint32_le(p + 4);
+    node->sgx_time = get_uint32_le(p + 8);
+    node->n_leadership = get_uint32_le(p + 12);
+    node->time_left = std::min(node->sgx_time, get_uint32_le(p + 16));
+    *src += NODE_RECORD_SIZE;
+
+    return 1;
+}
+
 void free_poet_context(struct poet_context *context) {
     assert(context != nullptr);
 
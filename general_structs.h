@@ -3,7 +3,9 @@
 
 #include <vector>
 #include <map>
+#include <deque>
 #include "queue_t.h"
+#include "work_queue_t.h"
 #include "socket_t.h"
 
 #ifdef __cplusplus
@@ -35,6 +37,43 @@ typedef struct node {
     uint time_left;
 } node_t;
 
+/*
+ * Binary encoding, granted at registration to the nodes asking for it on a length-framed connection. A request starts
+ * with a byte of at least POET_OPCODE_BASE, which can't start a JSON message (not '{' nor whitespace), so JSON requests
+ * stay available on the same connection:
+ *   request:      POET_OPCODE_BASE + opcode (index in poet_functions), varint id (0 for none), payload
+ *   response:     POET_STATUS_*, varint id, payload
+ *   notification: POET_NOTIFICATION_*, varint version, [varint from], queue, rows
+ * A queue is a varint count and varint node ids (zigzag operations for a delta), the rows a varint count and node_t
+ * records of NODE_RECORD_SIZE bytes, every field little-endian
+ */
+#define POET_ENCODING_JSON 0
+#define POET_ENCODING_BINARY 1
+
+typedef enum {
+    POET_OP_REGISTER = 0,
+    POET_OP_REMOTE_ATTESTATION,
+    POET_OP_SGX_TIME_BROADCAST,
+    POET_OP_GET_SGXTABLE,
+    POET_OP_GET_QUEUE,
+    POET_OP_GET_SGXTABLE_AND_QUEUE,
+    POET_OP_CLOSE_CONNECTION,
+    POET_OP_UNFINISHED_NODE,
+    POET_OP_SUBSCRIBE,
+    POET_OP_GET_NOTIFICATION_STATS,
+    POET_OPS,
+} poet_opcode_t;
+
+#define POET_OPCODE_BASE 0x80
+
+#define POET_STATUS_FAILURE 0
+#define POET_STATUS_SUCCESS 1
+#define POET_NOTIFICATION_FULL 2
+#define POET_NOTIFICATION_DELTA 3
+
+#define NODE_RECORD_SIZE (5 * sizeof(uint32_t))
+#define VARINT_MAX_SIZE 10
+
 typedef struct public_key {
     NUM_TYPE key[PUBLIC_KEY_SIZE];
 } public_key_t;
@@ -43,10 +82,37 @@ typedef struct signature {
     NUM_TYPE hash[SIGNATURE_SIZE];
 } signature_t;
 
+/* A node notified of the changes of the state, by the event loop serving the connection of the subscription */
+struct subscription {
+    work_queue_t *outbox; // snapshot not sent yet, a newer one replaces it (WORK_QUEUE_DROP_OLDEST)
+    uint node_id;
+    uint32_t channel; // SOCKET_CHANNEL_NOTIFICATIONS on a multiplexed connection, the default one on a secondary socket
+    uint64_t version; // of the last state sent, 0 until the whole state was sent
+    int encoding; // of the connection, POET_ENCODING_*
+};
+
+/* What one version of the state changed, replayed by the nodes that have the previous version */
+struct state_change {
+    uint64_t version;
+    std::vector<uint> nodes; // rows of the sgx table written
+    std::vector<int> queue_ops; // node ids pushed into the queue, QUEUE_OP_POP or QUEUE_OP_DEDUP
+};
+
+/* How the changes of the state were folded into notifications, updated atomically */
+struct notification_stats {
+    uint64_t broadcasts;
+    uint64_t changes; // versions of the state covered by the broadcasts
+    uint64_t max_changes; // most versions covered by one broadcast
+    uint64_t replaced; // notifications replaced in the outboxes of closed subscriptions before being sent
+};
+
 struct poet_context {
     node_t *node;
     public_key_t *public_key;
     signature_t *signature;
+    struct subscription *subscription; // NULL until the node subscribes on this connection
+    int encoding; // POET_ENCODING_*, negotiated at registration
+    long request_id; // "id" of the request being handled, echoed in its response (-1 when the node sent none)
 };
 
 struct global {
@@ -59,15 +125,24 @@ struct global {
     uint n_tiers = 0;
 
     queue_t *queue = nullptr;
+    std::vector<bool> queue_seen_nodes; // reused by the cleanups of the queue, under sgx_table_lock
 
     std::vector<node_t *> sgx_table;
     pthread_mutex_t sgx_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    socket_t *server_socket = nullptr;
+    uint64_t state_version = 0; // of the sgx table and the queue, under sgx_table_lock like the log
+    std::deque<struct state_change> state_log; // last changes, oldest first
+
+    /* A notification is sent once the first change waited max delay or max pending versions are waiting */
+    struct timespec notification_max_delay = {0, 20000000}; // 20 ms
+    uint64_t notification_max_pending = 64;
+    struct notification_stats notification_stats = {0, 0, 0, 0};
+
     socket_t *secondary_socket = nullptr;
+    socket_t *local_socket = nullptr; // AF_UNIX listener, same protocol as the main port
 
-    std::map<uint, socket_t *> secondary_socket_comms;
-    pthread_rwlock_t secondary_socket_comms_lock = PTHREAD_RWLOCK_INITIALIZER;
+    std::map<uint, struct subscription *> subscribers; // by node id, on secondary sockets or multiplexed connections
+    pthread_rwlock_t subscribers_lock = PTHREAD_RWLOCK_INITIALIZER;
 };
 
 #ifndef __WIN32
@@ -78,6 +153,11 @@ int json_to_node_t(const json_value *, node_t *);
 
 void free_poet_context(struct poet_context *);
 
+size_t put_varint(uint8_t *dest, uint64_t value);
+int get_varint(const uint8_t **src, const uint8_t *end, uint64_t *value);
+void put_node_record(uint8_t *dest, const node_t *node);
+int get_node_record(const uint8_t **src, const uint8_t *end, node_t *node);
+
 char *encode_hex(void *d, size_t len);
 
 void *decode_hex(const char *buffer, size_t buffer_len);
@@ -7,11 +7,13 @@
 #include <general_structs.h>
 #include <vector>
 #include <string>
+#include <map>
 #include <csignal>
 #include <sys/file.h>
 
 #include "socket_t.h"
 #include "queue_t.h"
+#include "arena_t.h"
 #include "poet_shared_functions.h"
 #include "enclave_helper.h"
 
@@ -28,6 +30,10 @@
 #define MAIN_PORT 9000
 #define SECONDARY_PORT 9001
 #define SERVER_IP "127.0.0.1"
+#define LOCAL_SERVER "local" // connects to the server running on this machine through LOCAL_SOCKET_PATH
+#define LOCAL_SOCKET_PATH "/tmp/poet_server.sock"
+#define MULTIPLEXED_CONNECTION true // notifications are received on a channel of node_socket, without SECONDARY_PORT
+#define BINARY_ENCODING true // asked at registration, JSON is still used when the server does not grant it
 
 #define BLOCKCHAIN_FILE "blockchain.dat"
 #define BLOCKCHAIN_WRITE_TIME 1 /* change */
@@ -60,24 +66,42 @@ std::vector<node_t *> sgx_table;
 pthread_mutex_t sgx_table_lock = PTHREAD_MUTEX_INITIALIZER;
 queue_t *queue;
 pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t state_version = 0; // of the sgx table and the queue, under both locks
+bool binary_encoding = false; // granted by the server at registration
 
 uint rejoin_state = 0;
 cond_mutex_t rejoin_cond = {PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
 
 void global_variable_initialization() {
     server_ip = (char *) malloc(18);
-    printf("Set the ip address to communicate (-1 for 127.0.0.1): ");
+    printf("Set the ip address to communicate (-1 for 127.0.0.1, " LOCAL_SERVER " for the local socket): ");
 //    scanf("%18s", server_ip);
     strcpy(server_ip, "-1");
     if (strcmp("-1", server_ip) == 0) {
         strcpy(server_ip, SERVER_IP);
     }
 
-    node_socket = socket_constructor(DOMAIN, TYPE, PROTOCOL, server_ip, MAIN_PORT);
-    assertp(node_socket != nullptr);
-    subscribe_socket = socket_constructor(DOMAIN, TYPE, PROTOCOL, server_ip, SECONDARY_PORT);
-    assertp(subscribe_socket != nullptr);
-    queue = queue_constructor();
+    // a node on the same machine as the server skips the TCP stack, the secondary socket is only available on TCP
+    bool local = strcmp(LOCAL_SERVER, server_ip) == 0;
+    int domain = local ? AF_UNIX : DOMAIN;
+    const char *address = local ? LOCAL_SOCKET_PATH : server_ip;
+
+    // notifications are received by a multishot request when io_uring is available
+    if (MULTIPLEXED_CONNECTION) {
+        node_socket = socket_constructor_custom(domain, TYPE, PROTOCOL, address, MAIN_PORT, SOCKET_BACKEND_IO_URING);
+        assertp(node_socket != nullptr && socket_enable_channels(node_socket));
+        subscribe_socket = node_socket;
+    } else {
+        node_socket = socket_constructor(domain, TYPE, PROTOCOL, address, MAIN_PORT);
+        assertp(node_socket != nullptr);
+        subscribe_socket = socket_constructor_custom(DOMAIN, TYPE, PROTOCOL, local ? SERVER_IP : server_ip,
+                                                     SECONDARY_PORT, SOCKET_BACKEND_IO_URING);
+        assertp(subscribe_socket != nullptr);
+    }
+    // the server detects the framing of each connection, large tables are received without scanning
+    socket_set_framing(node_socket, SOCKET_FRAMING_LENGTH);
+    socket_set_framing(subscribe_socket, SOCKET_FRAMING_LENGTH);
+    queue = queue_constructor_custom(QUEUE_RING);
     assertp(queue != nullptr);
 
     /* Initialize the enclave */
@@ -104,42 +128,257 @@ static void fill_with_rand(void *input, size_t len) {
 //    }
 }
 
-static int poet_remote_attestation_to_server() {
-    INFO("Starting remote attestation ...\n");
-    bool state = true;
-#ifdef NO_RA
-    char *buffer = (char *) malloc(BUFFER_SIZE);
+/* *************************** Requests to the server *************************** */
+
+/*
+ * Several threads have requests in flight on node_socket at once. Every request carries an "id" echoed by the server:
+ * a thread waiting for its response receives for every waiting thread (leader/follower) and hands over the responses of
+ * the other requests, so the responses can arrive in any order.
+ */
+struct rpc_request {
+    uint id;
+    json_value *response; // NULL when the request failed
+    char *frame; // instead of response when the server answered in the binary encoding
+    size_t frame_len;
+    bool done;
+};
+
+struct rpc_dispatcher {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t changed = PTHREAD_COND_INITIALIZER; // a response was handed over or the receiver left
+    pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+    bool receiving = false;
+    uint next_id = 1;
+    std::map<uint, rpc_request *> in_flight;
+} rpc;
+
+static rpc_request *rpc_request_constructor() {
+    auto request = new rpc_request();
+
+    assertp(pthread_mutex_lock(&rpc.lock) == 0);
+    request->id = rpc.next_id++;
+    if (rpc.next_id == 0) rpc.next_id = 1; // 0 is never used
+    rpc.in_flight[request->id] = request;
+    pthread_mutex_unlock(&rpc.lock);
+
+    return request;
+}
 
-    sprintf(buffer, R"({"method" : "remote_attestation", "data": null})");
-    printf("%s\n", buffer);
-    size_t len = strlen(buffer);
-    socket_send_message(node_socket, buffer, len);
+/* Returns the request to give to rpc_wait, or NULL if it could not be sent */
+static rpc_request *rpc_send_iov(rpc_request *request, struct iovec *parts, int nparts, const char *method) {
+    assertp(pthread_mutex_lock(&rpc.send_lock) == 0);
+    bool sent = socket_send_message_iov(node_socket, parts, nparts, 0) > 0;
+    pthread_mutex_unlock(&rpc.send_lock);
+
+    if (!sent) {
+        ERROR("Could not send the request '%s'\n", method);
+        assertp(pthread_mutex_lock(&rpc.lock) == 0);
+        rpc.in_flight.erase(request->id);
+        pthread_mutex_unlock(&rpc.lock);
+        delete request;
+        return nullptr;
+    }
 
-    free(buffer);
-    socket_get_message(node_socket, (void **) (&buffer), &len);
-    if (buffer == nullptr) {
-        return 0;
+    return request;
+}
+
+static rpc_request *rpc_send(const char *method, const char *data) {
+    rpc_request *request = rpc_request_constructor();
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header), R"({"id": %u, "method": "%s", "data": )", request->id, method);
+    struct iovec parts[] = {{header, (size_t) header_len}, {(void *) data, strlen(data)}, SOCKET_IOV_LITERAL("}")};
+
+    return rpc_send_iov(request, parts, 3, method);
+}
+
+/* Only once the server granted the binary encoding, the response is given by rpc_wait_binary */
+static rpc_request *rpc_send_binary(poet_opcode_t opcode, const std::string &payload) {
+    rpc_request *request = rpc_request_constructor();
+
+    uint8_t header[1 + VARINT_MAX_SIZE];
+    header[0] = (uint8_t) (POET_OPCODE_BASE + opcode);
+    size_t header_len = 1 + put_varint(header + 1, request->id);
+    struct iovec parts[] = {{header, header_len}, {(void *) payload.data(), payload.length()}};
+
+    return rpc_send_iov(request, parts, 2, "binary");
+}
+
+/* Must be called with rpc.lock, each one is given a NULL response */
+static void rpc_fail_in_flight() {
+    for (auto &it : rpc.in_flight) it.second->done = true;
+    rpc.in_flight.clear();
+}
+
+/*
+ * Must be called with rpc.lock. A binary response (frame) starts with its status and its id. A response without an id
+ * (one that could not be parsed, or the refusal of a busy server) can't be matched with its request: every request in
+ * flight fails instead of leaving its thread waiting for a response that already arrived
+ */
+static void rpc_hand_over(json_value *response, char *frame, size_t frame_len) {
+    bool has_id = false;
+    uint64_t id = 0;
+    if (frame != nullptr) {
+        const uint8_t *p = (uint8_t *) frame + 1;
+        has_id = get_varint(&p, (uint8_t *) frame + frame_len, &id) && id > 0;
+    } else if (response != nullptr) {
+        json_value *json_id = find_member(response, "id");
+        has_id = json_id != nullptr && json_id->type == json_integer;
+        id = has_id ? json_id->u.integer : 0;
     }
 
-    state = check_json_compliance(buffer, len) == 1;
-    if (state == 0) {
-        return 0;
+    if (!has_id) {
+        ERROR("Received a response without id, failing the %lu requests in flight\n", rpc.in_flight.size());
+        if (response != nullptr) json_value_free(response);
+        free(frame);
+        rpc_fail_in_flight();
+        return;
     }
 
-    json_value *json = json_parse(buffer, len);
-    json_value *json_status = find_value(json, "status");
-    if (json_status == nullptr || json_status->type != json_string ||
-        strcmp(json_status->u.string.ptr, "success") != 0) {
-        ERROR("Remote attestation was not successful\n");
-        state = false;
-    } else {
-        INFO("Remote attestation was successful\n");
+    auto it = rpc.in_flight.find((uint) id);
+    if (it == rpc.in_flight.end()) {
+        WARN("Received a response that no request is waiting for\n");
+        if (response != nullptr) json_value_free(response);
+        free(frame);
+        return;
     }
 
-    if (json != nullptr) {
-        json_value_free(json);
+    it->second->response = response;
+    it->second->frame = frame;
+    it->second->frame_len = frame_len;
+    it->second->done = true;
+    rpc.in_flight.erase(it);
+}
+
+/* Receives for every waiting thread until the response of the request arrived */
+static void rpc_receive(rpc_request *request) {
+    assertp(pthread_mutex_lock(&rpc.lock) == 0);
+    while (!request->done) {
+        if (rpc.receiving) { // the receiving thread hands over this response
+            pthread_cond_wait(&rpc.changed, &rpc.lock);
+            continue;
+        }
+
+        rpc.receiving = true;
+        pthread_mutex_unlock(&rpc.lock);
+
+        char *buffer = nullptr;
+        size_t len = 0;
+        json_value *response = nullptr;
+        bool received = socket_get_message(node_socket, (void **) &buffer, &len) > 0 && buffer != nullptr;
+        bool binary = received && len > 0 && (uint8_t) buffer[0] <= POET_STATUS_SUCCESS;
+        if (received && !binary) {
+            response = poet_parse_message(buffer, len);
+        }
+        if (!binary) {
+            free(buffer);
+            buffer = nullptr;
+        }
+
+        assertp(pthread_mutex_lock(&rpc.lock) == 0);
+        rpc.receiving = false;
+        if (received) {
+            rpc_hand_over(response, buffer, len);
+        } else { // the connection failed, and so did every request in flight
+            rpc_fail_in_flight();
+        }
+        pthread_cond_broadcast(&rpc.changed);
     }
+    pthread_mutex_unlock(&rpc.lock);
+}
+
+static bool rpc_response_success(json_value *response) {
+    json_value *json_status = response != nullptr ? find_member(response, "status") : nullptr;
+    return json_status != nullptr && json_status->type == json_string &&
+           strcmp(json_status->u.string.ptr, "success") == 0;
+}
 
+/* Waits for the response of the request (which is freed), returns it only if its status is success */
+static json_value *rpc_wait(rpc_request *request) {
+    if (request == nullptr) return nullptr;
+
+    rpc_receive(request);
+    json_value *response = request->response;
+    free(request->frame);
+    delete request;
+
+    if (!rpc_response_success(response)) {
+        if (response != nullptr) json_value_free(response);
+        return nullptr;
+    }
+
+    return response;
+}
+
+/* Waits for a response that only carries a status, in either encoding. The request is freed */
+static bool rpc_wait_status(rpc_request *request) {
+    if (request == nullptr) return false;
+
+    rpc_receive(request);
+    bool success = request->frame != nullptr ?
+                   request->frame_len > 0 && (uint8_t) request->frame[0] == POET_STATUS_SUCCESS :
+                   rpc_response_success(request->response);
+
+    free(request->frame);
+    if (request->response != nullptr) json_value_free(request->response);
+    delete request;
+
+    return success;
+}
+
+/* For a request nobody will wait for (its thread was canceled), the response is freed whenever it arrives */
+static void rpc_abandon(rpc_request *request) {
+    if (request == nullptr) return;
+
+    assertp(pthread_mutex_lock(&rpc.lock) == 0);
+    if (!request->done) rpc.in_flight.erase(request->id);
+    pthread_mutex_unlock(&rpc.lock);
+
+    free(request->frame);
+    if (request->response != nullptr) json_value_free(request->response);
+    delete request;
+}
+
+static json_value *rpc_call(const char *method, const char *data) {
+    return rpc_wait(rpc_send(method, data));
+}
+
+/*
+ * Waits for the response of a binary request (which is freed). Returns the frame to free only if its status is success,
+ * with the payload after the status and the id
+ */
+static char *rpc_wait_binary(rpc_request *request, const uint8_t **payload, size_t *payload_len) {
+    if (request == nullptr) return nullptr;
+
+    rpc_receive(request);
+    char *frame = request->frame;
+    size_t frame_len = request->frame_len;
+    if (request->response != nullptr) json_value_free(request->response);
+    delete request;
+
+    uint64_t id;
+    const uint8_t *p = (uint8_t *) frame + 1;
+    const uint8_t *end = (uint8_t *) frame + frame_len;
+    if (frame == nullptr || (uint8_t) frame[0] != POET_STATUS_SUCCESS || !get_varint(&p, end, &id)) {
+        free(frame);
+        return nullptr;
+    }
+
+    *payload = p;
+    *payload_len = end - p;
+    return frame;
+}
+
+static char *rpc_call_binary(poet_opcode_t opcode, const std::string &payload, const uint8_t **response,
+                             size_t *response_len) {
+    return rpc_wait_binary(rpc_send_binary(opcode, payload), response, response_len);
+}
+
+/* The response is given by poet_remote_attestation_wait */
+static rpc_request *poet_remote_attestation_send() {
+    INFO("Starting remote attestation ...\n");
+#ifdef NO_RA
+    return rpc_send("remote_attestation", "null");
 #else
 
     // TODO: Remote attestation
@@ -147,6 +386,15 @@ static int poet_remote_attestation_to_server() {
     exit(EXIT_FAILURE);
 
 #endif
+}
+
+static bool poet_remote_attestation_wait(rpc_request *request) {
+    bool state = rpc_wait_status(request);
+    if (state) {
+        INFO("Remote attestation was successful\n");
+    } else {
+        ERROR("Remote attestation was not successful\n");
+    }
 
     return state;
 }
@@ -180,108 +428,67 @@ static int poet_register_with_pk() {
         exit(EXIT_FAILURE);
     }
 
-    sprintf(buffer, R"({"method" : "register", "data": {"public_key": "%s", "signature" : "%s"}})", pk_64base,
-            sign_64base);
+    sprintf(buffer, R"({"public_key": "%s", "signature" : "%s", "encoding": "%s"})", pk_64base, sign_64base,
+            BINARY_ENCODING ? "binary" : "json");
     printf("%s\n", buffer);
-    size_t len = strlen(buffer);
-    state = socket_send_message(node_socket, buffer, len);
+    json_value *json = rpc_call("register", buffer);
+    state = json != nullptr;
 
     free(buffer);
     free(pk_64base);
     free(sign_64base);
 
-    state = socket_get_message(node_socket, (void **) (&buffer), &len) > 0;
-    state = state && check_json_compliance(buffer, len);
-
-    json_value *json = nullptr;
-    json_value *json_status = nullptr;
-
-    if (state) {
-        json = json_parse(buffer, len);
-
-        json_status = find_value(json, "status");
-        if (json_status == nullptr || json_status->type != json_string ||
-            strcmp(json_status->u.string.ptr, "success") != 0) {
-            state = 0;
-        }
-    }
-
     if (state) {
-        json_value *json_tmp = find_value(json, "sgxmax");
+        json_value *json_tmp = find_path(json, "data.sgxmax");
         state = json_tmp != nullptr && json_tmp->type == json_integer;
         if (state) sgxmax = json_tmp->u.integer;
 
-        json_tmp = find_value(json, "sgxt_lower");
+        json_tmp = find_path(json, "data.sgxt_lower");
         state = json_tmp != nullptr && json_tmp->type == json_integer;
         if (state) sgx_lowerbound = json_tmp->u.integer;
 
-        json_tmp = find_value(json, "node_id");
+        json_tmp = find_path(json, "data.node_id");
         state = json_tmp != nullptr && json_tmp->type == json_integer;
         if (state) node_id = json_tmp->u.integer;
 
-        json_tmp = find_value(json, "n_tiers");
+        json_tmp = find_path(json, "data.n_tiers");
         state = json_tmp != nullptr && json_tmp->type == json_integer;
         if (state) ntiers = json_tmp->u.integer;
 
-        json_tmp = find_value(json, "server_starting_time");
+        json_tmp = find_path(json, "data.server_starting_time");
         state = json_tmp != nullptr && json_tmp->type == json_integer;
         if (state) server_starting_time = json_tmp->u.integer;
+
+        json_tmp = find_path(json, "data.encoding"); // absent with the servers that only have JSON
+        binary_encoding = json_tmp != nullptr && json_tmp->type == json_string &&
+                          strcmp(json_tmp->u.string.ptr, "binary") == 0;
     }
 
-    json_value_free(json);
+    if (json != nullptr) {
+        json_value_free(json);
+    }
     return state;
 }
 
-static int poet_broadcast_sgxtime() {
-    char *buffer;
-    int state = 1;
-    json_value *json = nullptr;
-    json_value *json_status = nullptr;
-
+/* The response is given by poet_broadcast_sgxtime_wait */
+static rpc_request *poet_broadcast_sgxtime_send() {
     sgxt = generate_random_sgx_time();
     ERR("SGXt is generated: %u\n", sgxt);
 
-    buffer = (char *) malloc(BUFFER_SIZE);
-    if (buffer == nullptr) {
-        perror("malloc");
-        state = 0;
-        goto error;
-    }
-    sprintf(buffer, R"({"method":"sgx_time_broadcast", "data":{"sgxt": %u}})",
-            sgxt); // TODO: should send its identity from the enclave in it
     ERR("Sending SGXt (%u) to the server\n", sgxt);
-    state = socket_send_message(node_socket, buffer, strlen(buffer)) > 0;
-
-    free(buffer);
-    buffer = nullptr;
-
-    size_t len;
-    if (state) { // getting reply of success
-        state = socket_get_message(node_socket, (void **) &buffer, &len) > 0;
-        state = state && check_json_compliance(buffer, len);
-        if (state) {
-            json = json_parse(buffer, len);
-
-            json_status = find_value(json, "status");
-            if (json_status == nullptr || json_status->type != json_string ||
-                strcmp(json_status->u.string.ptr, "success") != 0) {
-                state = 0;
-            }
-
-            json_value_free(json);
-            json = nullptr;
-        }
-    }
-
-    error:
-    if (buffer != nullptr) {
-        free(buffer);
+    if (binary_encoding) {
+        std::string payload;
+        append_varint(payload, sgxt);
+        return rpc_send_binary(POET_OP_SGX_TIME_BROADCAST, payload);
     }
 
-    if (json != nullptr) {
-        json_value_free(json);
-    }
+    char data[64];
+    sprintf(data, R"({"sgxt": %u})", sgxt); // TODO: should send its identity from the enclave in it
+    return rpc_send("sgx_time_broadcast", data);
+}
 
+static int poet_broadcast_sgxtime_wait(rpc_request *request) {
+    int state = rpc_wait_status(request); // getting reply of success
     if (!state) {
         ERROR("Failed to broadcast SGXtime\n");
     }
@@ -289,6 +496,16 @@ static int poet_broadcast_sgxtime() {
     return state;
 }
 
+static int poet_broadcast_sgxtime() {
+    return poet_broadcast_sgxtime_wait(poet_broadcast_sgxtime_send());
+}
+
+static bool setup_secondary_socket();
+
+/*
+ * Once the node is registered, the remote attestation, the subscription and the first SGXt are independent, so they
+ * are in flight together and their responses are waited for afterwards
+ */
 static int poet_register_to_server() {
     int state = 1;
 
@@ -299,9 +516,19 @@ static int poet_register_to_server() {
             node_id);
     }
 
-    state = state && poet_remote_attestation_to_server();
+    // a secondary socket is subscribed before the first SGXt changes the state
+    state = state && (MULTIPLEXED_CONNECTION || setup_secondary_socket());
+
+    rpc_request *attestation = state ? poet_remote_attestation_send() : nullptr;
+    rpc_request *subscription = state && MULTIPLEXED_CONNECTION ? rpc_send("subscribe", "null") : nullptr;
+    rpc_request *broadcast = state ? poet_broadcast_sgxtime_send() : nullptr;
+
+    bool attested = poet_remote_attestation_wait(attestation);
+    bool subscribed = !MULTIPLEXED_CONNECTION || rpc_wait_status(subscription);
+    ERR("Subscription %s\n", subscribed ? "successful" : "failed");
+    bool broadcasted = poet_broadcast_sgxtime_wait(broadcast);
+    state = state && attested && subscribed && broadcasted;
 
-    error:
     ERR("Server registration %s\n", state ? "successful" : "failed");
 
     return state;
@@ -332,7 +559,7 @@ static bool get_sgx_table_from_json(json_value *json, bool lock = true) {
     bool state = true;
     json_value *json_sgx_table = nullptr;
 
-    json_sgx_table = find_value(json, "sgx_table");
+    json_sgx_table = find_path(json, "data.sgx_table");
     if (json_sgx_table == nullptr || json_sgx_table->type != json_array) {
         state = false;
     }
@@ -361,28 +588,15 @@ static bool get_sgx_table_from_json(json_value *json, bool lock = true) {
 }
 
 static bool get_sgx_table() {
-    json_value *json = nullptr;
-
-    char *buffer = (char *) malloc(BUFFER_SIZE);
-    sprintf(buffer, R"({"method":"get_sgxtable", "data": null})");
-    socket_send_message(node_socket, buffer, strlen(buffer));
-    free(buffer);
-    buffer = nullptr;
-
-    size_t len;
-    bool state = socket_get_message(node_socket, (void **) &buffer, &len) > 0;
+    json_value *json = rpc_call("get_sgxtable", "null");
 
-    state = state && (json = check_json_success_status(buffer, len)) != nullptr;
+    bool state = json != nullptr;
     state = state && get_sgx_table_from_json(json);
 
     if (json != nullptr) {
         json_value_free(json);
     }
 
-    if (buffer != nullptr) {
-        free(buffer);
-    }
-
     return state;
 }
 
@@ -390,7 +604,7 @@ static bool get_queue_from_json(json_value *json, bool lock = true) {
     bool state = true;
     json_value *json_queue = nullptr;
 
-    json_queue = find_value(json, "queue");
+    json_queue = find_path(json, "data.queue");
     if (json_queue == nullptr || json_queue->type != json_array) {
         state = false;
     }
@@ -399,7 +613,10 @@ static bool get_queue_from_json(json_value *json, bool lock = true) {
         /* Empty the queue */
         if (lock) assertp(mutex_locks(&queue_lock) != 0);
         queue_destructor(queue, 0);
-        queue = queue_constructor();
+        queue = queue_constructor_custom(QUEUE_RING);
+
+        std::vector<void *> ids;
+        ids.reserve(json_queue->u.array.length);
 
         json_value **json_node = json_queue->u.array.begin();
         while (state && json_node != json_queue->u.array.end()) {
@@ -408,8 +625,9 @@ static bool get_queue_from_json(json_value *json, bool lock = true) {
             state = state && value != nullptr && value->type == json_integer;
             nid = value->u.integer;
             json_node++;
-            queue_push(queue, (void *) (nid));
+            ids.push_back((void *) (nid));
         }
+        queue_push_n(queue, ids.data(), ids.size());
 
         if (lock) mutex_unlocks(&queue_lock);
 
@@ -421,94 +639,205 @@ static bool get_queue_from_json(json_value *json, bool lock = true) {
     return state;
 }
 
-static bool update_sgx_table_and_queue_from_txt(char *buffer, size_t len) {
-    bool state = 1;
+/* Returns 0 when the value is missing */
+static uint64_t get_version_from_json(json_value *json, const char *name) {
+    json_value *json_version = find_member(json, name);
+    if (json_version == nullptr || json_version->type != json_integer || json_version->u.integer < 0) {
+        return 0;
+    }
 
-    state = check_json_compliance(buffer, len);
-    json_value *json = nullptr;
-    if (state) {
-        assertp(mutex_locks(&sgx_table_lock, &queue_lock));
-        json = json_parse(buffer, len);
-        state = get_queue_from_json(json, false);
-        state = state && get_sgx_table_from_json(json, false);
-        if (state) {
-            node_current_time = time(nullptr) - server_starting_time;
-        }
-        mutex_unlocks(&sgx_table_lock, &queue_lock);
+    return (uint64_t) json_version->u.integer;
+}
+
+/* A notification in either encoding: the whole state, or the changes since the version from */
+struct state_update {
+    bool delta;
+    uint64_t version;
+    uint64_t from;
+    std::vector<long> queue; // node ids, or the queue operations of a delta
+    std::vector<node_t> rows;
+};
+
+static bool state_update_from_json(json_value *json, state_update &update) {
+    json_value *data = find_member(json, "data");
+    if (data == nullptr) return false;
+
+    update.delta = find_member(data, "from") != nullptr;
+    update.version = get_version_from_json(data, "version");
+    update.from = update.delta ? get_version_from_json(data, "from") : 0;
+
+    json_value *json_queue = find_member(data, update.delta ? "queue_ops" : "queue");
+    json_value *json_sgx_table = find_member(data, "sgx_table");
+    if (json_queue == nullptr || json_queue->type != json_array || json_sgx_table == nullptr ||
+        json_sgx_table->type != json_array) {
+        return false;
     }
 
-    ERR("sgx table and queue was updated: %d\n", state);
+    bool state = true;
+    for (unsigned int i = 0; state && i < json_queue->u.array.length; i++) {
+        json_value *value = json_queue->u.array.values[i];
+        state = value->type == json_integer;
+        if (state) update.queue.push_back((long) value->u.integer);
+    }
+
+    for (unsigned int i = 0; state && i < json_sgx_table->u.array.length; i++) {
+        node_t node{};
+        state = json_to_node_t(json_sgx_table->u.array.values[i], &node);
+        update.rows.push_back(node);
+    }
 
     return state;
 }
 
-static bool get_queue() {
-    json_value *json = nullptr;
+/* The body of a notification or of the get_sgxtable_and_queue response in the binary encoding */
+static bool state_update_from_binary(const uint8_t *p, const uint8_t *end, bool delta, state_update &update) {
+    uint64_t count = 0;
+    uint64_t value = 0;
 
-    char *buffer = (char *) malloc(BUFFER_SIZE);
-    sprintf(buffer, R"({"method":"get_queue", "data": null})");
-    int state = socket_send_message(node_socket, buffer, strlen(buffer));
-    free(buffer);
-    buffer = nullptr;
+    update.delta = delta;
+    update.from = 0;
+    bool state = get_varint(&p, end, &update.version);
+    state = state && (!delta || get_varint(&p, end, &update.from));
 
-    size_t len;
-    state = state && socket_get_message(node_socket, (void **) &buffer, &len) > 0;
-    state = state && (json = check_json_success_status(buffer, len)) != nullptr;
-    state = state && get_queue_from_json(json);
+    state = state && get_varint(&p, end, &count);
+    for (uint64_t i = 0; state && i < count; i++) {
+        state = get_varint(&p, end, &value);
+        update.queue.push_back(delta ? (long) zigzag_decode(value) : (long) value);
+    }
 
-    if (json != nullptr) {
-        json_value_free(json);
+    state = state && get_varint(&p, end, &count);
+    for (uint64_t i = 0; state && i < count; i++) {
+        node_t node{};
+        state = get_node_record(&p, end, &node);
+        update.rows.push_back(node);
     }
 
-    if (buffer != nullptr) {
-        free(buffer);
+    return state;
+}
+
+/* Must be called with both locks, a delta replays the changes made by the server */
+static bool apply_state_update(const state_update &update) {
+    bool state = true;
+
+    if (!update.delta) {
+        for (auto node : sgx_table) delete node;
+        sgx_table.clear();
+        queue_destructor(queue, 0);
+        queue = queue_constructor_custom(QUEUE_RING);
+    }
+
+    /* Same placement as the server: a known node is updated in place, a new one is appended */
+    for (const node_t &node : update.rows) {
+        if (update.delta && node.node_id < sgx_table.size()) {
+            *sgx_table[node.node_id] = node;
+        } else {
+            sgx_table.push_back(new node_t(node));
+        }
+    }
+
+    for (long op : update.queue) {
+        if (op >= 0) {
+            queue_push(queue, (void *) op);
+        } else if (update.delta && op == QUEUE_OP_POP) {
+            queue_pop(queue);
+        } else if (update.delta && op == QUEUE_OP_DEDUP) {
+            queue_remove_repeated_nodes(queue, 1);
+        } else {
+            state = false;
+        }
     }
 
     return state;
 }
 
 static bool get_queue_and_sgx_table() {
-    json_value *json = nullptr;
-
-    char *buffer = (char *) malloc(BUFFER_SIZE);
-    sprintf(buffer, R"({"method":"get_sgxtable_and_queue", "data": null})");
-    int state = socket_send_message(node_socket, buffer, strlen(buffer));
-    free(buffer);
-    buffer = nullptr;
+    bool state = true;
+    state_update update{};
+
+    if (binary_encoding) {
+        const uint8_t *payload = nullptr;
+        size_t payload_len = 0;
+        char *frame = rpc_call_binary(POET_OP_GET_SGXTABLE_AND_QUEUE, "", &payload, &payload_len);
+        state = frame != nullptr && state_update_from_binary(payload, payload + payload_len, false, update);
+        free(frame);
+    } else {
+        json_value *json = rpc_call("get_sgxtable_and_queue", "null");
+        state = json != nullptr && state_update_from_json(json, update);
+        if (json != nullptr) json_value_free(json);
+    }
 
-    size_t len;
-    state = state && socket_get_message(node_socket, (void **) &buffer, &len) > 0;
+    if (state) {
+        assertp(mutex_locks(&sgx_table_lock, &queue_lock));
+        state = apply_state_update(update);
+        if (state) state_version = update.version;
+        mutex_unlocks(&sgx_table_lock, &queue_lock);
+    }
 
-    state = state && (json = check_json_success_status(buffer, len)) != nullptr;
+    return state;
+}
 
-    assertp(mutex_locks(&sgx_table_lock, &queue_lock));
-    state = state && get_queue_from_json(json, false);
-    state = state && get_sgx_table_from_json(json, false);
-    mutex_unlocks(&sgx_table_lock, &queue_lock);
+/*
+ * A notification, in the encoding negotiated, has either the whole state or the changes since the version "from".
+ * When versions were missed, the whole state is asked to the server. A JSON notification is parsed in the arena, which
+ * is reset before returning. Returns false when the state could not be updated
+ */
+static bool update_sgx_table_and_queue_from_txt(char *buffer, size_t len, arena_t *arena) {
+    bool state = 1;
+    bool missed = false;
+    state_update update{};
 
-    if (json != nullptr) {
-        json_value_free(json);
+    uint8_t kind = len > 0 ? (uint8_t) buffer[0] : 0;
+    if (kind == POET_NOTIFICATION_FULL || kind == POET_NOTIFICATION_DELTA) {
+        state = state_update_from_binary((uint8_t *) buffer + 1, (uint8_t *) buffer + len,
+                                         kind == POET_NOTIFICATION_DELTA, update);
+    } else {
+        json_value *json = poet_parse_message_custom(buffer, len, arena);
+        state = json != nullptr && state_update_from_json(json, update);
+        arena_reset(arena);
     }
 
-    if (buffer != nullptr) {
-        free(buffer);
+    if (state) {
+        assertp(mutex_locks(&sgx_table_lock, &queue_lock));
+        if (update.version != 0 && update.version <= state_version) {
+            ERR("Version %lu is already known\n", (unsigned long) update.version);
+        } else if (update.delta && update.from != state_version) {
+            missed = true;
+        } else {
+            state = apply_state_update(update);
+        }
+        if (state && !missed) {
+            state_version = update.version != 0 ? update.version : state_version;
+            node_current_time = time(nullptr) - server_starting_time;
+        }
+        mutex_unlocks(&sgx_table_lock, &queue_lock);
+
+        if (missed) {
+            ERR("Missed the versions after %lu, getting the whole state\n", (unsigned long) state_version);
+            state = get_queue_and_sgx_table();
+        }
     }
 
+    ERR("sgx table and queue was updated: %d\n", state);
+
     return state;
 }
 
-static bool server_close_connection() {
-    char *buffer = (char *) malloc(BUFFER_SIZE);
-    sprintf(buffer, R"({"method":"close_connection", "data": null})");
-    int state = socket_send_message(node_socket, buffer, strlen(buffer)) > 0;
-    free(buffer);
-    buffer = nullptr;
+static bool get_queue() {
+    json_value *json = rpc_call("get_queue", "null");
 
-    size_t len;
-    state = socket_get_message(node_socket, (void **) &buffer, &len) > 0;
+    bool state = json != nullptr;
+    state = state && get_queue_from_json(json);
 
-    json_value *json = nullptr;
-    state = state && (json = check_json_success_status(buffer, len)) != nullptr;
+    if (json != nullptr) {
+        json_value_free(json);
+    }
+
+    return state;
+}
+
+static bool server_close_connection() {
+    json_value *json = rpc_call("close_connection", "null");
+    bool state = json != nullptr;
 
     if (json != nullptr) {
         json_value_free(json);
@@ -550,36 +879,44 @@ static void get_input_from_user_and_write(FILE *f) {
 //    fputs(address, f);
 }
 
-static bool notify_readdition_of_node_into_queue(int time_left) {
+/* The response is waited for with rpc_wait_status */
+static rpc_request *notify_readdition_of_node_into_queue(int time_left) {
     assert(time_left > 0);
     WARN("Time left to notify to the server: %u\n", time_left);
 
-    bool state = true;
-
-    char *buffer = (char *) malloc(BUFFER_SIZE);
     node_t tmp_node{};
     memcpy(&tmp_node, sgx_table[node_id], sizeof(node_t));
     tmp_node.time_left = time_left;
     assert(tmp_node.sgx_time > time_left);
 
+    if (binary_encoding) {
+        std::string payload;
+        append_node_record(payload, tmp_node);
+        return rpc_send_binary(POET_OP_UNFINISHED_NODE, payload);
+    }
+
     std::string str = node_to_json(tmp_node);
-    sprintf(buffer, R"({"method":"unfinished_node", "data": %s})", str.c_str());
-    state = socket_send_message(node_socket, buffer, strlen(buffer)) > 0;
-    free(buffer);
-    buffer = nullptr;
+    return rpc_send("unfinished_node", str.c_str());
+}
 
-    size_t len = 0;
-    state = state && socket_get_message(node_socket, (void **) &buffer, &len);
-    state = state && buffer != nullptr;
-    state = state && check_json_success_status(buffer, len);
+/* Not canceled while it receives for the other waiting threads */
+static bool wait_readdition(rpc_request *request) {
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    bool state = rpc_wait_status(request);
+    pthread_setcancelstate(oldstate, &oldstate);
 
-    if (buffer != nullptr) {
-        free(buffer);
+    if (!state) {
+        ERROR("Failed to notify the readdition of the node\n");
     }
 
     return state;
 }
 
+static void abandon_readdition(void *arg) {
+    rpc_abandon(*(rpc_request **) arg);
+}
+
 static bool notify_leadership_of_node() {
     // TODO
     ERROR("method not implemented\n");
@@ -669,6 +1006,10 @@ static void *starting_time_calculation(void *arg) { // thread 3
         notification_times.erase(notification_times.begin());
     }
 
+    // a readdition is in flight while sleeping until the next one, its response is waited for once the next is sent
+    rpc_request *readdition = nullptr;
+    pthread_cleanup_push(abandon_readdition, &readdition);
+
     int remaining_time = sgx_table[node_id]->time_left;
     for (auto &notification_time : notification_times) {
         assert(curr_time < notification_time);
@@ -678,12 +1019,22 @@ static void *starting_time_calculation(void *arg) { // thread 3
 
         WARN("Notifying server of readdition: %d\n", curr_time);
         if (remaining_time > 0) {
-            notify_readdition_of_node_into_queue(remaining_time);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+            rpc_request *previous = readdition;
+            readdition = notify_readdition_of_node_into_queue(remaining_time);
+            if (previous != nullptr) wait_readdition(previous);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
         }
     }
 
     sleep(leadership_time - curr_time);
 
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    if (readdition != nullptr) wait_readdition(readdition);
+    readdition = nullptr;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
+    pthread_cleanup_pop(0);
+
     /* ****** BECOMES LEADER ****** */
 
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
@@ -700,8 +1051,12 @@ void *notifications_sentinel(void *_) { // thread 2
     ERR("Started to listen on secondary socket\n");
     char *buffer = nullptr;
     size_t len;
+    arena_t *arena = arena_constructor(ARENA_BLOCK_SIZE);
+    assertp(arena != nullptr);
     while (should_terminate == 0) {
-        int valread = socket_get_message(subscribe_socket, (void **) &buffer, &len);
+        // the responses received meanwhile on a multiplexed connection are handed to the requesting thread
+        int valread = socket_get_message_channel(subscribe_socket, SOCKET_CHANNEL_NOTIFICATIONS, (void **) &buffer,
+                                                 &len);
         if (valread < 0) {
             ERRR("Empty message from secondary socket\n");
             continue;
@@ -717,9 +1072,9 @@ void *notifications_sentinel(void *_) { // thread 2
         }
 
         bool updated = false;
-        if (buffer != nullptr) updated = update_sgx_table_and_queue_from_txt(buffer, len);
+        if (buffer != nullptr) updated = update_sgx_table_and_queue_from_txt(buffer, len, arena);
 
-        if (buffer != nullptr) free(buffer);
+        free(buffer);
         buffer = nullptr;
         len = 0;
 
@@ -733,6 +1088,7 @@ void *notifications_sentinel(void *_) { // thread 2
         }
     }
 
+    arena_destructor(arena);
     pthread_exit(nullptr);
 }
 
@@ -746,12 +1102,12 @@ static bool connect_to_server() {
     if (retry_connection) {
         do {
             connect1 = connect1 ? true : socket_connect_retry(node_socket) == 0;
-            connect2 = connect2 ? true : socket_connect_retry(subscribe_socket) == 0;
+            connect2 = connect2 || MULTIPLEXED_CONNECTION ? true : socket_connect_retry(subscribe_socket) == 0;
             connected = connect1 && connect2;
         } while (!connected && first_time);
     } else {
         assertp(socket_connect(node_socket) == 0);
-        assertp(socket_connect(subscribe_socket) == 0);
+        assertp(MULTIPLEXED_CONNECTION || socket_connect(subscribe_socket) == 0);
     }
 
     first_time = false;
@@ -761,6 +1117,14 @@ static bool connect_to_server() {
 
 static bool setup_secondary_socket() {
     bool state = true;
+    if (MULTIPLEXED_CONNECTION) { // the server knows the node of the connection
+        json_value *json = rpc_call("subscribe", "null");
+        state = json != nullptr;
+        ERR("Subscription %s\n", state ? "successful" : "failed");
+        if (json != nullptr) json_value_free(json);
+        return state;
+    }
+
     // doing registration on subscriber channel
     char *buffer = (char *) malloc(BUFFER_SIZE);
     assertp(buffer != nullptr);
@@ -790,8 +1154,8 @@ int main(int argc, char *argv[]) {
     ERR("connection established\n");
 
     bool state = true;
-    assertp(poet_register_to_server());
-    assertp(setup_secondary_socket());
+    assertp(poet_register_to_server()); // which also subscribes and broadcasts the first SGXt
+    bool broadcasted = true;
 
     pthread_t notifications_checker_thread;
     assertp(pthread_create(&notifications_checker_thread, nullptr, notifications_sentinel, nullptr) == 0);
@@ -800,7 +1164,8 @@ int main(int argc, char *argv[]) {
     while (should_terminate != 1) {
         uint initial_state = rejoin_state;
 
-        state = poet_broadcast_sgxtime();
+        state = broadcasted || poet_broadcast_sgxtime();
+        broadcasted = false;
 
         assertp(pthread_mutex_lock(&rejoin_cond.mutex) == 0);
         struct timespec dt{};
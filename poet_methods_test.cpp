@@ -3,6 +3,8 @@
 #include "poet_common_definitions.h"
 #include "poet_shared_functions.h"
 #include "queue_t.h"
+#include "work_queue_t.h"
+#include "arena_t.h"
 #include "socket_t.h"
 
 void test_leadership_time() {
@@ -17,7 +19,7 @@ void test_leadership_time() {
     *sgx_table[2] = {2, 0, 2, 0, 2};
     *sgx_table[3] = {3, 0, 9, 0, 9};
 
-    queue_t *queue = queue_constructor();
+    queue_t *queue = queue_constructor_custom(QUEUE_RING);
     queue_push(queue, (void *) 0);
     queue_push(queue, (void *) 1);
     queue_push(queue, (void *) 2);
@@ -31,6 +33,503 @@ void test_leadership_time() {
     assertp(time == 25);
 }
 
+static int delete_odd_ids(int _, void *d) {
+    return ((long) d) % 2;
+}
+
+#define LOCKFREE_TEST_THREADS 4
+#define LOCKFREE_TEST_ITEMS 100000
+
+static void *test_lockfree_producer(void *arg) {
+    auto queue = (queue_t *) ((void **) arg)[0];
+    auto base = (long) ((void **) arg)[1];
+
+    for (long i = 1; i <= LOCKFREE_TEST_ITEMS; i++) {
+        queue_push(queue, (void *) (base + i));
+    }
+
+    return nullptr;
+}
+
+static void *test_lockfree_consumer(void *arg) {
+    auto queue = (queue_t *) ((void **) arg)[0];
+    auto received = (std::vector<long> *) ((void **) arg)[1];
+
+    struct timespec timeout = {0, 10000000};
+    while (received->size() < LOCKFREE_TEST_ITEMS) {
+        uint64_t version = queue_version(queue);
+        auto d = (long) queue_front_and_pop(queue);
+        if (d != 0) {
+            received->push_back(d);
+        } else {
+            queue_wait_version(queue, version, &timeout);
+        }
+    }
+
+    return nullptr;
+}
+
+void test_lockfree_queue() {
+    queue_t *queue = queue_constructor_custom(QUEUE_LOCKFREE);
+    assertp(queue != nullptr);
+    assertp(queue_is_empty(queue));
+
+    queue_push(queue, (void *) 1);
+    queue_push(queue, (void *) 2);
+    assertp(queue_size(queue) == 2);
+    assertp((long) queue_front(queue) == 1 && (long) queue_back(queue) == 2);
+    assertp((long) queue_front_and_pop(queue) == 1);
+    assertp((long) queue_front_and_pop(queue) == 2);
+    assertp(queue_is_empty(queue));
+
+    // only the FIFO operations are supported
+    queue_push(queue, (void *) 3);
+    errno = 0;
+    assertp(queue_snapshot(queue) == nullptr && errno == ENOTSUP);
+    errno = 0;
+    assertp(queue_selective_remove(queue, delete_odd_ids, 0, 1) == -1 && errno == ENOTSUP);
+    assertp((long) queue_front_and_pop(queue) == 3);
+
+    pthread_t producers[LOCKFREE_TEST_THREADS], consumers[LOCKFREE_TEST_THREADS];
+    void *producer_args[LOCKFREE_TEST_THREADS][2], *consumer_args[LOCKFREE_TEST_THREADS][2];
+    std::vector<long> received[LOCKFREE_TEST_THREADS];
+
+    for (int i = 0; i < LOCKFREE_TEST_THREADS; i++) {
+        producer_args[i][0] = consumer_args[i][0] = queue;
+        producer_args[i][1] = (void *) ((long) i * LOCKFREE_TEST_ITEMS);
+        consumer_args[i][1] = &received[i];
+        pthread_create(&consumers[i], nullptr, test_lockfree_consumer, consumer_args[i]);
+        pthread_create(&producers[i], nullptr, test_lockfree_producer, producer_args[i]);
+    }
+
+    for (int i = 0; i < LOCKFREE_TEST_THREADS; i++) {
+        pthread_join(producers[i], nullptr);
+        pthread_join(consumers[i], nullptr);
+    }
+
+    std::vector<bool> seen(LOCKFREE_TEST_THREADS * LOCKFREE_TEST_ITEMS + 1, false);
+    for (auto &list : received) {
+        for (long d : list) {
+            assertp(!seen[d]);
+            seen[d] = true;
+        }
+    }
+    assertp(queue_is_empty(queue));
+
+    queue_destructor(queue, 0);
+}
+
+void test_queue_pool() {
+    queue_t *queue = queue_constructor();
+    assertp(queue != nullptr);
+
+    for (long i = 1; i <= 10; i++) queue_push(queue, (void *) i);
+    while (!queue_is_empty(queue)) queue_pop(queue);
+
+    size_t hits, misses, hits_after, misses_after;
+    queue_pool_stats(queue, &hits, &misses);
+    assertp(hits + misses == 10);
+
+    for (long i = 1; i <= 10; i++) queue_push(queue, (void *) i);
+    queue_pool_stats(queue, &hits_after, &misses_after);
+    assertp(hits_after == hits + 10 && misses_after == misses);
+
+    queue_set_pool_high_water(queue, 0);
+    queue_destructor(queue, 0);
+}
+
+void test_ring_queue() {
+    queue_t *queue = queue_constructor_custom(QUEUE_RING);
+    assertp(queue != nullptr);
+    assertp(queue_is_empty(queue) && queue_front(queue) == nullptr);
+
+    /* forces the buffer to wrap around and then to grow */
+    for (long i = 0; i < 50; i++) queue_push(queue, (void *) i);
+    for (long i = 0; i < 40; i++) assertp((long) queue_front_and_pop(queue) == i);
+    for (long i = 50; i < 200; i++) queue_push(queue, (void *) i);
+
+    assertp(queue_size(queue) == 160);
+    assertp((long) queue_front(queue) == 40 && (long) queue_back(queue) == 199);
+
+    assertp(queue_selective_remove(queue, delete_odd_ids, 0, 1) == 80);
+    for (long i = 40; i < 200; i += 2) assertp((long) queue_front_and_pop(queue) == i);
+    assertp(queue_is_empty(queue));
+
+    queue_destructor(queue, 0);
+}
+
+void test_queue_batches() {
+    queue_type_t types[] = {QUEUE_LOCKED, QUEUE_LOCKFREE, QUEUE_RING};
+
+    for (auto type : types) {
+        queue_t *queue = queue_constructor_custom(type);
+        assertp(queue != nullptr);
+
+        std::vector<void *> items;
+        for (long i = 1; i <= 100; i++) items.push_back((void *) i);
+        assertp(queue_push_n(queue, items.data(), items.size()) == 100);
+        assertp(queue_size(queue) == 100);
+
+        void *popped[30];
+        assertp(queue_pop_n(queue, popped, 30) == 30);
+        for (long i = 0; i < 30; i++) assertp((long) popped[i] == i + 1);
+
+        std::vector<void *> rest(100, nullptr);
+        assertp(queue_drain_into(queue, rest.data(), rest.size()) == 70);
+        for (long i = 0; i < 70; i++) assertp((long) rest[i] == i + 31);
+        assertp(queue_is_empty(queue));
+
+        queue_destructor(queue, 0);
+    }
+}
+
+static int delete_seen_ids(void *d, void *ctx) {
+    auto &seen = *((std::vector<bool> *) ctx);
+    auto id = (long) d;
+    bool r = seen[id];
+    seen[id] = true;
+    return r;
+}
+
+void test_queue_selective_remove_from_back() {
+    queue_type_t types[] = {QUEUE_LOCKED, QUEUE_RING};
+
+    for (auto type : types) {
+        queue_t *queue = queue_constructor_custom(type);
+        assertp(queue != nullptr);
+
+        long ids[] = {1, 1, 2, 3, 2, 1, 3, 0};
+        for (long id : ids) queue_push(queue, (void *) id);
+
+        std::vector<bool> seen(4, false);
+        assertp(queue_selective_remove_custom(queue, delete_seen_ids, &seen, 0, 1, 1) == 4);
+
+        long expected[] = {2, 1, 3, 0};
+        assertp(queue_size(queue) == 4 && (long) queue_back(queue) == 0);
+        for (long id : expected) assertp((long) queue_front_and_pop(queue) == id);
+
+        queue_destructor(queue, 0);
+    }
+}
+
+void test_queue_remove_repeated_nodes() {
+    queue_t *queue = queue_constructor_custom(QUEUE_RING);
+    assertp(queue != nullptr);
+
+    long ids[] = {7, 2, 7, 12, 2, 0};
+    for (long id : ids) queue_push(queue, (void *) id);
+
+    assertp(queue_remove_repeated_nodes(queue, 1) == 2); // the ids grow the seen table
+    long expected[] = {7, 12, 2, 0};
+    assertp(queue_size(queue) == 4);
+    for (long id : expected) assertp((long) queue_front_and_pop(queue) == id);
+
+    // a buffer kept by the caller is cleared between the calls
+    std::vector<bool> seen(13, true);
+    for (int round = 0; round < 2; round++) {
+        for (long id : ids) queue_push(queue, (void *) id);
+        assertp(queue_remove_repeated_nodes(queue, 1, seen) == 2 && seen.size() == 13);
+        for (long id : expected) assertp((long) queue_front_and_pop(queue) == id);
+    }
+
+    queue_destructor(queue, 0);
+}
+
+void test_queue_snapshot() {
+    queue_t *queue = queue_constructor_custom(QUEUE_RING);
+    assertp(queue != nullptr);
+
+    for (long i = 0; i < 10; i++) queue_push(queue, (void *) i);
+
+    queue_snapshot_t *first = queue_snapshot(queue);
+    queue_snapshot_t *second = queue_snapshot(queue);
+    assertp(first != nullptr && first == second); // unchanged queue shares the view
+    assertp(first->size == 10);
+
+    queue_pop(queue);
+    queue_snapshot_t *third = queue_snapshot(queue);
+    assertp(third != first && third->version != first->version);
+    assertp(third->size == 9 && (long) third->items[0] == 1);
+
+    // older readers keep their view after the modification
+    for (long i = 0; i < 10; i++) assertp((long) first->items[i] == i);
+
+    queue_snapshot_release(first);
+    queue_snapshot_release(second);
+    queue_snapshot_release(third);
+    queue_destructor(queue, 0);
+}
+
+static void *wait_queue_version(void *arg) {
+    auto queue = (queue_t *) arg;
+    return (void *) (long) queue_wait_version(queue, 0, nullptr);
+}
+
+void test_queue_wait_version() {
+    queue_t *queue = queue_constructor_custom(QUEUE_RING);
+    assertp(queue != nullptr && queue_version(queue) == 0);
+
+    struct timespec timeout = {0, 10000000};
+    assertp(!queue_wait_version(queue, 0, &timeout)); // nothing changed
+
+    pthread_t waiter;
+    assertp(pthread_create(&waiter, nullptr, wait_queue_version, queue) == 0);
+    queue_push(queue, (void *) 1);
+
+    void *ret = nullptr;
+    pthread_join(waiter, &ret);
+    assertp((long) ret == 1);
+    assertp(queue_wait_version(queue, 0, &timeout)); // already past version 0
+
+    queue_destructor(queue, 0);
+}
+
+void test_work_queue() {
+    struct timespec timeout = {0, 10000000};
+    void *d = nullptr;
+
+    work_queue_t *reject = work_queue_constructor(2, WORK_QUEUE_REJECT);
+    assertp(reject != nullptr);
+    assertp(work_queue_put(reject, (void *) 1) && work_queue_put(reject, (void *) 2));
+    assertp(!work_queue_put(reject, (void *) 3));
+    assertp(work_queue_take(reject) == (void *) 1);
+
+    work_queue_stats_t stats;
+    work_queue_get_stats(reject, &stats);
+    assertp(stats.depth == 1 && stats.max_depth == 2 && stats.rejected == 1);
+    work_queue_destructor(reject, 0);
+
+    work_queue_t *drop = work_queue_constructor(2, WORK_QUEUE_DROP_OLDEST);
+    assertp(drop != nullptr);
+    for (long i = 1; i <= 3; i++) assertp(work_queue_put(drop, (void *) i));
+    assertp(work_queue_take(drop) == (void *) 2 && work_queue_take(drop) == (void *) 3);
+    assertp(!work_queue_take_timed(drop, &d, &timeout));
+    work_queue_destructor(drop, 0);
+
+    work_queue_t *block = work_queue_constructor(1, WORK_QUEUE_BLOCK);
+    assertp(block != nullptr);
+    assertp(work_queue_put(block, (void *) 1));
+    assertp(!work_queue_put_timed(block, (void *) 2, &timeout)); // full until the timeout
+    work_queue_close(block);
+    assertp(work_queue_take(block) == (void *) 1 && work_queue_take(block) == nullptr);
+    work_queue_destructor(block, 0);
+}
+
+static socket_t *socket_from_descriptor(int fd, socket_framing_t framing) {
+    auto soc = (socket_t *) calloc(1, sizeof(socket_t));
+    assertp(soc != nullptr);
+    soc->socket_descriptor = fd;
+    socket_set_framing(soc, framing);
+    return soc;
+}
+
+void test_socket_framing() {
+    int fds[2];
+    assertp(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    socket_t *sender = socket_from_descriptor(fds[0], SOCKET_FRAMING_LENGTH);
+    socket_t *receiver = socket_from_descriptor(fds[1], SOCKET_FRAMING_AUTO);
+
+    std::string message(100000, 'x');
+    message[10] = '\0'; // not truncated by length-prefixed framing
+    auto sender_thread = [](void *arg) -> void * {
+        auto args = (std::pair<socket_t *, std::string *> *) arg;
+        socket_send_message(args->first, (void *) args->second->data(), args->second->size());
+        return nullptr;
+    };
+    std::pair<socket_t *, std::string *> args(sender, &message);
+    pthread_t thread;
+    assertp(pthread_create(&thread, nullptr, sender_thread, &args) == 0);
+
+    char *buffer = nullptr;
+    size_t len = 0;
+    assertp(socket_get_message(receiver, (void **) &buffer, &len) == (int) message.size());
+    pthread_join(thread, nullptr);
+    assertp(receiver->framing == SOCKET_FRAMING_LENGTH);
+    assertp(len == message.size() && memcmp(buffer, message.data(), len) == 0);
+    free(buffer);
+
+    socket_destructor(sender);
+    socket_destructor(receiver);
+}
+
+void test_socket_frames() {
+    int fds[2];
+    assertp(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    socket_t *receiver = socket_from_descriptor(fds[1], SOCKET_FRAMING_AUTO);
+
+    // two messages in one write, then a terminator split between two writes
+    const char *first = "{\"a\":1}\r\n{\"b\":2}\r\n{\"c\":3}\r";
+    assertp(write(fds[0], first, strlen(first)) == (ssize_t) strlen(first));
+
+    char *frame = nullptr;
+    size_t len = 0;
+    assertp(socket_get_frame(receiver, &frame, &len) == 7 && strcmp(frame, "{\"a\":1}") == 0);
+    assertp(socket_get_frame(receiver, &frame, &len) == 7 && strcmp(frame, "{\"b\":2}") == 0);
+    assertp(write(fds[0], "\n", 1) == 1);
+    assertp(socket_get_frame(receiver, &frame, &len) == 7 && strcmp(frame, "{\"c\":3}") == 0);
+    assertp(receiver->rx.end == 0); // everything consumed
+
+    // back to back length-prefixed frames keep the first byte of the next header
+    receiver->framing = SOCKET_FRAMING_LENGTH;
+    char frames[] = {0, 0, 0, 2, 'h', 'i', 0, 0, 0, 3, 'y', 'o', 'u'};
+    assertp(write(fds[0], frames, sizeof(frames)) == (ssize_t) sizeof(frames));
+    assertp(socket_get_frame(receiver, &frame, &len) == 2 && strcmp(frame, "hi") == 0);
+    assertp(socket_get_frame(receiver, &frame, &len) == 3 && strcmp(frame, "you") == 0);
+
+    // gathered parts are received as one message
+    socket_t *sender = socket_from_descriptor(fds[0], SOCKET_FRAMING_LENGTH);
+    std::string table = "[1,2,3]";
+    struct iovec parts[] = {SOCKET_IOV_LITERAL(R"({"queue": )"), {(void *) table.data(), table.length()},
+                            SOCKET_IOV_LITERAL("}")};
+    assertp(socket_send_message_iov(sender, parts, 3, 0) == 18);
+    assertp(socket_get_frame(receiver, &frame, &len) == 18 && strcmp(frame, R"({"queue": [1,2,3]})") == 0);
+
+    socket_destructor(sender);
+    assertp(socket_get_frame(receiver, &frame, &len) == 0 && frame == nullptr);
+    socket_destructor(receiver);
+}
+
+void test_socket_nonblocking() {
+    int fds[2];
+    assertp(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    socket_t *sender = socket_from_descriptor(fds[0], SOCKET_FRAMING_LENGTH);
+    socket_t *receiver = socket_from_descriptor(fds[1], SOCKET_FRAMING_LENGTH);
+    assertp(socket_set_nonblocking(sender, 1) && socket_set_nonblocking(receiver, 1));
+    assertp(socket_enable_tx_buffer(sender));
+
+    char *frame = nullptr;
+    size_t len = 0;
+    assertp(socket_get_frame_custom(receiver, &frame, &len, MSG_DONTWAIT) == SOCKET_AGAIN);
+
+    // larger than the socket buffers, the rest waits in the transmit buffer instead of blocking
+    std::string message(4 * 1024 * 1024, 'x');
+    assertp(socket_send_message(sender, (void *) message.data(), message.size()) > 0);
+    assertp(socket_flush(sender) == 0 && socket_tx_pending(sender) > 0);
+
+    int socket_state;
+    while ((socket_state = socket_get_frame_custom(receiver, &frame, &len, MSG_DONTWAIT)) == SOCKET_AGAIN) {
+        assertp(socket_flush(sender) >= 0);
+    }
+    assertp(socket_state == (int) message.size() && memcmp(frame, message.data(), len) == 0);
+    assertp(socket_flush(sender) == 1 && socket_tx_pending(sender) == 0);
+
+    socket_destructor(sender);
+    socket_destructor(receiver);
+}
+
+void test_socket_reactor_wake() {
+    socket_reactor_t *reactor = socket_reactor_constructor();
+    assertp(reactor != nullptr);
+
+    socket_event_t events[4];
+    assertp(socket_reactor_wait(reactor, events, 4, 0) == 0);
+
+    // the wakes before a wait are reported once
+    assertp(socket_reactor_wake(reactor) && socket_reactor_wake(reactor));
+    assertp(socket_reactor_wait(reactor, events, 4, 0) == 1);
+    assertp(events[0].events == SOCKET_EVENT_WAKE && events[0].data == nullptr);
+    assertp(socket_reactor_wait(reactor, events, 4, 0) == 0);
+
+    socket_reactor_destructor(reactor);
+}
+
+void test_socket_send_batch() {
+    int fds[3][2];
+    socket_t *senders[3], *receivers[3];
+    for (int i = 0; i < 3; i++) {
+        assertp(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) == 0);
+        senders[i] = socket_from_descriptor(fds[i][0], i == 0 ? SOCKET_FRAMING_TERMINATOR : SOCKET_FRAMING_LENGTH);
+        senders[i]->backend = SOCKET_BACKEND_IO_URING; // batched when built with POET_IO_URING
+        receivers[i] = socket_from_descriptor(fds[i][1], SOCKET_FRAMING_AUTO);
+    }
+    socket_close(senders[2]);
+
+    struct iovec parts[] = {SOCKET_IOV_LITERAL(R"({"data": )"), SOCKET_IOV_LITERAL("[1,2]}")};
+    assertp(socket_send_message_batch(senders, 3, parts, 2) == 2);
+
+    char *frame = nullptr;
+    size_t len = 0;
+    for (int i = 0; i < 2; i++) {
+        assertp(socket_get_frame(receivers[i], &frame, &len) == 15 && strcmp(frame, R"({"data": [1,2]})") == 0);
+    }
+
+    // on a channel, through the transmit buffer of a server connection
+    assertp(socket_enable_tx_buffer(senders[1]) && socket_enable_channels(receivers[1]));
+    assertp(socket_send_channel_batch(senders + 1, 1, SOCKET_CHANNEL_NOTIFICATIONS, parts, 2) == 1);
+    assertp(socket_tx_pending(senders[1]) == 0);
+    char *buffer = nullptr;
+    assertp(socket_get_message_channel(receivers[1], SOCKET_CHANNEL_NOTIFICATIONS, (void **) &buffer, &len) == 15);
+    assertp(strcmp(buffer, R"({"data": [1,2]})") == 0);
+    free(buffer);
+
+    for (int i = 0; i < 3; i++) {
+        socket_destructor(senders[i]);
+        socket_destructor(receivers[i]);
+    }
+}
+
+void test_socket_channels() {
+    int fds[2];
+    assertp(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    socket_t *sender = socket_from_descriptor(fds[0], SOCKET_FRAMING_LENGTH);
+    socket_t *receiver = socket_from_descriptor(fds[1], SOCKET_FRAMING_AUTO);
+    assertp(socket_enable_channels(receiver));
+
+    struct iovec notification[] = {SOCKET_IOV_LITERAL(R"({"data": 1})")};
+    struct iovec response[] = {SOCKET_IOV_LITERAL(R"({"status": "success"})")};
+    assertp(socket_send_channel_iov(sender, SOCKET_CHANNEL_NOTIFICATIONS, notification, 1, 0) == 11);
+    assertp(socket_send_message_iov(sender, response, 1, 0) == 21);
+
+    // the notification received first is kept for its channel
+    char *buffer = nullptr;
+    size_t len = 0;
+    assertp(socket_get_message(receiver, (void **) &buffer, &len) == 21);
+    assertp(strcmp(buffer, R"({"status": "success"})") == 0);
+    free(buffer);
+    assertp(socket_get_message_channel(receiver, SOCKET_CHANNEL_NOTIFICATIONS, (void **) &buffer, &len) == 11);
+    assertp(strcmp(buffer, R"({"data": 1})") == 0);
+    free(buffer);
+
+    // a closed connection ends every channel
+    socket_destructor(sender);
+    assertp(socket_get_message_channel(receiver, SOCKET_CHANNEL_NOTIFICATIONS, (void **) &buffer, &len) == 0);
+    assertp(socket_get_message(receiver, (void **) &buffer, &len) == 0 && buffer == nullptr);
+    socket_destructor(receiver);
+}
+
+void test_socket_unix() {
+    const char *path = "/tmp/poet_test.sock";
+    socket_t *listener = socket_constructor(AF_UNIX, SOCK_STREAM, 0, path, 0);
+    socket_t *client = socket_constructor(AF_UNIX, SOCK_STREAM, 0, path, 0);
+    assertp(listener != nullptr && client != nullptr);
+    socket_set_framing(listener, SOCKET_FRAMING_AUTO);
+    socket_set_framing(client, SOCKET_FRAMING_LENGTH);
+    assertp(socket_bind(listener) == 0 && socket_listen(listener, 1) == 0);
+    assertp(socket_connect(client) == 0);
+    socket_t *accepted = socket_accept(listener);
+    assertp(accepted != nullptr && accepted->address.ss_family == AF_UNIX);
+
+    char *buffer = nullptr;
+    size_t len = 0;
+    assertp(socket_send_message(client, (void *) "{\"data\": 1}", 11) == 11);
+    assertp(socket_get_message(accepted, (void **) &buffer, &len) == 11 && strcmp(buffer, "{\"data\": 1}") == 0);
+    free(buffer);
+
+    // the path of a running server is not taken over
+    socket_t *second = socket_constructor(AF_UNIX, SOCK_STREAM, 0, path, 0);
+    assertp(second != nullptr && socket_bind(second) < 0 && errno == EADDRINUSE);
+    socket_destructor(second);
+    errno = 0;
+    socket_destructor(socket_accept(listener)); // the connection that checked the path
+
+    // only the listener removes the path
+    socket_destructor(accepted);
+    socket_destructor(client);
+    assertp(access(path, F_OK) == 0);
+    socket_destructor(listener);
+    assertp(access(path, F_OK) != 0);
+}
+
 void *test_thread_locks(void * arg) {
     auto list = (pthread_mutex_t **) arg;
     pthread_mutex_t &lock1 = *list[0];
@@ -45,6 +544,91 @@ void *test_thread_locks(void * arg) {
 
 }
 
+void test_parse_message() {
+    const char valid[] = R"({"id": 4, "method": "get_queue", "data": null})";
+    json_value *json = poet_parse_message(valid, strlen(valid) + 1); // the NUL byte ends the message
+    assertp(json != nullptr && find_member(json, "id")->u.integer == 4);
+    json_value_free(json);
+
+    const char *invalid[] = {R"({"id": 4, "method": "get_queue", "data": null)", R"({"id": 4} })", "", "{\"id\": }"};
+    for (const char *message : invalid) {
+        assertp(poet_parse_message(message, strlen(message)) == nullptr);
+    }
+}
+
+void test_find_path() {
+    const char message[] = R"({"data": {"sgx_table": [{"node_id": 7}], "id": 1}, "id_x": 2, "id": 3})";
+    json_value *json = poet_parse_message(message, strlen(message));
+    assertp(json != nullptr);
+
+    assertp(find_member(json, "id")->u.integer == 3); // neither a prefix of "id_x" nor the nested "id"
+    assertp(find_path(json, "data.id")->u.integer == 1);
+    assertp(find_path(json, "data.sgx_table[0].node_id")->u.integer == 7);
+    assertp(find_path(json, "data.sgx_table[1]") == nullptr);
+    assertp(find_path(json, "data.sgx_table.node_id") == nullptr);
+    assertp(find_path(json, "node_id") == nullptr);
+    json_value_free(json);
+}
+
+void test_arena() {
+    arena_t *arena = arena_constructor(64);
+    assertp(arena != nullptr);
+
+    char *a = (char *) arena_alloc(arena, 1);
+    char *b = (char *) arena_alloc(arena, 24);
+    assertp(a != nullptr && b != nullptr && (uintptr_t) b % alignof(max_align_t) == 0);
+    assertp(arena_alloc(arena, 200) != nullptr); // larger than a block
+
+    arena_stats_t stats;
+    arena_get_stats(arena, &stats);
+    assertp(stats.allocations == 3 && stats.blocks == 1);
+
+    // the first block was grown to what was used, the same allocations fit in it again
+    arena_reset(arena);
+    assertp(arena_alloc(arena, 1) != nullptr && arena_alloc(arena, 24) != nullptr && arena_alloc(arena, 200) != nullptr);
+    arena_get_stats(arena, &stats);
+    assertp(stats.blocks == 1 && stats.resets == 1);
+
+    const char message[] = R"({"id": 4, "method": "get_queue", "data": {"queue": [1, 2, 3]}})";
+    arena_reset(arena);
+    json_value *json = poet_parse_message_custom(message, strlen(message), arena);
+    assertp(json != nullptr && find_path(json, "data.queue[2]")->u.integer == 3);
+    arena_get_stats(arena, &stats);
+    assertp(stats.allocations > 6);
+    assertp(poet_parse_message_custom(message, strlen(message) - 1, arena) == nullptr);
+    arena_reset(arena);
+
+    arena_destructor(arena);
+}
+
+void test_binary_encoding() {
+    std::string s;
+    uint64_t values[] = {0, 127, 128, 300, UINT32_MAX, UINT64_MAX};
+    for (uint64_t v : values) append_varint(s, v);
+    append_varint(s, zigzag_encode(QUEUE_OP_DEDUP));
+    assertp(s.length() == 1 + 1 + 2 + 2 + 5 + VARINT_MAX_SIZE + 1);
+
+    node_t node = {3, 1000, 25, 2, 40}; // time_left above sgx_time is clamped like json_to_node_t does
+    append_node_record(s, node);
+    assertp(s.length() == 22 + NODE_RECORD_SIZE);
+
+    auto p = (const uint8_t *) s.data();
+    auto end = p + s.length();
+    uint64_t v;
+    for (uint64_t expected : values) assertp(get_varint(&p, end, &v) && v == expected);
+    assertp(get_varint(&p, end, &v) && zigzag_decode(v) == QUEUE_OP_DEDUP);
+
+    node_t decoded{};
+    assertp(!get_node_record(&p, end - 1, &decoded)); // truncated
+    assertp(get_node_record(&p, end, &decoded) && p == end);
+    assertp(decoded.node_id == 3 && decoded.arrival_time == 1000 && decoded.sgx_time == 25);
+    assertp(decoded.n_leadership == 2 && decoded.time_left == 25);
+
+    const uint8_t truncated[] = {0x80, 0x80};
+    p = truncated;
+    assertp(!get_varint(&p, truncated + sizeof(truncated), &v));
+}
+
 void test_locks_methods() {
     pthread_t thread;
 
@@ -74,6 +658,26 @@ void test_locks_methods() {
 }
 
 int main() {
+    test_lockfree_queue();
+    test_queue_pool();
+    test_ring_queue();
+    test_queue_batches();
+    test_queue_selective_remove_from_back();
+    test_queue_remove_repeated_nodes();
+    test_queue_snapshot();
+    test_queue_wait_version();
+    test_work_queue();
+    test_socket_framing();
+    test_socket_frames();
+    test_socket_nonblocking();
+    test_socket_reactor_wake();
+    test_socket_send_batch();
+    test_socket_channels();
+    test_socket_unix();
+    test_parse_message();
+    test_find_path();
+    test_arena();
+    test_binary_encoding();
     test_leadership_time();
     test_locks_methods();
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <csignal>
 #include <vector>
 #include <map>
+#include <set>
+#include <tuple>
 
 #ifndef _WIN32
 
@@ -19,31 +21,56 @@
 
 #include "socket_t.h"
 #include "queue_t.h"
+#include "work_queue_t.h"
+#include "arena_t.h"
 #include "general_structs.h"
 #include "poet_common_definitions.h"
 #include "poet_server_functions.h"
 #include "poet_shared_functions.h"
 
 #define MAX_NODES 10000
-#define MAX_THREADS 20
-#define MAX_CONNECTIONS MAX_THREADS
-#define THREAD_RETRIES_THRESHOLD 100
-#define THREAD_RETRY_WAIT 2
+#define MAX_CONNECTIONS SOMAXCONN // listen backlog
+#define REACTOR_EVENTS 64
+#define REACTOR_TIMEOUT 5000 // ms
+#define JOB_THREADS 4
+#define MAX_PENDING_JOBS 256
 #define TRUE 1
 #define FALSE 0
 
 #define DOMAIN AF_INET
 #define TYPE SOCK_STREAM
 #define PROTOCOL 0
+#define BACKEND SOCKET_BACKEND_IO_URING // SOCKET_BACKEND_POSIX when io_uring is not available
 #define MAIN_PORT 9000
 #define SECONDARY_PORT 9001
 #define SERVER_IP "0.0.0.0"
+#define LOCAL_SOCKET_PATH "/tmp/poet_server.sock" // AF_UNIX listener for the nodes running on this machine
 
 /********** GLOBAL VARIABLES **********/
 int should_terminate = 0;
 
-pthread_t threads[MAX_THREADS];
-queue_t *threads_queue = nullptr;
+pthread_t job_threads[JOB_THREADS];
+work_queue_t *jobs_queue = nullptr; // short jobs (secondary socket registrations)
+
+/*
+ * Node connections are non-blocking and served by one event loop per core. Every loop accepts on its own listener of
+ * MAIN_PORT (SO_REUSEPORT), so the kernel balances the new connections and no thread is created after the start
+ */
+struct event_loop {
+    pthread_t thread;
+    socket_reactor_t *reactor;
+    socket_t *listener;
+    std::set<struct connection *> subscribers; // connections with a subscription, only used by the loop thread
+};
+
+std::vector<struct event_loop> event_loops;
+int active_connections = 0;
+const struct timespec NO_WAIT = {0, 0};
+
+struct server_job {
+    void (*function)(void *);
+    void *data;
+};
 
 /********** PoET variables **********/
 struct global g;
@@ -53,30 +80,41 @@ struct global g;
 /********** GLOBAL VARIABLES END **********/
 
 static void global_variables_initialization() {
-    g.queue = queue_constructor();
-    threads_queue = queue_constructor();
-    g.server_socket = socket_constructor(DOMAIN, TYPE, PROTOCOL, SERVER_IP, MAIN_PORT);
-    g.secondary_socket = socket_constructor(DOMAIN, TYPE, PROTOCOL, SERVER_IP, SECONDARY_PORT);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    event_loops.resize(cores > 0 ? (size_t) cores : 1);
+
+    g.queue = queue_constructor_custom(QUEUE_RING);
+    jobs_queue = work_queue_constructor(MAX_PENDING_JOBS, WORK_QUEUE_BLOCK);
+    for (auto &loop : event_loops) {
+        loop.reactor = socket_reactor_constructor();
+        loop.listener = socket_constructor_custom(DOMAIN, TYPE, PROTOCOL, SERVER_IP, MAIN_PORT, BACKEND);
+        if (loop.reactor == nullptr || loop.listener == nullptr) goto error;
+
+        socket_set_framing(loop.listener, SOCKET_FRAMING_AUTO);
+        if (socket_bind(loop.listener) != FALSE) goto error;
+    }
+    g.secondary_socket = socket_constructor_custom(DOMAIN, TYPE, PROTOCOL, SERVER_IP, SECONDARY_PORT, BACKEND);
+    g.local_socket = socket_constructor_custom(AF_UNIX, TYPE, PROTOCOL, LOCAL_SOCKET_PATH, 0, BACKEND);
 
-    if (g.queue == nullptr || g.server_socket == nullptr || threads_queue == nullptr || g.secondary_socket == nullptr) {
-        perror("queue, socket or threads_queue constructor");
+    if (g.queue == nullptr || jobs_queue == nullptr || g.secondary_socket == nullptr || g.local_socket == nullptr) {
+        perror("queue, socket or work queue constructor");
         goto error;
     }
 
-    if (socket_bind(g.server_socket) != FALSE) {
+    // accepted sockets answer with the framing used by the node (length-prefixed or "\r\n" terminated)
+    socket_set_framing(g.secondary_socket, SOCKET_FRAMING_AUTO);
+    socket_set_framing(g.local_socket, SOCKET_FRAMING_AUTO);
+
+    if (socket_bind(g.secondary_socket) != FALSE) {
         goto error;
     }
 
-    if (socket_bind(g.secondary_socket) != FALSE) {
+    if (socket_bind(g.local_socket) != FALSE) {
         goto error;
     }
 
     g.server_starting_time = time(nullptr);
 
-    for (int i = 0; i < MAX_THREADS; i++) {
-        queue_push(threads_queue, threads + i);
-    }
-
     return;
 
     error:
@@ -86,8 +124,11 @@ static void global_variables_initialization() {
 
 static void global_variables_destruction() {
     queue_destructor(g.queue, 0);
-    queue_destructor(threads_queue, 0);
-    socket_destructor(g.server_socket);
+    work_queue_close(jobs_queue); // the threads still waiting on it are released
+    for (auto &loop : event_loops) {
+        if (loop.listener != nullptr) socket_destructor(loop.listener);
+    }
+    socket_destructor(g.local_socket); // removes LOCAL_SOCKET_PATH
 }
 
 // Define the function to be called when ctrl-c (SIGINT) signal is sent to process
@@ -116,7 +157,7 @@ static bool check_message_integrity(json_value *json) {
     valid = valid && json->type == json_object;
     valid = valid && json->u.object.length >= 2;
 
-    json_value *json_method = (valid ? find_value(json, "method") : nullptr);
+    json_value *json_method = (valid ? find_member(json, "method") : nullptr);
     valid = valid && json_method != nullptr;
     valid = valid && json_method->type == json_string;
 
@@ -130,38 +171,43 @@ static bool check_message_integrity(json_value *json) {
         valid = valid && found;
     }
 
-    valid = valid && find_value(json, "data") != nullptr;
+    valid = valid && find_member(json, "data") != nullptr;
 
     return valid;
 }
 
-static bool delegate_message(char *buffer, size_t buffer_len, socket_t *soc, poet_context *context) {
+/* The message is parsed in the arena of the connection, which is reset once it is handled */
+static bool delegate_message(char *buffer, size_t buffer_len, arena_t *arena, socket_t *soc, poet_context *context) {
     json_value *json = nullptr;
+    json_value *json_id = nullptr;
     bool ret = true;
     struct function_handle *function = nullptr;
     char *func_name = nullptr;
 
-    if (!check_json_compliance(buffer, buffer_len)) {
+    json = poet_parse_message_custom(buffer, buffer_len, arena);
+    if (json == nullptr) {
         WARN("JSON format of message doesn't have a valid format for communication\n");
         goto error;
     }
 
-    json = json_parse(buffer, buffer_len);
-
     if (!check_message_integrity(json)) {
         ERROR("JSON format of message doesn't have a valid format for communication\n");
         goto error;
     }
 
     ERRR("JSON message is valid\n");
-    func_name = find_value(json, "method")->u.string.ptr;
+    func_name = find_member(json, "method")->u.string.ptr;
+
+    json_id = find_member(json, "id"); // pipelined requests are matched with their responses by the node
+    context->request_id = json_id != nullptr && json_id->type == json_integer && json_id->u.integer >= 0 ?
+                          (long) json_id->u.integer : -1;
 
     for (struct function_handle *i = poet_functions; i->name != nullptr && function == nullptr; i++) {
         function = strcmp(func_name, i->name) == 0 ? i : nullptr;
     }
     assert(function != nullptr);
 
-    ret = function->function(find_value(json, "data"), soc, context);
+    ret = function->function(find_member(json, "data"), soc, context);
     goto terminate;
 
     error:
@@ -169,72 +215,300 @@ static bool delegate_message(char *buffer, size_t buffer_len, socket_t *soc, poe
     ret = false;
 
     terminate:
-    if (json != nullptr) {
-        json_value_free(json);
-    }
+    arena_reset(arena);
     return ret;
 }
 
-static void *process_new_node(void *arg) {
-    auto *curr_thread = (struct thread_tuple *) arg;
-    auto *node_socket = (socket_t *) curr_thread->data;
-    ERR("Processing node in thread: %p(0x%lx) and socket %3d\n", curr_thread->thread, *(curr_thread->thread),
-        node_socket->socket_descriptor);
+/* A frame in the binary encoding (see general_structs.h), the opcode was checked by the caller */
+static bool delegate_binary_message(const uint8_t *buffer, size_t buffer_len, socket_t *soc, poet_context *context) {
+    const uint8_t *p = buffer + 1;
+    const uint8_t *end = buffer + buffer_len;
+    struct function_handle *function = poet_functions + (buffer[0] - POET_OPCODE_BASE);
+
+    uint64_t id = 0;
+    if (!get_varint(&p, end, &id)) {
+        ERROR("Binary message for function '%s' is truncated\n", function->name);
+        return false;
+    }
+    context->request_id = id > 0 ? (long) id : -1;
+
+    if (function->binary == nullptr) {
+        WARN("The function '%s' is only available in JSON\n", function->name);
+        return poet_binary_response(soc, context, POET_STATUS_FAILURE, nullptr, 0) > 0;
+    }
+
+    return function->binary(p, end - p, soc, context);
+}
+
+/* Protocol state of a node connection, advanced by its event loop as bytes arrive */
+struct connection {
+    socket_t *socket;
+    arena_t *arena; // JSON messages are parsed in it
+    struct poet_context context;
+};
+
+static void destroy_connection(struct connection *c) {
+    poet_unsubscribe(&c->context);
+    free_poet_context(&c->context);
+    socket_destructor(c->socket);
+    arena_destructor(c->arena);
+    free(c);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+static void drop_connection(struct event_loop *loop, struct connection *c) {
+    ERR("Connection was closed in socket %d on thread 0x%lx\n", c->socket->socket_descriptor, pthread_self());
+
+    if (!c->socket->is_closed) {
+        socket_reactor_remove(loop->reactor, c->socket); // a closed descriptor already left the reactor
+    }
+    loop->subscribers.erase(c);
+    destroy_connection(c);
+}
 
+/* Runs the handler of every complete frame, returns false once the connection has to be closed */
+static bool process_frames(struct connection *c) {
     char *buffer = nullptr;
     size_t buffer_size = 0;
-    struct poet_context context{};
-
     int socket_state;
-    socket_state = socket_get_message(node_socket, (void **) &buffer, &buffer_size);
 
-    while (socket_state > 0) {
-        ERR("message received from socket %d on thread %p(0x%lx)\n: \"%s\"\n",
-            node_socket->socket_descriptor,
-            curr_thread->thread,
-            *(curr_thread->thread),
-            buffer);
+    // in place, valid until the next frame
+    while ((socket_state = socket_get_frame_custom(c->socket, &buffer, &buffer_size, MSG_DONTWAIT)) > 0) {
+        // JSON stays available to a node that negotiated the binary encoding
+        uint8_t opcode = buffer_size > 0 ? (uint8_t) buffer[0] - POET_OPCODE_BASE : POET_OPS; // wraps below the base
+        bool binary = c->context.encoding == POET_ENCODING_BINARY && opcode < POET_OPS;
+        bool delegated;
+        if (binary) {
+            ERR("binary message %u received from socket %d on thread 0x%lx\n", opcode,
+                c->socket->socket_descriptor, pthread_self());
+            delegated = delegate_binary_message((uint8_t *) buffer, buffer_size, c->socket, &c->context);
+        } else {
+            ERR("message received from socket %d on thread 0x%lx\n: \"%s\"\n", c->socket->socket_descriptor,
+                pthread_self(), buffer);
+            delegated = delegate_message(buffer, buffer_size, c->arena, c->socket, &c->context);
+        }
 
-        if (!delegate_message(buffer, buffer_size, node_socket, &context)) {
-            ERROR("Could not delegate message from socket %d\n", node_socket->socket_descriptor);
-            goto error;
+        if (!delegated) {
+            ERROR("Could not delegate message from socket %d\n", c->socket->socket_descriptor);
+            return false;
         }
 
-        if (node_socket->is_closed) {
-            ERR("The socket %d was intentionally closed by server.\n", node_socket->socket_descriptor);
-            goto error;
+        if (c->socket->is_closed) {
+            ERR("The socket %d was intentionally closed by server.\n", c->socket->socket_descriptor);
+            return false;
         }
+    }
 
-        free(buffer);
-        buffer = nullptr;
+    return socket_state == SOCKET_AGAIN;
+}
+
+/*
+ * The snapshot of the outbox is only taken once the previous one left the transmit buffer, so the snapshots of a node
+ * that falls behind are replaced instead of piling up. A delta that does not follow the version the node has (a
+ * replaced one, or the first one) is rebuilt from that version. Returns nullptr when there is nothing to send
+ */
+static struct state_snapshot *next_snapshot(struct connection *c) {
+    struct subscription *subscription = c->context.subscription;
+    void *item = nullptr;
+    if (socket_tx_pending(c->socket) > 0 || !work_queue_take_timed(subscription->outbox, &item, &NO_WAIT)) {
+        return nullptr;
+    }
 
-        socket_state = socket_get_message(node_socket, (void **) &buffer, &buffer_size);
+    auto snapshot = (struct state_snapshot *) item;
+    if (snapshot->version <= subscription->version) { // already sent within a rebuilt one
+        state_snapshot_release(snapshot);
+        return nullptr;
+    }
+    if (snapshot->from != subscription->version) {
+        state_snapshot_release(snapshot);
+        snapshot = state_snapshot_constructor(subscription->version);
     }
 
-    if (socket_state == 0 || node_socket->is_closed) {
-        ERROR("Connection was closed in socket %d on thread %p(0x%lx)\n",
-              node_socket->socket_descriptor,
-              curr_thread->thread,
-              *(curr_thread->thread));
+    ERR("Sending the version %lu (from %lu) to node %u on socket %d\n", (unsigned long) snapshot->version,
+        (unsigned long) snapshot->from, subscription->node_id, c->socket->socket_descriptor);
+    return snapshot;
+}
+
+static void snapshot_iov(struct state_snapshot *snapshot, int encoding, struct iovec *part,
+                         const struct iovec **parts, int *nparts) {
+    if (encoding == POET_ENCODING_BINARY) {
+        *part = {(void *) snapshot->binary.data(), snapshot->binary.length()};
+        *parts = part;
+        *nparts = 1;
     } else {
-        ERROR("error receiving message from socket %d on thread %p(0x%lx)\n",
-              node_socket->socket_descriptor,
-              curr_thread->thread,
-              *(curr_thread->thread));
+        *parts = snapshot->parts;
+        *nparts = SNAPSHOT_PARTS;
     }
+}
 
-    error:
-    if (buffer != nullptr) {
-        free(buffer);
+/* Returns false once the connection has to be closed */
+static bool send_snapshot(struct connection *c) {
+    struct subscription *subscription = c->context.subscription;
+    struct state_snapshot *snapshot = next_snapshot(c);
+    if (snapshot == nullptr) return true;
+
+    struct iovec part;
+    const struct iovec *parts;
+    int nparts;
+    snapshot_iov(snapshot, subscription->encoding, &part, &parts, &nparts);
+    socket_send_channel_iov(c->socket, subscription->channel, parts, nparts, 0);
+    subscription->version = snapshot->version;
+    state_snapshot_release(snapshot);
+
+    return !c->socket->is_closed;
+}
+
+/*
+ * The notifier filled the outboxes. The subscribers of the loop that get the same snapshot in the same encoding on
+ * the same channel (all of them, unless some fell behind) are sent to with one batch
+ */
+static void send_snapshots(struct event_loop *loop) {
+    struct batch {
+        std::vector<struct connection *> connections;
+        std::vector<socket_t *> sockets;
+    };
+    std::map<std::tuple<struct state_snapshot *, int, uint32_t>, struct batch> batches;
+    for (auto c : loop->subscribers) {
+        struct subscription *subscription = c->context.subscription;
+        struct state_snapshot *snapshot = next_snapshot(c);
+        if (snapshot == nullptr) continue;
+
+        struct batch &b = batches[std::make_tuple(snapshot, subscription->encoding, subscription->channel)];
+        b.connections.push_back(c);
+        b.sockets.push_back(c->socket);
+    }
+
+    std::vector<struct connection *> failed;
+    for (auto &pair : batches) {
+        struct state_snapshot *snapshot = std::get<0>(pair.first);
+        struct batch &b = pair.second;
+
+        struct iovec part;
+        const struct iovec *parts;
+        int nparts;
+        snapshot_iov(snapshot, std::get<1>(pair.first), &part, &parts, &nparts);
+        socket_send_channel_batch(b.sockets.data(), (int) b.sockets.size(), std::get<2>(pair.first), parts, nparts);
+
+        for (auto c : b.connections) {
+            c->context.subscription->version = snapshot->version;
+            state_snapshot_release(snapshot); // one reference per connection
+            if (c->socket->is_closed) failed.push_back(c);
+        }
+    }
+
+    for (auto c : failed) {
+        drop_connection(loop, c);
+    }
+}
+
+static struct connection *connection_constructor(socket_t *new_socket);
+static void serve_connection(struct event_loop *loop, struct connection *c);
+
+/* Every connection of the loop is only touched by its thread, so handlers run without extra locking */
+static void *event_loop_worker(void *arg) {
+    auto loop = (struct event_loop *) ((struct thread_tuple *) arg)->data;
+    free(arg);
+
+    socket_event_t events[REACTOR_EVENTS];
+    while (!should_terminate) {
+        int n = socket_reactor_wait(loop->reactor, events, REACTOR_EVENTS, REACTOR_TIMEOUT);
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].events & SOCKET_EVENT_WAKE) {
+                send_snapshots(loop);
+                continue;
+            }
+
+            if (events[i].data == loop) { // edge triggered, every pending connection is accepted
+                socket_t *new_socket;
+                struct connection *c;
+                while ((new_socket = socket_accept(loop->listener)) != nullptr) {
+                    if ((c = connection_constructor(new_socket)) != nullptr) serve_connection(loop, c);
+                }
+                continue;
+            }
+
+            auto c = (struct connection *) events[i].data;
+            bool open = true;
+
+            if (events[i].events & SOCKET_EVENT_WRITE) {
+                open = socket_flush(c->socket) >= 0;
+            }
+
+            // edge triggered, the socket is read until there is nothing left (which also reports a hang up)
+            if (open && (events[i].events & (SOCKET_EVENT_READ | SOCKET_EVENT_CLOSE))) {
+                open = process_frames(c);
+            }
+
+            // a written transmit buffer makes room for the next snapshot
+            if (open && c->context.subscription != nullptr) {
+                loop->subscribers.insert(c);
+                open = send_snapshot(c);
+            }
+
+            if (!open) {
+                drop_connection(loop, c);
+            }
+        }
     }
-    free_poet_context(&context);
-    socket_destructor(node_socket);
-    queue_push(threads_queue, curr_thread->thread);
-    free(curr_thread);
 
     pthread_exit(nullptr);
 }
 
+static void *job_worker(void *arg) {
+    free(arg); // thread tuple, the queue is global
+
+    struct server_job *job;
+    while ((job = (struct server_job *) work_queue_take(jobs_queue)) != nullptr) {
+        job->function(job->data);
+        free(job);
+    }
+
+    pthread_exit(nullptr);
+}
+
+static bool submit_job(void (*function)(void *), void *data) {
+    auto job = (struct server_job *) malloc(sizeof(struct server_job));
+    if (job == nullptr) {
+        perror("submit_job malloc");
+        return false;
+    }
+
+    job->function = function;
+    job->data = data;
+    if (!work_queue_put(jobs_queue, job)) {
+        free(job);
+        return false;
+    }
+
+    return true;
+}
+
+/* poet_server [coalescing delay in ms [coalescing versions]], a delay of 0 notifies every change on its own */
+static void set_notification_coalescing(int argc, char *argv[]) {
+    if (argc > 1) {
+        long ms = strtol(argv[1], nullptr, 10);
+        if (ms < 0) {
+            ERROR("invalid coalescing delay\n");
+            exit(EXIT_FAILURE);
+        }
+        g.notification_max_delay = {ms / 1000, (ms % 1000) * 1000000L};
+    }
+
+    if (argc > 2) {
+        long versions = strtol(argv[2], nullptr, 10);
+        if (versions <= 0) {
+            ERROR("invalid number of coalescing versions\n");
+            exit(EXIT_FAILURE);
+        }
+        g.notification_max_pending = (uint64_t) versions;
+    }
+
+    INFO("Coalescing the notifications for %ld ms or %lu versions\n",
+         g.notification_max_delay.tv_sec * 1000 + g.notification_max_delay.tv_nsec / 1000000L,
+         (unsigned long) g.notification_max_pending);
+}
+
 void set_global_constants() {
     printf("Enter SGXt lowerbound: ");
     scanf("%lu", &g.sgxt_lowerbound);
@@ -256,165 +530,250 @@ void set_global_constants() {
     }
 }
 
-static void *asyncronous_send_message(void *arg) {
-    auto curr_thread = (struct thread_tuple *) arg;
-
-    auto ptr_lst = (void **) curr_thread->data;
-    auto socket = (socket_t *) ptr_lst[0];
-    auto buffer = (char *) ptr_lst[1];
-    auto len = (size_t) ptr_lst[2];
+static uint64_t get_state_version() {
+    assertp(pthread_mutex_lock(&g.sgx_table_lock) == 0);
+    uint64_t version = g.state_version;
+    pthread_mutex_unlock(&g.sgx_table_lock);
+    return version;
+}
 
-    ERR("Sending message to socket %d with the updated data: [%.*s]\n", socket->socket_descriptor, std::min(500, (int)len), buffer);
+/*
+ * Coalescing window opened by a change of the queue: the following changes are waited for until the first one is
+ * notification_max_delay old or notification_max_pending versions of the state are not sent yet, so a burst of joins
+ * costs one notification per subscriber. Returns the last version of the queue seen
+ */
+static uint64_t wait_coalescing_window(uint64_t version, uint64_t state_version) {
+    const struct timespec &delay = g.notification_max_delay;
+    struct timespec deadline, now, remaining;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += delay.tv_sec + (deadline.tv_nsec + delay.tv_nsec) / 1000000000L;
+    deadline.tv_nsec = (deadline.tv_nsec + delay.tv_nsec) % 1000000000L;
+
+    while (get_state_version() - state_version < g.notification_max_pending) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+        remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (remaining.tv_nsec < 0) {
+            remaining.tv_sec--;
+            remaining.tv_nsec += 1000000000L;
+        }
+        if (remaining.tv_sec < 0 || (remaining.tv_sec == 0 && remaining.tv_nsec == 0)) break;
 
-    int sent = socket_send_message(socket, buffer, len);
-    if (sent <= 0) {
-        ERROR("failed to send message to secondary socket %d\n", socket->socket_descriptor);
+        if (!queue_wait_version(g.queue, version, &remaining)) break;
+        version = queue_version(g.queue);
     }
 
-    free(ptr_lst);
-
-    queue_push(threads_queue, curr_thread->thread);
-    free(curr_thread);
+    return version;
+}
 
-    pthread_exit(nullptr);
+static void update_notification_stats(uint64_t changes) {
+    struct notification_stats &stats = g.notification_stats;
+    __atomic_add_fetch(&stats.broadcasts, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.changes, changes, __ATOMIC_RELAXED);
+    if (changes > __atomic_load_n(&stats.max_changes, __ATOMIC_RELAXED)) { // only written by the notifier
+        __atomic_store_n(&stats.max_changes, changes, __ATOMIC_RELAXED);
+    }
 }
 
+/* Every change goes to the outbox of each subscriber and is sent by its event loop, so nobody waits for a slow node */
 static void *sgx_table_and_queue_notification(void *_) {
-    int ret = 1;
-    do {
-        do {
-            ret = queue_wait_change(g.queue); // wait until there is a change in the nodes queue
-            if (!ret) sleep(1);
-        } while(!ret);
+    uint64_t version = queue_version(g.queue);
+    uint64_t state_version = 0; // of the previous notification, the next one only has the later changes
+    while (received_termination_signal() == FALSE) {
+        queue_wait_version(g.queue, version, nullptr); // wait until there is a change in the nodes queue
+        version = queue_version(g.queue); // later changes wake the next round
+        version = wait_coalescing_window(version, state_version);
         ERR("There was a change on the queue, sending message to all subscribers ...\n");
-        ret = 0; // ignore return status
-
-        assertp(pthread_mutex_lock(&g.sgx_table_lock) == 0);
-        std::string qs = std::move(get_queue_str());
-        std::string sgxt_str = std::move(get_sgx_table_str(false));
-        pthread_mutex_unlock(&g.sgx_table_lock);
 
-        int state = 1;
+        struct state_snapshot *snapshot = state_snapshot_constructor(state_version);
+        if (snapshot->version == state_version) { // the state itself did not change
+            state_snapshot_release(snapshot);
+            continue;
+        }
+        update_notification_stats(snapshot->version - state_version);
+        state_version = snapshot->version;
+
+        // never blocks: the snapshot still waiting in an outbox is replaced by this one
+        assertp(pthread_rwlock_rdlock(&g.subscribers_lock) == 0);
+        for (auto &pair : g.subscribers) {
+            __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+            if (!work_queue_put(pair.second->outbox, snapshot)) {
+                state_snapshot_release(snapshot);
+            }
+        }
+        pthread_rwlock_unlock(&g.subscribers_lock);
+        state_snapshot_release(snapshot);
 
-        char *buffer = (char *) calloc(1, qs.length() + sgxt_str.length() + BUFFER_SIZE);
-        state = state && buffer != nullptr;
-        if (state) {
-            uint written = 0;
-            written += sprintf(buffer, R"({"data":{"queue": )");
-            strcat(buffer + written, qs.c_str());
-            written += qs.length();
-            strcat(buffer + written, R"(, "sgx_table": )");
-            strcat(buffer + written, sgxt_str.c_str());
-            written += sgxt_str.length();
-            strcat(buffer + written, "}}");
+        for (auto &loop : event_loops) {
+            socket_reactor_wake(loop.reactor);
         }
+    }
 
-        size_t len = strlen(buffer);
+    pthread_exit(nullptr);
+}
 
-        if (state) {
-            std::queue<pthread_t *> q;
-
-            assertp(pthread_rwlock_rdlock(&g.secondary_socket_comms_lock) == 0);
-            for (auto pair = g.secondary_socket_comms.begin(); pair != g.secondary_socket_comms.end(); pair++) {
-                auto thread = (pthread_t *) queue_front_and_pop(threads_queue);
-                auto ptr_lst = (void **) calloc(3, sizeof(void *));
-                ptr_lst[0] = (*pair).second;
-                ptr_lst[1] = buffer;
-                ptr_lst[2] = (void *) len;
-                delegate_thread_to_function(thread, (void *) ptr_lst, asyncronous_send_message, false);
-                q.push(thread);
-            }
-            pthread_rwlock_unlock(&g.secondary_socket_comms_lock);
+/*
+ * The framing of a socket is only known once the node sent something, it is guessed like SOCKET_FRAMING_AUTO does
+ * from the bytes already received, or else the length-prefixed framing of the nodes is used
+ */
+static void guess_framing(socket_t *soc) {
+    if (soc->framing != SOCKET_FRAMING_AUTO) return;
 
-            while(!q.empty()) {
-                pthread_join(*q.front(), nullptr);
-                q.pop();
-            }
-        }
+    char first;
+    ssize_t r = recv(soc->socket_descriptor, &first, 1, MSG_PEEK | MSG_DONTWAIT);
+    socket_set_framing(soc, r == 1 && first == '{' ? SOCKET_FRAMING_TERMINATOR : SOCKET_FRAMING_LENGTH);
+}
 
-        free(buffer);
-    } while (ret == 0);
+/* Returns NULL, after destroying the socket, when the connection can't be served */
+static struct connection *connection_constructor(socket_t *new_socket) {
+    if (__atomic_load_n(&active_connections, __ATOMIC_RELAXED) >= MAX_NODES) {
+        WARN("Too many connections (%d), rejecting socket %d\n", active_connections, new_socket->socket_descriptor);
 
-    pthread_exit(nullptr);
+        guess_framing(new_socket); // the refusal has to be readable by the node
+        const char *p = R"({"status":"busy"})";
+        socket_send_message(new_socket, (void *) p, strlen(p));
+        socket_destructor(new_socket);
+        return nullptr;
+    }
+
+    auto c = (struct connection *) calloc(1, sizeof(struct connection));
+    if (c != nullptr) c->arena = arena_constructor(ARENA_BLOCK_SIZE);
+    if (c == nullptr || c->arena == nullptr || !socket_set_nonblocking(new_socket, 1) ||
+        !socket_enable_tx_buffer(new_socket)) {
+        ERROR("Could not prepare socket %d for an event loop\n", new_socket->socket_descriptor);
+        if (c != nullptr && c->arena != nullptr) arena_destructor(c->arena);
+        free(c);
+        socket_destructor(new_socket);
+        return nullptr;
+    }
+
+    c->socket = new_socket;
+    __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+/* The connection is served by the loop until it is closed */
+static void serve_connection(struct event_loop *loop, struct connection *c) {
+    if (!socket_reactor_add(loop->reactor, c->socket, SOCKET_EVENT_READ | SOCKET_EVENT_WRITE, c)) {
+        ERROR("Could not register socket %d in an event loop\n", c->socket->socket_descriptor);
+        destroy_connection(c);
+    }
+}
+
+/* For the connections that are not accepted by an event loop */
+static struct event_loop *next_event_loop() {
+    static uint next_loop = 0;
+    return &event_loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % event_loops.size()];
 }
 
-static void *process_secondary_node_addition(void *arg) {
-    auto *curr_thread = (struct thread_tuple *) arg;
-    auto *socket = (socket_t *) curr_thread->data;
+/* The secondary socket of a node only receives the notifications, it is served by an event loop once registered */
+static void process_secondary_node_addition(void *arg) {
+    auto *socket = (socket_t *) arg;
 
     char *buffer = nullptr;
     size_t len;
     int state = socket_get_message(socket, (void **) &buffer, &len) > 0;
 
     json_value *json = nullptr;
+    json_value *json_nodeid = nullptr;
+    uint node_id = 0;
 
-    state = state && check_json_compliance(buffer, len);
     if (state) {
-        json = json_parse(buffer, len);
+        json = poet_parse_message(buffer, len);
         state = json != nullptr;
-        json_value *json_nodeid = nullptr;
         if (state) {
-            json_nodeid = find_value(json, "node_id");
+            json_nodeid = find_member(json, "node_id");
             state = json_nodeid != nullptr && json_nodeid->type == json_integer;
         }
 
         if (state) {
-            uint node_id = json_nodeid->u.integer;
+            node_id = json_nodeid->u.integer;
             if (g.current_id <= node_id) { // invalid id
                 ERR("invalid node id: (current_id) %u <= (node_id) %u\n", g.current_id, node_id);
                 state = 0;
             }
-            // will only add it if it is a valid id
-            if (state)  {
-                assertp(pthread_rwlock_wrlock(&g.secondary_socket_comms_lock) == 0);
-                g.secondary_socket_comms[node_id] = socket;
-                pthread_rwlock_unlock(&g.secondary_socket_comms_lock);
-                const char *p = R"({"status":"success"})";
-                socket_send_message(socket, (void *) p, strlen(p));
-                ERR("Adds node %u into secondary socket message list on socket %d\n", node_id, socket->socket_descriptor);
-            } else {
-                const char *p = R"({"status":"failure"})";
-                socket_send_message(socket, (void *) p, strlen(p));
-            }
         }
     }
 
-    if (!state) {
-        socket_close(socket);
-    }
-
     json_value_free(json);
     if (buffer != nullptr) {
         free(buffer);
     }
 
-    queue_push(threads_queue, curr_thread->thread);
-    free(curr_thread);
+    // will only add it if it is a valid id
+    if (!state) {
+        const char *p = R"({"status":"failure"})";
+        if (!socket->is_closed) socket_send_message(socket, (void *) p, strlen(p));
+        socket_destructor(socket);
+        return;
+    }
 
-    pthread_exit(nullptr);
+    struct connection *c = connection_constructor(socket);
+    if (c == nullptr) return;
+
+    state = poet_subscribe_node(&c->context, node_id, SOCKET_CHANNEL_DEFAULT);
+    const char *p = state ? R"({"status":"success"})" : R"({"status":"failure"})";
+    socket_send_message(socket, (void *) p, strlen(p));
+    if (!state) {
+        destroy_connection(c);
+        return;
+    }
+
+    ERR("Adds node %u into secondary socket message list on socket %d\n", node_id, socket->socket_descriptor);
+    serve_connection(next_event_loop(), c);
 }
 
-/**
- * Checks new connections on recently added nodes, it delegates to another thread so it doesn't block new connections
- * @param _
- * @return
- */
-static void *secondary_socket_sentinel(void *_) {
-    ERR("Started to listen on secondary socket\n");
+/* Local connections have no listener per loop, they are spread over the loops by the accepting thread */
+static void accept_local_connection(socket_t *new_socket) {
+    struct connection *c = connection_constructor(new_socket);
+    if (c != nullptr) serve_connection(next_event_loop(), c);
+}
+
+/* New connections on recently added nodes are delegated to the job threads so they don't block new connections */
+static void accept_secondary_connection(socket_t *new_socket) {
+    ERR("Received new connection on secondary socket %d\n", new_socket->socket_descriptor);
+
+    if (!submit_job(process_secondary_node_addition, new_socket)) {
+        socket_destructor(new_socket);
+    }
+}
+
+struct listener {
+    socket_t *socket;
+    void (*on_accept)(socket_t *);
+};
+
+/* Accepts the connections of the listeners not owned by an event loop until the termination signal */
+static void accept_connections() {
+    struct listener listeners[] = {{g.secondary_socket, accept_secondary_connection},
+                                   {g.local_socket,     accept_local_connection}};
+    socket_reactor_t *reactor;
+    assertp((reactor = socket_reactor_constructor()) != nullptr);
+    for (auto &l : listeners) {
+        assertp(socket_set_nonblocking(l.socket, 1));
+        assertp(socket_reactor_add(reactor, l.socket, SOCKET_EVENT_READ, &l));
+    }
+
+    socket_event_t events[REACTOR_EVENTS];
     while (received_termination_signal() == FALSE) {
-        int state = socket_select(g.secondary_socket);
-        if (!state) {
-            printf(",");
+        int n = socket_reactor_wait(reactor, events, REACTOR_EVENTS, REACTOR_TIMEOUT);
+        if (n == 0) {
+            printf(".");
             continue;
         }
 
-        socket_t *new_socket = socket_accept(g.secondary_socket);
+        for (int i = 0; i < n && received_termination_signal() == FALSE; i++) {
+            auto l = (struct listener *) events[i].data;
 
-        ERR("Received new connection on secondary socket %d\n", new_socket->socket_descriptor);
-
-        auto thread = (pthread_t *) queue_front_and_pop(threads_queue);
-        delegate_thread_to_function(thread, new_socket, process_secondary_node_addition);
+            // edge triggered, every pending connection is accepted
+            socket_t *new_socket;
+            while ((new_socket = socket_accept(l->socket)) != nullptr) {
+                l->on_accept(new_socket);
+            }
+        }
     }
+
+    socket_reactor_destructor(reactor);
 }
 
 int main(int argc, char *argv[]) {
@@ -423,21 +782,34 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, signal_callback_handler);
     global_variables_initialization();
     set_global_constants();
+    set_notification_coalescing(argc, argv);
 
-    ERRR("queue: %p | server_socket: %p\n", queue, server_socket);
+    ERRR("queue: %p | event loops: %lu\n", g.queue, event_loops.size());
 
-    if (socket_listen(g.server_socket, MAX_CONNECTIONS) != FALSE) {
-        goto error;
+    for (auto &loop : event_loops) {
+        if (socket_listen(loop.listener, MAX_CONNECTIONS) != FALSE) {
+            goto error;
+        }
+        assertp(socket_set_nonblocking(loop.listener, 1));
+        assertp(socket_reactor_add(loop.reactor, loop.listener, SOCKET_EVENT_READ, &loop));
     }
 
     if (socket_listen(g.secondary_socket, MAX_CONNECTIONS) != FALSE) {
         goto error;
     }
+
+    if (socket_listen(g.local_socket, MAX_CONNECTIONS) != FALSE) {
+        goto error;
+    }
     INFO("Starting to listen\n");
 
-    pthread_t secondary_socket_thread;
-    assertp(pthread_create(&secondary_socket_thread, nullptr, secondary_socket_sentinel, nullptr) == 0);
-    pthread_detach(secondary_socket_thread);
+    for (auto &loop : event_loops) {
+        assertp(delegate_thread_to_function(&loop.thread, &loop, event_loop_worker) == 0);
+    }
+
+    for (int i = 0; i < JOB_THREADS; i++) {
+        assertp(delegate_thread_to_function(job_threads + i, nullptr, job_worker) == 0);
+    }
 
     pthread_t sgx_table_and_queue_notification_thread;
     assertp(pthread_create(&sgx_table_and_queue_notification_thread, nullptr, sgx_table_and_queue_notification, nullptr) == 0);
@@ -446,32 +818,7 @@ int main(int argc, char *argv[]) {
 
     /* ************************ */
 
-    while (received_termination_signal() == FALSE) {
-        int state = socket_select(g.server_socket);
-        if (!state) {
-            printf(".");
-            continue;
-        }
-
-        socket_t *new_socket = socket_accept(g.server_socket);
-
-        while(queue_is_empty(threads_queue)) {
-            WARN("The thread queue is empty, waiting until a thread finishes and gets added again into the queue.\n");
-            queue_wait_change_timed(threads_queue, {1, 0});
-        }
-
-        if (received_termination_signal() != FALSE) {
-            break;
-        }
-
-        auto *next_thread = (pthread_t *) queue_front_and_pop(threads_queue);
-        int error = delegate_thread_to_function(next_thread, new_socket, process_new_node);
-        if (error != FALSE) {
-            perror("thread creation");
-            ERROR("A thread could not be created: %p(0x%lx) (error code: %d)\n", next_thread, *next_thread, error);
-            exit(EXIT_FAILURE);
-        }
-    }
+    accept_connections();
 
     global_variables_destruction();
     return EXIT_SUCCESS;
@@ -14,12 +14,52 @@
 #include <zconf.h>
 
 #define POET_PREFIX(X) poet_ ## X
-#define FUNC_PAIR(NAME)  { #NAME, POET_PREFIX(NAME) }
+#define POET_BINARY_PREFIX(X) poet_binary_ ## X
+#define FUNC_PAIR(NAME)  { #NAME, POET_PREFIX(NAME), nullptr }
+#define FUNC_TRIPLE(NAME)  { #NAME, POET_PREFIX(NAME), POET_BINARY_PREFIX(NAME) }
 
 const struct timespec LOCK_TIMEOUT = {5, 0};
+const struct timespec NO_WAIT = {0, 0};
 
 extern struct global g;
 
+#define MAX_RESPONSE_PARTS 8
+
+/* Sends the response of the request being handled, echoing its "id" so that the node can match it with the request */
+static int send_response_iov(socket_t *socket, poet_context *context, struct iovec *parts, int nparts) {
+    if (context->request_id < 0) return socket_send_message_iov(socket, parts, nparts, 0);
+
+    assert(0 < nparts && nparts < MAX_RESPONSE_PARTS);
+    assert(parts[0].iov_len > 0 && *(char *) parts[0].iov_base == '{');
+
+    char id[32];
+    struct iovec response[MAX_RESPONSE_PARTS];
+    response[0] = {id, (size_t) sprintf(id, R"({"id": %ld, )", context->request_id)};
+    response[1] = {(char *) parts[0].iov_base + 1, parts[0].iov_len - 1}; // the members after the opening brace
+    memcpy(response + 2, parts + 1, (nparts - 1) * sizeof(struct iovec));
+    return socket_send_message_iov(socket, response, nparts + 1, 0);
+}
+
+static int send_response(socket_t *socket, poet_context *context, const char *msg) {
+    struct iovec part = {(void *) msg, strlen(msg)};
+    return send_response_iov(socket, context, &part, 1);
+}
+
+/* Response of a binary request: the status and the id of the request before the payload */
+int poet_binary_response(socket_t *socket, poet_context *context, uint8_t status, const struct iovec *parts,
+                         int nparts) {
+    assert(0 <= nparts && nparts < MAX_RESPONSE_PARTS);
+
+    uint8_t header[1 + VARINT_MAX_SIZE];
+    header[0] = status;
+    size_t header_len = 1 + put_varint(header + 1, context->request_id >= 0 ? (uint64_t) context->request_id : 0);
+
+    struct iovec response[MAX_RESPONSE_PARTS];
+    response[0] = {header, header_len};
+    if (nparts > 0) memcpy(response + 1, parts, nparts * sizeof(struct iovec));
+    return socket_send_message_iov(socket, response, nparts + 1, 0);
+}
+
 std::map<std::string, uint> public_keys;
 pthread_rwlock_t public_keys_lock = PTHREAD_RWLOCK_INITIALIZER;
 
@@ -109,26 +149,33 @@ int POET_PREFIX(register)(json_value *json, socket_t *socket, poet_context *cont
     char *pk_64base = nullptr;
     size_t pk_64base_len = 0;
     json_value *sign_json = nullptr;
+    json_value *encoding_json = nullptr;
     if (context->node == nullptr) context->node = (node_t *) calloc(1, sizeof(node_t));
 
     ERR("Register method is called.\n");
 
     /**************************************/
 
-    json_value *pk_json = find_value(json, "public_key");
+    json_value *pk_json = find_member(json, "public_key");
     if (pk_json == nullptr || pk_json->type != json_string) {
         ERROR("public key from node is not valid or is not present\n");
         goto error;
     }
     pk_64base = pk_json->u.string.ptr;
 
-    sign_json = find_value(json, "signature");
+    sign_json = find_member(json, "signature");
     if (sign_json == nullptr || sign_json->type != json_string) {
         ERROR("signature from node is not valid or is not present\n");
         goto error;
     }
     sign_64base = sign_json->u.string.ptr;
 
+    encoding_json = find_member(json, "encoding"); // the binary encoding needs the length framing
+    if (encoding_json != nullptr && encoding_json->type == json_string &&
+        strcmp(encoding_json->u.string.ptr, "binary") == 0 && socket->framing == SOCKET_FRAMING_LENGTH) {
+        context->encoding = POET_ENCODING_BINARY;
+    }
+
     if (check_public_key_and_signature_registration(std::string(pk_64base), std::string(sign_64base), context)) {
         bool locked = true;
         locked = rwlock_timedrdlocks(&LOCK_TIMEOUT, &g.current_id_lock, &public_keys_lock);
@@ -150,11 +197,12 @@ int POET_PREFIX(register)(json_value *json, socket_t *socket, poet_context *cont
 
     msg = (char *) malloc(BUFFER_SIZE);
     sprintf(msg,
-            R"({"status":"success", "data": {"sgxmax" : %lu, "sgxt_lower": %lu, "node_id" : %u, "n_tiers": %u, "server_starting_time": %lu}})",
+            R"({"status":"success", "data": {"sgxmax" : %lu, "sgxt_lower": %lu, "node_id" : %u, "n_tiers": %u, "server_starting_time": %lu, "encoding": "%s"}})",
             g.sgxmax,
-            g.sgxt_lowerbound, context->node->node_id, g.n_tiers, g.server_starting_time);
+            g.sgxt_lowerbound, context->node->node_id, g.n_tiers, g.server_starting_time,
+            context->encoding == POET_ENCODING_BINARY ? "binary" : "json");
     ERR("Server is sending sgxmax (%lu) to the node\n", g.sgxmax);
-    socket_send_message(socket, msg, strlen(msg));
+    send_response(socket, context, msg);
     free(msg);
 
     goto terminate;
@@ -180,8 +228,7 @@ int POET_PREFIX(remote_attestation)(json_value *json, socket_t *socket, poet_con
     state = state && buffer != nullptr;
     if (state) {
         sprintf(buffer, R"({"status":"success"})");
-        size_t len = strlen(buffer);
-        state = socket_send_message(socket, buffer, len) > 0;
+        state = send_response(socket, context, buffer) > 0;
         free(buffer);
     }
 #else
@@ -194,39 +241,37 @@ int POET_PREFIX(remote_attestation)(json_value *json, socket_t *socket, poet_con
     return state;
 }
 
-std::map<void *, int> repetitions;
-
-int queue_delete_continuous_nodes(int first, void *d) {
-    static void *previous;
-    if (first) {
-        previous = d;
-        repetitions.clear();
-        repetitions[d] = 1;
-        return 0;
+/* Must be called with sgx_table_lock, the changes made until the next call belong to the new version */
+static struct state_change &state_change_begin() {
+    g.state_log.emplace_back();
+    g.state_log.back().version = ++g.state_version;
+    if (g.state_log.size() > STATE_LOG_VERSIONS) {
+        g.state_log.pop_front();
     }
 
-    repetitions[d]++;
-
-    if (previous == d) {
-        assert(repetitions[d] > 1);
-        repetitions[d]--;
-        return 1;
-    }
+    return g.state_log.back();
+}
 
-    previous = d;
-    return 0;
+/* The queue operations are recorded so the subscribers can replay them, the queue must be locked */
+static void state_queue_push(struct state_change &change, uint node_id) {
+    queue_push_custom(g.queue, (void *) (long) node_id, 0, 0);
+    change.queue_ops.push_back((int) node_id);
 }
 
-int queue_delete_repeated_nodes(int _, void *d) {
-    if (repetitions[d] > 1) {
-        repetitions[d]--;
-        return 1;
+/* The whole batch is pushed in one call, only the ids that made it into the queue are recorded */
+static void state_queue_push_n(struct state_change &change, std::vector<void *> &node_ids) {
+    size_t pushed = queue_push_n_custom(g.queue, node_ids.data(), node_ids.size(), 0, 0);
+    for (size_t i = 0; i < pushed; i++) {
+        change.queue_ops.push_back((int) (long) node_ids[i]);
     }
+}
 
-    return 0;
+static void state_queue_pop(struct state_change &change) {
+    queue_pop_custom(g.queue, 0, 0);
+    change.queue_ops.push_back(QUEUE_OP_POP);
 }
 
-static bool queue_cleanup(bool lock = true) {
+static bool queue_cleanup(struct state_change &change, bool lock = true) {
     if (lock) {
         struct timespec t = {5, 0};
         assertp(rwlock_rwlocks(g.queue->lock));
@@ -269,10 +314,12 @@ static bool queue_cleanup(bool lock = true) {
 //            }
 //        }
 
-        queue_pop_custom(g.queue, 0, 0);
-        int deleted = queue_selective_remove(g.queue, queue_delete_continuous_nodes, 0, 0);
-        deleted += queue_selective_remove(g.queue, queue_delete_repeated_nodes, 0, 0);
+        state_queue_pop(change);
+        g.queue_seen_nodes.resize(g.sgx_table.size()); // node ids are indexes of the table
+        int deleted = queue_remove_repeated_nodes(g.queue, 0, g.queue_seen_nodes);
+        change.queue_ops.push_back(QUEUE_OP_DEDUP);
         ERR("deleted %d elements from the queue\n", deleted);
+        (void) deleted; // only logged
     } else {
         WARN("SGXtable is empty\n");
     }
@@ -300,6 +347,7 @@ static bool insert_node_into_sgx_table_and_queue(node_t &node) {
     assertp(state = mutex_locks(&g.sgx_table_lock, g.queue->cond.cond_mutex));
     assertp(rwlock_rwlocks(g.queue->lock));
     if (state) {
+        struct state_change &change = state_change_begin();
         if (node.node_id < g.sgx_table.size()) {
             ERR("The node %d is already in the SGXtable\n", node.node_id);
             node_t *n = g.sgx_table[node.node_id];
@@ -309,11 +357,12 @@ static bool insert_node_into_sgx_table_and_queue(node_t &node) {
             n->arrival_time = node.arrival_time;
             n->time_left = node.time_left;
             n->n_leadership++;
+            change.nodes.push_back(node.node_id);
             if (queue_size_custom(g.queue, 0) >= g.sgx_table.size()) {
-                queue_pop_custom(g.queue, 0, 0);
+                state_queue_pop(change);
             }
-            queue_push_custom(g.queue, (void *) node.node_id, 0, 0);
-            queue_cleanup(false);
+            state_queue_push(change, node.node_id);
+            queue_cleanup(change, false);
             queue_broadcast(g.queue);
         } else {
             auto new_node = (node_t *) calloc(1, sizeof(node_t));
@@ -321,8 +370,9 @@ static bool insert_node_into_sgx_table_and_queue(node_t &node) {
             memcpy(new_node, &node, sizeof(node_t));
             g.sgx_table.push_back(new_node);
             assert(g.sgx_table.back() == new_node);
-            queue_push_custom(g.queue, (void *) node.node_id, 0, 0);
-            queue_cleanup(false);
+            change.nodes.push_back(g.sgx_table.size() - 1);
+            state_queue_push(change, node.node_id);
+            queue_cleanup(change, false);
             queue_broadcast(g.queue);
             ERR("Inserted node (ID: %u, SGXt: %u, At: %u, TL: %u, NOL: %u) into the SGX table and Queue\n",
                 node.node_id,
@@ -338,12 +388,14 @@ static bool insert_node_into_sgx_table_and_queue(node_t &node) {
                 rt_sum += g.sgx_table[i]->time_left;
             }
 
+            std::vector<void *> missing;
             for (int i = 0; i < g.sgx_table.size(); i++) {
                 if (v.count(i) == 0 && g.sgx_table[i]->arrival_time) { /* Fills the queue with missing elements */
-                    queue_push_custom(g.queue, (void *) i, 0, 0);
+                    missing.push_back((void *) (long) i);
                     ERR("Node %d is missing from the Queue\n", i);
                 }
             }
+            state_queue_push_n(change, missing);
         }
     } else {
         perror("insert_node_into_sgx_table_and_queue");
@@ -366,6 +418,24 @@ static std::string get_quantum_times() {
     return "[]"; // TODO complete
 }
 
+/* Checks the SGXt received from the node and adds the node into the sgx table and the queue */
+static bool add_sgx_time(poet_context *context, uint sgxt) {
+    bool state = g.sgxt_lowerbound <= sgxt && sgxt <= g.sgxmax;
+    ERR("SGXt is%s valid: %s (%u)\n", (state ? "" : " not"), (state ? "true" : "false"), sgxt);
+
+    if (state) {
+        node_t &node = *(context->node);
+        node.arrival_time = time(nullptr) - g.server_starting_time;
+//        node.arrival_time = 0;
+        node.n_leadership = 0;
+        node.sgx_time = sgxt;
+        node.time_left = sgxt;
+        state = insert_node_into_sgx_table_and_queue(node);
+    }
+
+    return state;
+}
+
 int POET_PREFIX(sgx_time_broadcast)(json_value *json, socket_t *socket, poet_context *context) {
     assert(json != nullptr);
     assert(socket != nullptr);
@@ -375,7 +445,7 @@ int POET_PREFIX(sgx_time_broadcast)(json_value *json, socket_t *socket, poet_con
     uint sgxt = 0;
     bool state = true;
 
-    json_value *json_sgxt = find_value(json, "sgxt");
+    json_value *json_sgxt = find_member(json, "sgxt");
     if (json_sgxt == nullptr || json_sgxt->type != json_integer) {
         state = false;
     }
@@ -385,18 +455,7 @@ int POET_PREFIX(sgx_time_broadcast)(json_value *json, socket_t *socket, poet_con
         ERR("SGXt is received and checking the validity.\n");
     }
 
-    state = state && (g.sgxt_lowerbound <= sgxt && sgxt <= g.sgxmax);
-    ERR("SGXt is%s valid: %s (%u)\n", (state ? "" : " not"), (state ? "true" : "false"), sgxt);
-
-    if (state) {
-        node_t &node = *(context->node);
-        node.arrival_time = time(nullptr) - g.server_starting_time;
-//        node.arrival_time = 0;
-        node.n_leadership = 0;
-        node.sgx_time = sgxt;
-        node.time_left = sgxt;
-        state = insert_node_into_sgx_table_and_queue(node);
-    }
+    state = state && add_sgx_time(context, sgxt);
 
     if (state) {
         node_t &node = *(context->node);
@@ -417,13 +476,35 @@ int POET_PREFIX(sgx_time_broadcast)(json_value *json, socket_t *socket, poet_con
         sprintf(msg, R"({"status":"failure"})");
     }
 
-    socket_send_message(socket, msg, strlen(msg));
+    send_response(socket, context, msg);
     free(msg);
     msg = nullptr;
 
     return state;
 }
 
+/* The payload is the varint SGXt, the response has the number of nodes and of tiers */
+int POET_BINARY_PREFIX(sgx_time_broadcast)(const uint8_t *payload, size_t len, socket_t *socket,
+                                           poet_context *context) {
+    assert(socket != nullptr);
+    assert(context != nullptr);
+
+    uint64_t sgxt = 0;
+    const uint8_t *p = payload;
+    bool state = get_varint(&p, payload + len, &sgxt) && sgxt <= UINT32_MAX;
+    state = state && add_sgx_time(context, (uint) sgxt);
+
+    std::string data;
+    if (state) {
+        append_varint(data, g.current_id);
+        append_varint(data, g.n_tiers);
+    }
+    struct iovec part = {(void *) data.data(), data.length()};
+    poet_binary_response(socket, context, state ? POET_STATUS_SUCCESS : POET_STATUS_FAILURE, &part, 1);
+
+    return state;
+}
+
 std::string get_sgx_table_str(bool lock = true) {
     std::string sgx_table_str = "[";
 
@@ -460,27 +541,16 @@ int POET_PREFIX(get_sgxtable)(json_value *json, socket_t *socket, poet_context *
     bool state = true;
     std::string str = std::move(get_sgx_table_str());
 
-    char *buffer = (char *) malloc(str.length() + BUFFER_SIZE);
-    state = buffer != nullptr;
-
-    if (state) {
-        uint written = 0;
-        written += sprintf(buffer, R"({"status":"success", "data":{"sgx_table": )");
-        strcat(buffer + written, str.c_str());
-        written += str.length();
-        strcat(buffer + written, "}}");
-    }
-
-    state = state && (socket_send_message(socket, buffer, strlen(buffer)) > 0);
+    struct iovec parts[] = {SOCKET_IOV_LITERAL(R"({"status":"success", "data":{"sgx_table": )"),
+                            {(void *) str.data(), str.length()},
+                            SOCKET_IOV_LITERAL("}}")};
+    state = send_response_iov(socket, context, parts, 3) > 0;
 
     if (!state) {
         int node_id = (context->node != nullptr) ? (int) context->node->node_id : -1;
         WARN("Could not send sgx_table to node %d.\n", node_id);
     }
 
-    if (buffer != nullptr) {
-        free(buffer);
-    }
     return state;
 }
 
@@ -536,29 +606,38 @@ int POET_PREFIX(get_queue)(json_value *json, socket_t *socket, poet_context *con
     bool state = true;
 
     std::string s = std::move(get_queue_str());
-    char *buffer = (char *) malloc(s.length() + BUFFER_SIZE);
-    state = buffer != nullptr;
-    if (state) {
-        uint written = 0;
-        written += sprintf(buffer, R"({"status":"success", "data":{"queue": )");
-        strcat(buffer + written, s.c_str());
-        written += s.length();
-        strcat(buffer + written, "}}");
-    }
-    state = state && socket_send_message(socket, buffer, strlen(buffer)) > 0;
+    struct iovec parts[] = {SOCKET_IOV_LITERAL(R"({"status":"success", "data":{"queue": )"),
+                            {(void *) s.data(), s.length()},
+                            SOCKET_IOV_LITERAL("}}")};
+    state = send_response_iov(socket, context, parts, 3) > 0;
 
     if (!state) {
         uint node_id = (context->node != nullptr) ? context->node->node_id : -1;
-        ERROR("Could not send queue to node %u, buffer length: %lu\n", node_id, strlen(buffer));
-    }
-
-    if (buffer != nullptr) {
-        free(buffer);
+        ERROR("Could not send queue to node %u, queue length: %lu\n", node_id, s.length());
     }
 
     return state;
 }
 
+static void copy_queue_ids(void *node_ptr, void *ids_ptr) {
+    ((std::vector<uint> *) ids_ptr)->push_back((uint) ((long long) node_ptr));
+}
+
+/* The version, the queue and the rows of the sgx table in the binary encoding, must be called with sgx_table_lock */
+static std::string get_state_binary() {
+    std::vector<uint> ids;
+    queue_print_func_dump(g.queue, copy_queue_ids, &ids);
+
+    std::string s;
+    append_varint(s, g.state_version);
+    append_varint(s, ids.size());
+    for (uint id : ids) append_varint(s, id);
+    append_varint(s, g.sgx_table.size());
+    for (node_t *node : g.sgx_table) append_node_record(s, *node);
+
+    return s;
+}
+
 int POET_PREFIX(get_sgxtable_and_queue)(json_value *json, socket_t *socket, poet_context *context) {
     assert(json != nullptr);
     assert(socket != nullptr);
@@ -570,35 +649,53 @@ int POET_PREFIX(get_sgxtable_and_queue)(json_value *json, socket_t *socket, poet
     if (!state) {
         perror("poet_get_sgxtable_and_queue");
     }
+    std::string header = state ? R"({"status":"success", "data":{"version": )" + std::to_string(g.state_version) +
+                                 R"(, "queue": )" : "";
     std::string qs = state ? std::move(get_queue_str()) : "";
     std::string sgxt_str = state ? std::move(get_sgx_table_str(false)) : "";
     if (state) pthread_mutex_unlock(&g.sgx_table_lock);
 
-    char *buffer = (char *) malloc(qs.length() + sgxt_str.length() + BUFFER_SIZE);
-    state = state && buffer != nullptr;
     if (state) {
-        uint written = 0;
-        written += sprintf(buffer, R"({"status":"success", "data":{"queue": )");
-        strcat(buffer + written, qs.c_str());
-        written += qs.length();
-        strcat(buffer + written, R"(, "sgx_table": )");
-        strcat(buffer + written, sgxt_str.c_str());
-        written += sgxt_str.length();
-        strcat(buffer + written, "}}");
+        struct iovec parts[] = {{(void *) header.data(), header.length()},
+                                {(void *) qs.data(), qs.length()},
+                                SOCKET_IOV_LITERAL(R"(, "sgx_table": )"),
+                                {(void *) sgxt_str.data(), sgxt_str.length()},
+                                SOCKET_IOV_LITERAL("}}")};
+        state = send_response_iov(socket, context, parts, 5) > 0;
     } else {
         char sbuffer[BUFFER_SIZE];
         sprintf(sbuffer, R"({"status":"failure"})");
-        socket_send_message(socket, sbuffer, strlen(sbuffer));
+        send_response(socket, context, sbuffer);
     }
-    state = state && socket_send_message(socket, buffer, strlen(buffer)) > 0;
 
     if (!state) {
-        uint node_id = (context->node != nullptr) ? context->node->node_id : -1;
-        ERROR("Could not send queue and sgx table to node, buffer length: %lu\n", strlen(buffer));
+        ERROR("Could not send queue and sgx table to node, message length: %lu\n", qs.length() + sgxt_str.length());
     }
 
-    if (buffer != nullptr) {
-        free(buffer);
+    return state;
+}
+
+/* The response has the whole state, as in the POET_NOTIFICATION_FULL notifications */
+int POET_BINARY_PREFIX(get_sgxtable_and_queue)(const uint8_t *payload, size_t len, socket_t *socket,
+                                               poet_context *context) {
+    assert(socket != nullptr);
+    assert(context != nullptr);
+
+    std::string data;
+    bool state = pthread_mutex_timedlock(&g.sgx_table_lock, &LOCK_TIMEOUT) == 0;
+    if (state) {
+        data = std::move(get_state_binary());
+        pthread_mutex_unlock(&g.sgx_table_lock);
+    } else {
+        perror("poet_binary_get_sgxtable_and_queue");
+    }
+
+    struct iovec part = {(void *) data.data(), data.length()};
+    state = poet_binary_response(socket, context, state ? POET_STATUS_SUCCESS : POET_STATUS_FAILURE, &part, 1) > 0 &&
+            state;
+
+    if (!state) {
+        ERROR("Could not send queue and sgx table to node, message length: %lu\n", data.length());
     }
 
     return state;
@@ -615,7 +712,7 @@ int POET_PREFIX(close_connection)(json_value *json, socket_t *socket, poet_conte
     state = buffer != nullptr;
     if (state) {
         sprintf(buffer, R"({"status":"success"})");
-        state = socket_send_message(socket, buffer, strlen(buffer)) > 0;
+        state = send_response(socket, context, buffer) > 0;
     }
 
     socket_close(socket);
@@ -627,20 +724,13 @@ int POET_PREFIX(close_connection)(json_value *json, socket_t *socket, poet_conte
     return state;
 }
 
-int POET_PREFIX(unfinished_node)(json_value *json, socket_t *socket, poet_context *context) {
-    assert(json != nullptr);
-    assert(socket != nullptr);
-    assert(context != nullptr);
-
+/* Updates the time left of a node that did not finish its turn and puts it back at the end of the queue */
+static bool readd_unfinished_node(const node_t &new_node) {
     bool state = true;
 
-    node_t new_node{};
-
-    state = json_to_node_t(json, &new_node);
-
     assertp(mutex_locks(&g.sgx_table_lock, g.queue->cond.cond_mutex));
     assertp(rwlock_rwlocks(g.queue->lock));
-    if (state && new_node.node_id < g.sgx_table.size()) {
+    if (new_node.node_id < g.sgx_table.size()) {
         node_t *dest = g.sgx_table[new_node.node_id];
         assert(dest != nullptr);
 
@@ -648,8 +738,10 @@ int POET_PREFIX(unfinished_node)(json_value *json, socket_t *socket, poet_contex
         assert(dest->arrival_time != new_node.arrival_time || dest->time_left >= new_node.time_left);
         if (dest->sgx_time == new_node.sgx_time && dest->arrival_time == new_node.arrival_time) {
             dest->time_left = new_node.time_left;
-            queue_cleanup(false);
-            queue_push_custom(g.queue, (void *) dest->node_id, 0, 0);
+            struct state_change &change = state_change_begin();
+            change.nodes.push_back(new_node.node_id);
+            queue_cleanup(change, false);
+            state_queue_push(change, dest->node_id);
         } else {
             state = false;
         }
@@ -662,6 +754,21 @@ int POET_PREFIX(unfinished_node)(json_value *json, socket_t *socket, poet_contex
 
     if (state) queue_broadcast(g.queue);
 
+    return state;
+}
+
+int POET_PREFIX(unfinished_node)(json_value *json, socket_t *socket, poet_context *context) {
+    assert(json != nullptr);
+    assert(socket != nullptr);
+    assert(context != nullptr);
+
+    bool state = true;
+
+    node_t new_node{};
+
+    state = json_to_node_t(json, &new_node);
+    state = state && readd_unfinished_node(new_node);
+
     const char *msg = nullptr;
     if (state) {
         msg = R"({"status": "success"})";
@@ -669,18 +776,227 @@ int POET_PREFIX(unfinished_node)(json_value *json, socket_t *socket, poet_contex
         msg = R"({"status": "failure"})";
     }
 
-    socket_send_message(socket, (void *) msg, strlen(msg));
+    send_response(socket, context, msg);
+    return state;
+}
+
+/* The payload is the node_t record of the node */
+int POET_BINARY_PREFIX(unfinished_node)(const uint8_t *payload, size_t len, socket_t *socket, poet_context *context) {
+    assert(socket != nullptr);
+    assert(context != nullptr);
+
+    node_t new_node{};
+    const uint8_t *p = payload;
+    bool state = get_node_record(&p, payload + len, &new_node);
+    state = state && readd_unfinished_node(new_node);
+
+    poet_binary_response(socket, context, state ? POET_STATUS_SUCCESS : POET_STATUS_FAILURE, nullptr, 0);
+    return state;
+}
+
+
+/*
+ * Multiplexed mode: the notifications are pushed on the SOCKET_CHANNEL_NOTIFICATIONS channel of this connection, so
+ * the node needs neither the secondary connection nor its node id handshake
+ */
+int POET_PREFIX(subscribe)(json_value *json, socket_t *socket, poet_context *context) {
+    assert(json != nullptr);
+    assert(socket != nullptr);
+    assert(context != nullptr);
+
+    bool state = context->node != nullptr && socket->framing == SOCKET_FRAMING_LENGTH;
+    state = state && poet_subscribe_node(context, context->node->node_id, SOCKET_CHANNEL_NOTIFICATIONS);
+    if (state) {
+        ERR("Node %u subscribed on socket %d\n", context->node->node_id, socket->socket_descriptor);
+    }
+
+    const char *msg = state ? R"({"status": "success"})" : R"({"status": "failure"})";
+    send_response(socket, context, msg);
     return state;
 }
 
+/* Shows how many changes of the state each notification covered and how many were replaced before being sent */
+int POET_PREFIX(get_notification_stats)(json_value *json, socket_t *socket, poet_context *context) {
+    assert(json != nullptr);
+    assert(socket != nullptr);
+    assert(context != nullptr);
+
+    uint64_t replaced = __atomic_load_n(&g.notification_stats.replaced, __ATOMIC_RELAXED);
+    size_t subscribers = 0;
+    assertp(pthread_rwlock_rdlock(&g.subscribers_lock) == 0);
+    for (auto &pair : g.subscribers) {
+        work_queue_stats_t stats;
+        work_queue_get_stats(pair.second->outbox, &stats);
+        replaced += stats.dropped;
+        subscribers++;
+    }
+    pthread_rwlock_unlock(&g.subscribers_lock);
+
+    char buffer[BUFFER_SIZE];
+    sprintf(buffer, R"({"status": "success", "data": {"broadcasts": %lu, "changes": %lu, "max_changes": %lu, )"
+                    R"("replaced": %lu, "subscribers": %lu}})",
+            (unsigned long) __atomic_load_n(&g.notification_stats.broadcasts, __ATOMIC_RELAXED),
+            (unsigned long) __atomic_load_n(&g.notification_stats.changes, __ATOMIC_RELAXED),
+            (unsigned long) __atomic_load_n(&g.notification_stats.max_changes, __ATOMIC_RELAXED),
+            (unsigned long) replaced, subscribers);
+
+    return send_response(socket, context, buffer) > 0;
+}
+
+/* The snapshots put in the outbox of the subscription have to be sent by whoever serves the connection */
+bool poet_subscribe_node(poet_context *context, uint node_id, uint32_t channel) {
+    assert(context != nullptr);
+
+    if (context->subscription != nullptr) return true;
+
+    auto subscription = new struct subscription();
+    subscription->outbox = work_queue_constructor_custom(1, WORK_QUEUE_DROP_OLDEST, state_snapshot_release);
+    if (subscription->outbox == nullptr) {
+        delete subscription;
+        return false;
+    }
+    subscription->node_id = node_id;
+    subscription->channel = channel;
+    subscription->encoding = context->encoding;
+
+    assertp(pthread_rwlock_wrlock(&g.subscribers_lock) == 0);
+    g.subscribers[node_id] = subscription; // a newer connection of the node replaces the previous one
+    pthread_rwlock_unlock(&g.subscribers_lock);
+    context->subscription = subscription;
+
+    return true;
+}
+
+/* Must be called before the connection is destroyed, the notifier fills the outboxes under the lock */
+void poet_unsubscribe(poet_context *context) {
+    assert(context != nullptr);
+
+    struct subscription *subscription = context->subscription;
+    if (subscription == nullptr) return;
+
+    assertp(pthread_rwlock_wrlock(&g.subscribers_lock) == 0);
+    auto it = g.subscribers.find(subscription->node_id);
+    if (it != g.subscribers.end() && it->second == subscription) { // not replaced by a newer connection
+        g.subscribers.erase(it);
+    }
+    pthread_rwlock_unlock(&g.subscribers_lock);
+
+    void *snapshot;
+    while (work_queue_take_timed(subscription->outbox, &snapshot, &NO_WAIT)) {
+        state_snapshot_release(snapshot);
+    }
+    work_queue_stats_t stats;
+    work_queue_get_stats(subscription->outbox, &stats);
+    __atomic_add_fetch(&g.notification_stats.replaced, stats.dropped, __ATOMIC_RELAXED);
+    work_queue_destructor(subscription->outbox, 0);
+    delete subscription;
+    context->subscription = nullptr;
+}
+
+/* Must be called with sgx_table_lock, the log has to cover every version after from */
+static void state_delta(struct state_snapshot *snapshot, uint64_t from) {
+    std::vector<uint> rows;
+    std::vector<bool> seen(g.sgx_table.size(), false);
+    std::vector<int> queue_ops;
+    std::string ops = "[";
+
+    for (auto &change : g.state_log) {
+        if (change.version <= from) continue;
+        for (int op : change.queue_ops) {
+            ops.append(std::to_string(op)).append(",");
+            queue_ops.push_back(op);
+        }
+        for (uint row : change.nodes) {
+            if (row < seen.size() && !seen[row]) { // only the last value of a row is sent
+                seen[row] = true;
+                rows.push_back(row);
+            }
+        }
+    }
+    if (ops.back() == ',') ops.pop_back();
+    ops.append("]");
+
+    std::string sgx_table = "[";
+    for (uint row : rows) {
+        sgx_table.append(node_to_json(*g.sgx_table[row])).append(",");
+    }
+    if (sgx_table.back() == ',') sgx_table.pop_back();
+    sgx_table.append("]");
+
+    std::string &binary = snapshot->binary;
+    binary.push_back(POET_NOTIFICATION_DELTA);
+    append_varint(binary, g.state_version);
+    append_varint(binary, from);
+    append_varint(binary, queue_ops.size());
+    for (int op : queue_ops) append_varint(binary, zigzag_encode(op));
+    append_varint(binary, rows.size());
+    for (uint row : rows) append_node_record(binary, *g.sgx_table[row]);
+
+    snapshot->from = from;
+    snapshot->queue = std::move(ops);
+    snapshot->sgx_table = std::move(sgx_table);
+}
+
+/*
+ * Takes the changes of the state since the version from, or the whole state when from is 0 or the log does not go
+ * back that far. The caller owns the first reference
+ */
+struct state_snapshot *state_snapshot_constructor(uint64_t from) {
+    auto snapshot = new struct state_snapshot();
+    snapshot->refs = 1;
+
+    assertp(pthread_mutex_lock(&g.sgx_table_lock) == 0);
+    snapshot->version = g.state_version;
+    bool delta = from != 0 && from <= g.state_version &&
+                 (from == g.state_version || g.state_log.front().version <= from + 1);
+    if (delta) {
+        state_delta(snapshot, from);
+    } else {
+        snapshot->from = 0;
+        snapshot->queue = std::move(get_queue_str());
+        snapshot->sgx_table = std::move(get_sgx_table_str(false));
+        snapshot->binary.push_back(POET_NOTIFICATION_FULL);
+        snapshot->binary.append(get_state_binary());
+    }
+    pthread_mutex_unlock(&g.sgx_table_lock);
+
+    if (delta) {
+        snapshot->header = R"({"data":{"version": )" + std::to_string(snapshot->version) + R"(, "from": )" +
+                           std::to_string(snapshot->from) + R"(, "queue_ops": )";
+    } else {
+        snapshot->header = R"({"data":{"version": )" + std::to_string(snapshot->version) + R"(, "queue": )";
+    }
+
+    snapshot->parts[0] = {(void *) snapshot->header.data(), snapshot->header.length()};
+    snapshot->parts[1] = {(void *) snapshot->queue.data(), snapshot->queue.length()};
+    snapshot->parts[2] = SOCKET_IOV_LITERAL(R"(, "sgx_table": )");
+    snapshot->parts[3] = {(void *) snapshot->sgx_table.data(), snapshot->sgx_table.length()};
+    snapshot->parts[4] = SOCKET_IOV_LITERAL("}}");
+
+    return snapshot;
+}
+
+void state_snapshot_release(void *arg) {
+    auto snapshot = (struct state_snapshot *) arg;
+    if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        delete snapshot;
+    }
+}
+
 struct function_handle poet_functions[] = {
         FUNC_PAIR(register),
         FUNC_PAIR(remote_attestation),
-        FUNC_PAIR(sgx_time_broadcast),
+        FUNC_TRIPLE(sgx_time_broadcast),
         FUNC_PAIR(get_sgxtable),
         FUNC_PAIR(get_queue),
-        FUNC_PAIR(get_sgxtable_and_queue),
+        FUNC_TRIPLE(get_sgxtable_and_queue),
         FUNC_PAIR(close_connection),
-        FUNC_PAIR(unfinished_node),
-        {nullptr, nullptr} // to indicate end
-};
\ No newline at end of file
+        FUNC_TRIPLE(unfinished_node),
+        FUNC_PAIR(subscribe),
+        FUNC_PAIR(get_notification_stats),
+        {nullptr, nullptr, nullptr} // to indicate end
+};
+
+// the binary opcodes are the indexes in poet_functions
+static_assert(sizeof(poet_functions) / sizeof(*poet_functions) == POET_OPS + 1, "poet_opcode_t and poet_functions differ");
+static_assert(POET_OPCODE_BASE + POET_OPS <= UINT8_MAX + 1, "the opcodes don't fit in their byte");
\ No newline at end of file
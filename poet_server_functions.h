@@ -12,6 +12,38 @@ int poet_get_sgxtable(json_value *json, socket_t *socket, poet_context *context)
 int poet_get_queue(json_value *json, socket_t *socket, poet_context *context);
 int poet_get_sgxtable_and_queue(json_value *json, socket_t *socket, poet_context *context);
 int poet_close_connection(json_value *json, socket_t *socket, poet_context *context);
+int poet_subscribe(json_value *json, socket_t *socket, poet_context *context);
+int poet_get_notification_stats(json_value *json, socket_t *socket, poet_context *context);
+
+/* Handlers of the binary encoding, given the payload after the opcode and the id */
+int poet_binary_sgx_time_broadcast(const uint8_t *payload, size_t len, socket_t *socket, poet_context *context);
+int poet_binary_get_sgxtable_and_queue(const uint8_t *payload, size_t len, socket_t *socket, poet_context *context);
+int poet_binary_unfinished_node(const uint8_t *payload, size_t len, socket_t *socket, poet_context *context);
+int poet_binary_response(socket_t *socket, poet_context *context, uint8_t status, const struct iovec *parts,
+                         int nparts);
+bool poet_subscribe_node(poet_context *context, uint node_id, uint32_t channel);
+void poet_unsubscribe(poet_context *context);
+
+#define SNAPSHOT_PARTS 5
+#define STATE_LOG_VERSIONS 1024 // changes kept for the deltas, a node further behind gets the whole state
+
+/*
+ * Notification of the state shared by the outboxes of the subscribers, freed when the last reference is released.
+ * A delta (from != 0) has the queue operations and the rows written since the version from
+ */
+struct state_snapshot {
+    int refs;
+    uint64_t from;
+    uint64_t version;
+    std::string header;
+    std::string queue;
+    std::string sgx_table;
+    struct iovec parts[SNAPSHOT_PARTS]; // the message, gathered from the strings
+    std::string binary; // the same message for the nodes using the binary encoding
+};
+
+struct state_snapshot *state_snapshot_constructor(uint64_t from);
+void state_snapshot_release(void *snapshot);
 
 
 std::string get_sgx_table_str(bool);
@@ -20,6 +52,7 @@ std::string get_queue_str();
 struct function_handle {
     const char *name;
     int (*function)(json_value *, socket_t *, poet_context *);
+    int (*binary)(const uint8_t *, size_t, socket_t *, poet_context *); // NULL when the method is only in JSON
 };
 
 extern struct function_handle poet_functions[];
@@ -2,92 +2,166 @@
 
 #define JSON_ERROR_LEN 30
 
-int check_json_compliance(const char *buffer, size_t buffer_len) {
-    assert(buffer != nullptr);
-    assert(buffer_len >= 0);
+static void *arena_json_alloc(size_t size, int zero, void *user_data) {
+    void *p = arena_alloc((arena_t *) user_data, size);
+    if (p != nullptr && zero) memset(p, 0, size);
+    return p;
+}
 
-    if (buffer_len == 0) return 0;
+static void arena_json_free(void *, void *) {} // released all at once by arena_reset
 
-    JSON_checker jc = new_JSON_checker(buffer_len);
+json_value *poet_parse_message(const char *buffer, size_t buffer_len) {
+    return poet_parse_message_custom(buffer, buffer_len, nullptr);
+}
 
-    int is_valid = 1;
-    for (int current_pos = 0; (current_pos < buffer_len) && (buffer[current_pos] != '\0') && is_valid; current_pos++) {
-        int next_char = buffer[current_pos];
+/*
+ * Validates the message and builds its tree in a single pass: json-parser refuses everything that is not JSON, so the
+ * bytes are not scanned a second time by a checker. As before, a NUL byte ends the message. Returns NULL when the
+ * message is not valid.
+ * With an arena, the tree is built in it and is valid until the arena is reset: it must not be given to json_value_free
+ */
+json_value *poet_parse_message_custom(const char *buffer, size_t buffer_len, arena_t *arena) {
+    assert(buffer != nullptr);
 
-        is_valid = JSON_checker_char(jc, next_char);
+    if (buffer_len == 0) return nullptr;
 
-        if (!is_valid) {
-            WARN("JSON_checker_char: syntax error\n");
-        }
+    json_settings settings = {};
+    if (arena != nullptr) {
+        settings.mem_alloc = arena_json_alloc;
+        settings.mem_free = arena_json_free;
+        settings.user_data = arena;
     }
-
-    is_valid = is_valid && JSON_checker_done(jc);
-    if (!is_valid) {
-        WARN("JSON_checker_end: syntax error\n");
+    char error[json_error_max];
+    json_value *json = json_parse_ex(&settings, buffer, buffer_len, error);
+    if (json == nullptr) {
         int len = std::min(buffer_len, (size_t) JSON_ERROR_LEN);
-        WARN("JSON with invalid syntax: [%.*s]\n", len, buffer + (buffer_len - len));
+        WARN("JSON with invalid syntax (%s): [%.*s]\n", error, len, buffer + (buffer_len - len));
     }
 
-    return is_valid;
+    return json;
 }
 
-// BFS
-json_value *find_value(json_value *u, const char *name) {
+// Field accessors
+
+/* NULL if u is not an object */
+static json_value *find_member_n(json_value *u, const char *name, size_t name_len) {
+    if (u->type != json_object) return nullptr;
+
+    for (unsigned int i = 0; i < u->u.object.length; i++) {
+        json_object_entry &entry = u->u.object.values[i];
+        if (entry.name_length == name_len && memcmp(entry.name, name, name_len) == 0) {
+            return entry.value;
+        }
+    }
+
+    return nullptr;
+}
+
+/* Only the members of u are compared, nested values are never visited */
+json_value *find_member(json_value *u, const char *name) {
     assert(u != nullptr);
     assert(name != nullptr);
 
-    json_value *r = nullptr;
-    queue_t *queue = queue_constructor();
-    queue_push(queue, u);
-
-    while (!queue_is_empty(queue) && r == nullptr) {
-        u = (json_value *) queue_front(queue);
-        queue_pop(queue);
-
-        switch (u->type) {
-            case json_object:
-                for (int i = 0; i < u->u.object.length && r == nullptr; i++) {
-                    json_object_entry *entry = &(u->u.object.values[i]);
-                    queue_push(queue, entry->value);
-
-                    if (strcmp(entry->name, name) == 0) {
-                        r = entry->value;
-                    }
-                }
-                break;
-            case json_array:
-                for (int i = 0; i < u->u.array.length; i++) {
-                    queue_push(queue, u->u.array.values[i]);
-                }
-                break;
-            case json_integer:
-            case json_double:
-            case json_string:
-            case json_boolean:
-            case json_null:
-            default:
-                break;
+    return find_member_n(u, name, strlen(name));
+}
+
+/*
+ * Resolves a path of member names separated by dots, with [i] for an element of an array (for example
+ * "data.sgx_table[0].node_id"). Only the values on the path are visited and nothing is allocated. Returns NULL if a
+ * step is missing
+ */
+json_value *find_path(json_value *u, const char *path) {
+    assert(u != nullptr);
+    assert(path != nullptr);
+
+    const char *p = path;
+    while (u != nullptr && *p != '\0') {
+        if (*p == '[') {
+            char *end = nullptr;
+            unsigned long i = strtoul(p + 1, &end, 10);
+            if (end == p + 1 || *end != ']' || u->type != json_array || i >= u->u.array.length) return nullptr;
+            u = u->u.array.values[i];
+            p = end + 1;
+        } else {
+            if (*p == '.') p++;
+            size_t len = strcspn(p, ".[");
+            u = find_member_n(u, p, len);
+            p += len;
         }
     }
 
-    queue_destructor(queue, 0);
-
-    return r;
+    return u;
 }
 
 json_value * check_json_success_status(char *buffer, size_t len) {
     int state = 1;
-    json_value *json = nullptr;
-    state = state && check_json_compliance(buffer, len);
+    json_value *json = poet_parse_message(buffer, len);
+    state = json != nullptr;
     if (state) {
-        json = json_parse(buffer, len);
-        json_value *status = find_value(json, "status");
+        json_value *status = find_member(json, "status");
         if (status != nullptr && status->type == json_string) {
             state = strcmp(status->u.string.ptr, "success") == 0;
         }
     }
 
-    return state ? json : nullptr;
+    if (!state && json != nullptr) {
+        json_value_free(json);
+        json = nullptr;
+    }
+
+    return json;
+}
+
+/*
+ * Keeps only the last occurrence of each node in the queue (which also drops the consecutive repetitions). The queue
+ * is walked from the back, so a node is deleted whenever it was already seen.
+ */
+static int queue_delete_repeated_nodes(void *d, void *ctx) {
+    auto &seen = *((std::vector<bool> *) ctx);
+    auto id = (uint) ((long long) d);
+
+    if (id >= seen.size()) {
+        seen.resize(id + 1, false);
+    }
+
+    if (seen[id]) {
+        return 1;
+    }
+
+    seen[id] = true;
+    return 0;
+}
+
+/* Returns the number of elements deleted, the server and the nodes apply it to keep the same queue */
+int queue_remove_repeated_nodes(queue_t *queue, int lock) {
+    std::vector<bool> seen;
+    return queue_remove_repeated_nodes(queue, lock, seen);
+}
+
+/* seen is cleared and kept by the caller, it does not allocate when it already covers every id of the queue */
+int queue_remove_repeated_nodes(queue_t *queue, int lock, std::vector<bool> &seen) {
+    seen.assign(seen.size(), false);
+    return queue_selective_remove_custom(queue, queue_delete_repeated_nodes, &seen, 0, lock, 1);
+}
+
+void append_varint(std::string &s, uint64_t value) {
+    uint8_t buffer[VARINT_MAX_SIZE];
+    s.append((char *) buffer, put_varint(buffer, value));
+}
+
+void append_node_record(std::string &s, const node_t &node) {
+    uint8_t buffer[NODE_RECORD_SIZE];
+    put_node_record(buffer, &node);
+    s.append((char *) buffer, NODE_RECORD_SIZE);
+}
+
+/* Small negative values (the queue operations) stay one byte long */
+uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+int64_t zigzag_decode(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
 }
 
 int calc_tier_number(const node_t &node, uint total_tiers, uint sgx_max) {
@@ -99,12 +173,25 @@ int calc_tier_number(const node_t &node, uint total_tiers, uint sgx_max) {
     return tier;
 }
 
-static void copy_queuet_std_queue(void * node_ptr, void * std_queue_ptr) {
-    auto &q = *((std::queue<uint> *) std_queue_ptr);
-    auto node = (uint) ((long long) (node_ptr));
-
-    q.push(node);
-}
+/*
+ * Round robin simulation over a shared snapshot of the queue: the snapshot is walked in place and only the nodes
+ * re-added during the simulation are stored
+ */
+struct snapshot_queue {
+    queue_snapshot_t *snapshot;
+    size_t position = 0;
+    std::queue<uint> readded;
+
+    // without the snapshot the schedules would be computed on an empty queue
+    explicit snapshot_queue(queue_t *queue) : snapshot(queue_snapshot(queue)) { assertp(snapshot != nullptr); }
+    ~snapshot_queue() { queue_snapshot_release(snapshot); }
+
+    bool in_snapshot() const { return position < snapshot->size; }
+    bool empty() const { return !in_snapshot() && readded.empty(); }
+    uint front() const { return in_snapshot() ? (uint) ((long long) snapshot->items[position]) : readded.front(); }
+    void pop() { if (in_snapshot()) position++; else readded.pop(); }
+    void push(uint u) { readded.push(u); }
+};
 
 std::vector<uint> calc_quantum_times(const std::vector<node *> &sgx_table, uint ntiers, uint sgx_max, time_t node_current_time, time_t server_starting_time) {
     assert(ntiers > 0);
@@ -163,8 +250,7 @@ static uint remaining_quantum_time(const std::vector<uint> &quantum_times, const
 
 time_t calc_leadership_time(queue_t *queue, const std::vector<node_t *> &sgx_table, const node_t &current_node, uint tiers, uint sgx_max, time_t node_current_time, time_t server_starting_time) {
     assert(queue != nullptr);
-    std::queue<uint> q;
-    queue_print_func_dump((queue_t *) queue, copy_queuet_std_queue, &q);
+    snapshot_queue q((queue_t *) queue);
 
     /* **************** */
 
@@ -223,8 +309,7 @@ time_t calc_leadership_time(queue_t *queue, const std::vector<node_t *> &sgx_tab
 
 std::vector<time_t> calc_notification_times(queue_t *queue, const std::vector<node_t *> &sgx_table, const node_t &current_node, uint ntiers, uint sgx_max, time_t node_current_time, time_t server_starting_time) {
     assert(queue != nullptr);
-    std::queue<uint> q;
-    queue_print_func_dump((queue_t *) queue, copy_queuet_std_queue, &q);
+    snapshot_queue q((queue_t *) queue);
 
     /* ************* */
 
@@ -279,8 +364,7 @@ std::vector<time_t> calc_notification_times(queue_t *queue, const std::vector<no
 /* TODO should rather be all the starting times of the current node */
 time_t calc_starting_time(queue_t *queue, const std::vector<node_t *> &sgx_table, const node_t &current_node, uint ntiers, uint sgx_max, time_t node_current_time, time_t server_starting_time) {
     assert(queue != nullptr);
-    std::queue<uint> q;
-    queue_print_func_dump((queue_t *) queue, copy_queuet_std_queue, &q);
+    snapshot_queue q((queue_t *) queue);
 
     auto quantum_times = calc_quantum_times(sgx_table, ntiers, sgx_max, node_current_time, server_starting_time);
 
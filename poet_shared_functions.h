@@ -7,17 +7,12 @@
 #include <cerrno>
 #include <queue>
 #include "queue_t.h"
+#include "arena_t.h"
 #include "general_structs.h"
 #include <cstdarg>
 #include <vector>
+#include <string>
 #include <json-parser/json.h>
-#ifdef __cplusplus
-extern "C" {
-#endif
-#include <JSON-c/JSON_checker.h>
-#ifdef __cplusplus
-};
-#endif
 #include "queue_t.h"
 
 struct thread_tuple {
@@ -30,11 +25,26 @@ typedef struct {
     pthread_mutex_t mutex;
 } cond_mutex_t;
 
-json_value *find_value(json_value *u, const char *name);
+json_value *find_member(json_value *u, const char *name);
+json_value *find_path(json_value *u, const char *path);
 /* Should return NULL if not found */
-int check_json_compliance(const char *buffer, size_t buffer_len);
+json_value *poet_parse_message(const char *buffer, size_t buffer_len);
+json_value *poet_parse_message_custom(const char *buffer, size_t buffer_len, arena_t *arena);
 json_value * check_json_success_status(char *buffer, size_t len);
 
+/* Queue operations of the delta notifications, the other values are node ids pushed into the queue */
+#define QUEUE_OP_POP (-1)
+#define QUEUE_OP_DEDUP (-2)
+
+int queue_remove_repeated_nodes(queue_t *queue, int lock);
+int queue_remove_repeated_nodes(queue_t *queue, int lock, std::vector<bool> &seen);
+
+/* Binary encoding (see general_structs.h) */
+void append_varint(std::string &s, uint64_t value);
+void append_node_record(std::string &s, const node_t &node);
+uint64_t zigzag_encode(int64_t value);
+int64_t zigzag_decode(uint64_t value);
+
 int calc_tier_number(const node_t &node, uint total_tiers, uint sgx_max);
 
 std::vector<uint> calc_quantum_times(const std::vector<node_t *> &sgx_table, uint ntiers, uint sgx_max, time_t, time_t);
@@ -2,13 +2,485 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
 #include "queue_t.h"
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* ************************* LOCK-FREE BACKEND ************************* */
+
+/* Michael & Scott non-blocking queue (PODC '96). Nodes are carved from segments that are only released by the
+ * destructor and are recycled through a lock-free free list, so a slow thread can always dereference a node it read
+ * before. Links are (index, tag) pairs packed in 64 bits, every write of a link increments its tag so a recycled node
+ * can not be confused with the one that was read (ABA). Index 0 is never handed out and works as NULL. */
+
+#define QUEUE_LF_SEGMENT_BITS 12
+#define QUEUE_LF_SEGMENT_SIZE (1u << QUEUE_LF_SEGMENT_BITS)
+#define QUEUE_LF_MAX_SEGMENTS 4096 /* up to 16M elements */
+#define QUEUE_LF_NIL 0u
+
+#define LF_REF(idx, tag) ((((uint64_t) (tag)) << 32) | (uint32_t) (idx))
+#define LF_IDX(ref) ((uint32_t) (ref))
+#define LF_TAG(ref) ((uint32_t) ((ref) >> 32))
+
+typedef struct lf_node {
+    _Atomic(void *) d;
+    _Atomic(uint64_t) next;
+} lf_node_t;
+
+struct queue_lockfree {
+    _Alignas(64) _Atomic(uint64_t) head;
+    _Alignas(64) _Atomic(uint64_t) tail;
+    _Alignas(64) _Atomic(uint64_t) free_list;
+    _Atomic(uint32_t) next_unused;
+    _Atomic(long) size;
+    _Atomic(size_t) hits;
+    _Atomic(size_t) misses;
+    _Atomic(lf_node_t *) segments[QUEUE_LF_MAX_SEGMENTS];
+};
+
+static inline lf_node_t *lf_node(struct queue_lockfree *lf, uint32_t idx) {
+    lf_node_t *segment = atomic_load_explicit(&lf->segments[idx >> QUEUE_LF_SEGMENT_BITS], memory_order_acquire);
+    return segment + (idx & (QUEUE_LF_SEGMENT_SIZE - 1));
+}
+
+static uint32_t lf_node_alloc(struct queue_lockfree *lf) {
+    uint64_t top = atomic_load(&lf->free_list);
+    while (LF_IDX(top) != QUEUE_LF_NIL) {
+        uint64_t next = atomic_load(&lf_node(lf, LF_IDX(top))->next);
+        if (atomic_compare_exchange_weak(&lf->free_list, &top, LF_REF(LF_IDX(next), LF_TAG(top) + 1))) {
+            atomic_fetch_add_explicit(&lf->hits, 1, memory_order_relaxed);
+            return LF_IDX(top);
+        }
+    }
+
+    atomic_fetch_add_explicit(&lf->misses, 1, memory_order_relaxed);
+    uint32_t idx = atomic_fetch_add(&lf->next_unused, 1);
+    uint32_t segment_idx = idx >> QUEUE_LF_SEGMENT_BITS;
+    if (segment_idx >= QUEUE_LF_MAX_SEGMENTS) {
+        ERROR("lock-free queue %p reached its maximum capacity\n", lf);
+        return QUEUE_LF_NIL;
+    }
+
+    if (atomic_load(&lf->segments[segment_idx]) == NULL) {
+        lf_node_t *segment = calloc(QUEUE_LF_SEGMENT_SIZE, sizeof(lf_node_t));
+        if (segment == NULL) {
+            perror("lock-free queue segment calloc");
+            return QUEUE_LF_NIL;
+        }
+
+        lf_node_t *expected = NULL;
+        if (!atomic_compare_exchange_strong(&lf->segments[segment_idx], &expected, segment)) {
+            free(segment); // another thread installed it first
+        }
+    }
+
+    return idx;
+}
+
+static void lf_node_free(struct queue_lockfree *lf, uint32_t idx) {
+    lf_node_t *n = lf_node(lf, idx);
+    uint32_t tag = LF_TAG(atomic_load(&n->next)) + 1;
+    uint64_t top = atomic_load(&lf->free_list);
+    do {
+        atomic_store(&n->next, LF_REF(LF_IDX(top), tag));
+    } while (!atomic_compare_exchange_weak(&lf->free_list, &top, LF_REF(idx, LF_TAG(top) + 1)));
+}
+
+static struct queue_lockfree *lf_constructor() {
+    struct queue_lockfree *lf = aligned_alloc(64, sizeof(struct queue_lockfree));
+    if (lf == NULL) return NULL;
+    memset(lf, 0, sizeof(struct queue_lockfree));
+
+    atomic_init(&lf->next_unused, 1); /* index 0 is the NIL reference */
+    uint32_t dummy = lf_node_alloc(lf);
+    if (dummy == QUEUE_LF_NIL) {
+        free(lf);
+        return NULL;
+    }
+
+    atomic_init(&lf->head, LF_REF(dummy, 0));
+    atomic_init(&lf->tail, LF_REF(dummy, 0));
+    return lf;
+}
+
+static int lf_enqueue(struct queue_lockfree *lf, void *d) {
+    uint32_t idx = lf_node_alloc(lf);
+    if (idx == QUEUE_LF_NIL) return 0;
+
+    lf_node_t *n = lf_node(lf, idx);
+    atomic_store_explicit(&n->d, d, memory_order_relaxed);
+    atomic_store(&n->next, LF_REF(QUEUE_LF_NIL, LF_TAG(atomic_load(&n->next)) + 1));
+
+    uint64_t tail;
+    for (;;) {
+        tail = atomic_load(&lf->tail);
+        lf_node_t *t = lf_node(lf, LF_IDX(tail));
+        uint64_t next = atomic_load(&t->next);
+        if (tail != atomic_load(&lf->tail)) continue;
+
+        if (LF_IDX(next) == QUEUE_LF_NIL) {
+            if (atomic_compare_exchange_weak(&t->next, &next, LF_REF(idx, LF_TAG(next) + 1))) break;
+        } else { /* tail is falling behind, help it */
+            atomic_compare_exchange_weak(&lf->tail, &tail, LF_REF(LF_IDX(next), LF_TAG(tail) + 1));
+        }
+    }
+    atomic_compare_exchange_strong(&lf->tail, &tail, LF_REF(idx, LF_TAG(tail) + 1));
+    atomic_fetch_add(&lf->size, 1);
+
+    return 1;
+}
+
+static int lf_dequeue(struct queue_lockfree *lf, void **d) {
+    uint64_t head, tail, next;
+    for (;;) {
+        head = atomic_load(&lf->head);
+        tail = atomic_load(&lf->tail);
+        next = atomic_load(&lf_node(lf, LF_IDX(head))->next);
+        if (head != atomic_load(&lf->head)) continue;
+
+        if (LF_IDX(head) == LF_IDX(tail)) {
+            if (LF_IDX(next) == QUEUE_LF_NIL) return 0;
+            atomic_compare_exchange_weak(&lf->tail, &tail, LF_REF(LF_IDX(next), LF_TAG(tail) + 1));
+        } else {
+            /* read before the CAS, afterwards the node can be recycled by another consumer */
+            void *value = atomic_load_explicit(&lf_node(lf, LF_IDX(next))->d, memory_order_relaxed);
+            if (atomic_compare_exchange_weak(&lf->head, &head, LF_REF(LF_IDX(next), LF_TAG(head) + 1))) {
+                if (d != NULL) *d = value;
+                break;
+            }
+        }
+    }
+
+    lf_node_free(lf, LF_IDX(head));
+    atomic_fetch_sub(&lf->size, 1);
+
+    return 1;
+}
+
+static void *lf_front(struct queue_lockfree *lf) {
+    for (;;) {
+        uint64_t head = atomic_load(&lf->head);
+        uint64_t next = atomic_load(&lf_node(lf, LF_IDX(head))->next);
+        void *d = LF_IDX(next) != QUEUE_LF_NIL ? atomic_load(&lf_node(lf, LF_IDX(next))->d) : NULL;
+        if (head == atomic_load(&lf->head)) return d;
+    }
+}
+
+static void *lf_back(struct queue_lockfree *lf) {
+    for (;;) {
+        uint64_t head = atomic_load(&lf->head);
+        uint64_t tail = atomic_load(&lf->tail);
+        uint64_t next = atomic_load(&lf_node(lf, LF_IDX(tail))->next);
+        if (LF_IDX(next) != QUEUE_LF_NIL) {
+            atomic_compare_exchange_weak(&lf->tail, &tail, LF_REF(LF_IDX(next), LF_TAG(tail) + 1));
+            continue;
+        }
+        if (LF_IDX(head) == LF_IDX(tail)) return NULL;
+
+        void *d = atomic_load(&lf_node(lf, LF_IDX(tail))->d);
+        if (tail == atomic_load(&lf->tail)) return d;
+    }
+}
+
+static size_t lf_size(struct queue_lockfree *lf) {
+    long size = atomic_load(&lf->size);
+    return size > 0 ? (size_t) size : 0;
+}
+
+/* Weakly consistent walk: elements pushed or popped while walking may or may not be visited */
+static void lf_for_each(struct queue_lockfree *lf, void (*func)(void *, void *), void *dest) {
+    uint32_t idx = LF_IDX(atomic_load(&lf->head));
+    for (idx = LF_IDX(atomic_load(&lf_node(lf, idx)->next)); idx != QUEUE_LF_NIL;
+         idx = LF_IDX(atomic_load(&lf_node(lf, idx)->next))) {
+        func(atomic_load(&lf_node(lf, idx)->d), dest);
+    }
+}
+
+static void lf_destructor(struct queue_lockfree *lf, int deallocate) {
+    void *d;
+    while (lf_dequeue(lf, &d)) {
+        if (deallocate) free(d);
+    }
+
+    for (int i = 0; i < QUEUE_LF_MAX_SEGMENTS; i++) {
+        free(atomic_load(&lf->segments[i]));
+    }
+    free(lf);
+}
+
+/* ************************* ITEM POOL ************************* */
+
+/* Released items are kept in a per-queue free list (up to pool.high_water) so the steady state of a queue does not
+ * touch the allocator. The pool is only accessed with the queue write lock held (or by the owner of the lock when
+ * the *_custom functions are called with lock = 0). Items that do not fit in the queue pool, or that belong to a
+ * destroyed queue, go to a small per-thread cache so short-lived queues (one per received message or per lookup)
+ * also reuse them. */
+
+#define QUEUE_THREAD_CACHE_SIZE 256
+
+static __thread struct {
+    item_t *free_list;
+    size_t free_items;
+} thread_cache;
+
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+
+static void thread_cache_destructor(void *_) {
+    (void) _; /* the cache is thread local, not the key value */
+    while (thread_cache.free_list != NULL) {
+        item_t *item = thread_cache.free_list;
+        thread_cache.free_list = item->next;
+        free(item);
+    }
+    thread_cache.free_items = 0;
+}
+
+static void thread_cache_key_creation() {
+    pthread_key_create(&thread_cache_key, thread_cache_destructor);
+}
+
+static void item_free(item_t *item) {
+    if (thread_cache.free_items < QUEUE_THREAD_CACHE_SIZE) {
+        if (thread_cache.free_list == NULL) { /* registers the cleanup of this thread's cache */
+            pthread_once(&thread_cache_once, thread_cache_key_creation);
+            pthread_setspecific(thread_cache_key, &thread_cache);
+        }
+        item->next = thread_cache.free_list;
+        thread_cache.free_list = item;
+        thread_cache.free_items++;
+    } else {
+        free(item);
+    }
+}
+
+static item_t *item_alloc(queue_t *q) {
+    item_t *item = q->pool.free_list;
+    if (item != NULL) {
+        q->pool.free_list = item->next;
+        q->pool.free_items--;
+        q->pool.hits++;
+    } else if ((item = thread_cache.free_list) != NULL) {
+        thread_cache.free_list = item->next;
+        thread_cache.free_items--;
+        q->pool.hits++;
+    } else {
+        item = (item_t *) malloc(sizeof(item_t));
+        q->pool.misses++;
+        if (item == NULL) return NULL;
+    }
+
+    item->d = NULL;
+    item->next = NULL;
+    return item;
+}
+
+static void item_release(queue_t *q, item_t *item) {
+    if (q->pool.free_items < q->pool.high_water) {
+        item->next = q->pool.free_list;
+        q->pool.free_list = item;
+        q->pool.free_items++;
+    } else {
+        item_free(item);
+    }
+}
+
+static void pool_trim(queue_t *q, size_t high_water) {
+    while (q->pool.free_items > high_water) {
+        item_t *item = q->pool.free_list;
+        q->pool.free_list = item->next;
+        q->pool.free_items--;
+        item_free(item);
+    }
+}
+
+/* ************************* EVENT COUNT ************************* */
+
+/* Every modification increments the 64-bit version of the queue, and every notification increments the 32-bit
+ * event sequence used as futex word. A waiter reads the sequence before checking the version, so a notification that
+ * happens between the check and the sleep changes the word and the futex returns right away: no change is missed. */
+
+static void queue_changed(queue_t *q) {
+    __atomic_add_fetch(&q->version, 1, __ATOMIC_SEQ_CST);
+}
+
+#ifdef __linux__
+
+static void event_wait(queue_t *q, uint32_t seq, const struct timespec *timeout) {
+    /* the timeout of FUTEX_WAIT is relative */
+    int saved_errno = errno;
+    if (syscall(SYS_futex, &q->event.seq, FUTEX_WAIT_PRIVATE, seq, timeout, NULL, 0) != 0 && errno != EAGAIN &&
+        errno != EINTR && errno != ETIMEDOUT) {
+        perror("queue event wait -> futex");
+    }
+    errno = saved_errno; /* timeouts and spurious wake ups are expected */
+}
+
+static void event_wake(queue_t *q) {
+    syscall(SYS_futex, &q->event.seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+static void event_wait(queue_t *q, uint32_t seq, const struct timespec *timeout) {
+    pthread_mutex_lock(q->cond.cond_mutex);
+    if (__atomic_load_n(&q->event.seq, __ATOMIC_SEQ_CST) == seq) {
+        if (timeout != NULL) {
+            struct timespec abstime;
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_sec += timeout->tv_sec + (abstime.tv_nsec + timeout->tv_nsec) / 1000000000L;
+            abstime.tv_nsec = (abstime.tv_nsec + timeout->tv_nsec) % 1000000000L;
+            pthread_cond_timedwait(q->cond.cond, q->cond.cond_mutex, &abstime);
+        } else {
+            pthread_cond_wait(q->cond.cond, q->cond.cond_mutex);
+        }
+    }
+    pthread_mutex_unlock(q->cond.cond_mutex);
+}
+
+static void event_wake(queue_t *q) {
+    pthread_mutex_lock(q->cond.cond_mutex);
+    pthread_cond_broadcast(q->cond.cond);
+    pthread_mutex_unlock(q->cond.cond_mutex);
+}
+
+#endif
+
+static void queue_notify(queue_t *q) {
+    __atomic_add_fetch(&q->event.seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->event.waiters, __ATOMIC_SEQ_CST) > 0) {
+        event_wake(q);
+    }
+}
+
+/* ************************* RING BACKEND ************************* */
+
+/* Ids are stored contiguously in a circular buffer whose capacity is a power of two and doubles when full, so walking
+ * the queue is a linear scan over 4-byte entries. It is guarded by the rwlock like the linked list. */
+
+#define QUEUE_RING_INITIAL_CAPACITY 64
+#define RING_AT(q, i) ((q)->ring.data[((q)->ring.first + (i)) & ((q)->ring.capacity - 1)])
+#define RING_ID(d) ((uint32_t) (uintptr_t) (d))
+#define RING_PTR(id) ((void *) (uintptr_t) (id))
+
+static int ring_grow(queue_t *q) {
+    size_t capacity = q->ring.capacity > 0 ? q->ring.capacity * 2 : QUEUE_RING_INITIAL_CAPACITY;
+    uint32_t *data = (uint32_t *) malloc(capacity * sizeof(uint32_t));
+    if (data == NULL) {
+        perror("queue ring malloc");
+        return 0;
+    }
+
+    if (q->size > 0) { /* unwraps the elements at the beginning of the new buffer */
+        size_t first_part = min(q->size, q->ring.capacity - q->ring.first);
+        memcpy(data, q->ring.data + q->ring.first, first_part * sizeof(uint32_t));
+        memcpy(data + first_part, q->ring.data, (q->size - first_part) * sizeof(uint32_t));
+    }
+
+    free(q->ring.data);
+    q->ring.data = data;
+    q->ring.capacity = capacity;
+    q->ring.first = 0;
+
+    return 1;
+}
+
+/* ************************* QUEUE ************************* */
+
+/* Backend independent primitives for the locked backends, the caller must hold the queue lock */
+
+static int queue_append(queue_t *q, void *d) {
+    if (q->type == QUEUE_RING) {
+        if (q->size == q->ring.capacity && !ring_grow(q)) return 0;
+        RING_AT(q, q->size) = RING_ID(d);
+    } else {
+        item_t *new_item = item_alloc(q);
+        if (new_item == NULL) return 0;
+
+        new_item->d = d;
+
+        if (q->tail == NULL) {
+            assert(q->head == NULL);
+            q->head = q->tail = new_item;
+        } else {
+            q->tail->next = new_item;
+            q->tail = new_item;
+        }
+    }
+
+    q->size++;
+    queue_changed(q);
+    return 1;
+}
+
+static int queue_take_front(queue_t *q, void **d) {
+    if (q->type == QUEUE_RING) {
+        if (q->size == 0) return 0;
+        if (d != NULL) *d = RING_PTR(RING_AT(q, 0));
+        ERRR("Pops element (%u) from queue %p\n", RING_AT(q, 0), q);
+        q->ring.first = (q->ring.first + 1) & (q->ring.capacity - 1);
+    } else {
+        if (q->head == NULL) {
+            assert(q->tail == NULL);
+            return 0;
+        }
+
+        item_t *t = q->head;
+        q->head = q->head->next;
+        if (t == q->tail) {
+            q->tail = NULL;
+            assert(q->head == NULL);
+        }
+        ERRR("Pops element (%p) from queue %p\n", t->d, q);
+        if (d != NULL) *d = t->d;
+        item_release(q, t);
+    }
+
+    q->size--;
+    queue_changed(q);
+    return 1;
+}
+
+static void queue_for_each(queue_t *q, void (*func)(void *, void *), void *dest) {
+    if (q->type == QUEUE_RING) {
+        for (size_t i = 0; i < q->size; i++) {
+            func(RING_PTR(RING_AT(q, i)), dest);
+        }
+    } else {
+        for (item_t *i = q->head; i != NULL; i = i->next) {
+            func(i->d, dest);
+        }
+    }
+}
+
 queue_t *queue_constructor() {
+    return queue_constructor_custom(QUEUE_LOCKED);
+}
+
+queue_t *queue_constructor_custom(queue_type_t type) {
     queue_t *q = (queue_t *) malloc(sizeof(queue_t));
     if (q == NULL) goto error;
 
     memset(q, 0, sizeof(queue_t));
+    q->type = type;
+    q->pool.high_water = QUEUE_POOL_HIGH_WATER;
+
+    if (type == QUEUE_LOCKFREE) {
+        q->lockfree = lf_constructor();
+        if (q->lockfree == NULL) {
+            perror("queue constructor lock-free");
+            goto error;
+        }
+    }
 
     q->lock = malloc(sizeof(pthread_rwlock_t));
     if (q->lock == NULL){
@@ -24,11 +496,17 @@ queue_t *queue_constructor() {
 
     q->cond.cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
     q->cond.cond_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
-    if (q->cond.cond == NULL || q->cond.cond_mutex == NULL) {
+    q->snapshot.lock = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (q->cond.cond == NULL || q->cond.cond_mutex == NULL || q->snapshot.lock == NULL) {
         perror("queue constructor malloc 2");
         goto error;
     }
 
+    if (pthread_mutex_init(q->snapshot.lock, NULL) != 0) {
+        perror("queue_snapshot_lock init");
+        goto error;
+    }
+
     if (pthread_mutex_init(q->cond.cond_mutex, NULL) != 0) {
         perror("queue_cond_mutex init");
         goto error;
@@ -53,17 +531,21 @@ queue_t *queue_constructor() {
     if (q != NULL && q->lock != NULL) free(q->lock);
     if (q != NULL && q->cond.cond != NULL) free(q->cond.cond);
     if (q != NULL && q->cond.cond_mutex != NULL) free(q->cond.cond_mutex);
+    if (q != NULL && q->snapshot.lock != NULL) free(q->snapshot.lock);
+    if (q != NULL && q->lockfree != NULL) lf_destructor(q->lockfree, 0);
     if (q != NULL) free(q);
     return NULL;
 }
 
 int queue_is_empty_custom(queue_t *q, int lock) {
     assert(q != NULL && q->lock != NULL);
+    if (q->type == QUEUE_LOCKFREE) return lf_front(q->lockfree) == NULL && lf_size(q->lockfree) == 0;
+
     if (lock) pthread_rwlock_rdlock(q->lock);
     assert(q->head != NULL || q->head == q->tail); // if the head is NULL, then tail should be NULL as well
-    ERRR("queue %p is empty: %s (size: %d)\n", q, (q != NULL && q->head == NULL ? "true" : "false"),
+    ERRR("queue %p is empty: %s (size: %d)\n", q, (q != NULL && q->size == 0 ? "true" : "false"),
          (q != NULL ? (int) q->size : 0));
-    int r = q != NULL && q->head == NULL;
+    int r = q != NULL && (q->type == QUEUE_RING ? q->size == 0 : q->head == NULL);
     if (lock) pthread_rwlock_unlock(q->lock);
     return r;
 }
@@ -74,10 +556,15 @@ int queue_is_empty(queue_t *q) {
 
 void *queue_front_custom(queue_t *q, int lock) {
     assert(q != NULL && q->lock != NULL);
+    if (q->type == QUEUE_LOCKFREE) return lf_front(q->lockfree);
 
     if (lock) pthread_rwlock_rdlock(q->lock);
 
-    if (q->head != NULL) {
+    if (q->type == QUEUE_RING && q->size > 0) {
+        void *d = RING_PTR(RING_AT(q, 0));
+        if (lock) pthread_rwlock_unlock(q->lock);
+        return d;
+    } else if (q->head != NULL) {
         void *d = q->head->d;
         pthread_rwlock_unlock(q->lock);
         return d;
@@ -97,10 +584,15 @@ void *queue_front(queue_t *q) {
 
 void *queue_back_custom(queue_t *q, int lock) {
     assert(q != NULL && q->lock != NULL);
+    if (q->type == QUEUE_LOCKFREE) return lf_back(q->lockfree);
 
     if (lock) pthread_rwlock_rdlock(q->lock);
 
-    if (q->tail != NULL) {
+    if (q->type == QUEUE_RING && q->size > 0) {
+        void *d = RING_PTR(RING_AT(q, q->size - 1));
+        if (lock) pthread_rwlock_unlock(q->lock);
+        return d;
+    } else if (q->tail != NULL) {
         void *d = q->tail->d;
         pthread_rwlock_unlock(q->lock);
         return d;
@@ -121,24 +613,16 @@ void *queue_back(queue_t *q) {
 void queue_pop_custom(queue_t *q, int notify, int lock) {
     assert(q != NULL && q->lock != NULL);
 
-    if (lock) pthread_rwlock_wrlock(q->lock);
-
-    if (q->head != NULL) {
-        item_t *t = q->head;
-        q->head = q->head->next;
-        if (t == q->tail) {
-            q->tail = NULL;
-            assert(q->head == NULL);
-        }
-        ERRR("Pops element (%p) from queue %p\n", t->d, q);
-        free(t);
-        q->size--;
-    } else {
-        assert(q->tail == NULL);
+    if (q->type == QUEUE_LOCKFREE) {
+        if (lf_dequeue(q->lockfree, NULL)) queue_changed(q);
+        if (notify) queue_notify(q);
+        return;
     }
 
+    if (lock) pthread_rwlock_wrlock(q->lock);
+    queue_take_front(q, NULL);
     if (lock) pthread_rwlock_unlock(q->lock);
-    if (notify) pthread_cond_broadcast(q->cond.cond);
+    if (notify) queue_notify(q);
 }
 
 void queue_pop(queue_t *q) {
@@ -148,27 +632,20 @@ void queue_pop(queue_t *q) {
 void *queue_front_and_pop_custom(queue_t *q, int notify, int lock) {
     assert(q != NULL && q->lock != NULL);
 
+    if (q->type == QUEUE_LOCKFREE) {
+        void *d = NULL;
+        if (lf_dequeue(q->lockfree, &d)) queue_changed(q);
+        if (notify) queue_notify(q);
+        return d;
+    }
+
     if (lock) pthread_rwlock_wrlock(q->lock);
 
     void *d = NULL;
-
-    if (q->head != NULL) {
-        item_t *t = q->head;
-        q->head = q->head->next;
-        if (t == q->tail) {
-            q->tail = NULL;
-            assert(q->head == NULL);
-        }
-        ERRR("Pops element (%p) from queue %p\n", t->d, q);
-        d = t->d;
-        free(t);
-        q->size--;
-    } else {
-        assert(q->tail == NULL);
-    }
+    queue_take_front(q, &d);
 
     if (lock) pthread_rwlock_unlock(q->lock);
-    if (notify) pthread_cond_broadcast(q->cond.cond);
+    if (notify) queue_notify(q);
 
     return d;
 }
@@ -180,28 +657,25 @@ void *queue_front_and_pop(queue_t *q) {
 void queue_push_custom(queue_t *q, void *d, int notify, int lock) {
     assert(q != NULL && q->lock != NULL);
 
-    if (lock) {
-        pthread_rwlock_wrlock(q->lock);
+    if (q->type == QUEUE_LOCKFREE) {
+        if (!lf_enqueue(q->lockfree, d)) {
+            ERROR("Could not allocate new item into queue\n");
+            return;
+        }
+        queue_changed(q);
+        if (notify) queue_notify(q);
+        ERRR("Pushes %p into the queue %p\n", d, q);
+        return;
     }
 
-    item_t *new_item = (item_t *) malloc(sizeof(item_t));
-    if (new_item == NULL) goto error;
-    memset(new_item, 0, sizeof(item_t));
-
-    new_item->d = d;
-
-    if (q->tail == NULL) {
-        assert(q->head == NULL);
-        q->head = q->tail = new_item;
-    } else {
-        q->tail->next = new_item;
-        q->tail = new_item;
+    if (lock) {
+        pthread_rwlock_wrlock(q->lock);
     }
 
-    q->size++;
+    if (!queue_append(q, d)) goto error;
 
     if (lock) pthread_rwlock_unlock(q->lock);
-    if (notify) pthread_cond_broadcast(q->cond.cond);
+    if (notify) queue_notify(q);
     ERRR("Pushes %p into the queue %p (size: %lu)\n", d, q, q->size);
 
     return;
@@ -215,42 +689,127 @@ void queue_push(queue_t *q, void *d) {
     queue_push_custom(q, d, 1, 1);
 }
 
-int queue_wait_change(queue_t *q) {
+/* The batched calls take the lock and wake the waiters once for the whole batch */
+
+size_t queue_push_n_custom(queue_t *q, void **items, size_t n, int notify, int lock) {
     assert(q != NULL && q->lock != NULL);
-    int ret = 0;
-    if((ret = (pthread_mutex_trylock(q->cond.cond_mutex) == 0))) {
-        ret = pthread_cond_wait(q->cond.cond, q->cond.cond_mutex) == 0;
-        if (!ret) {
-            perror("queue_wait_change -> cond_wait");
-        }
-        pthread_mutex_unlock(q->cond.cond_mutex);
+    assert(items != NULL || n == 0);
+
+    size_t pushed = 0;
+    if (q->type == QUEUE_LOCKFREE) {
+        while (pushed < n && lf_enqueue(q->lockfree, items[pushed])) pushed++;
+        if (pushed > 0) queue_changed(q);
     } else {
-        perror("queue_wait_change -> trylock");
+        if (lock) pthread_rwlock_wrlock(q->lock);
+        if (q->type == QUEUE_RING) {
+            while (q->ring.capacity - q->size < n && ring_grow(q));
+        }
+        while (pushed < n && queue_append(q, items[pushed])) pushed++;
+        if (lock) pthread_rwlock_unlock(q->lock);
     }
 
-    return ret;
+    if (pushed < n) {
+        ERROR("Could only push %lu out of %lu items into queue %p\n", pushed, n, q);
+    }
+
+    if (notify && pushed > 0) queue_notify(q);
+    ERRR("Pushes %lu elements into the queue %p\n", pushed, q);
+
+    return pushed;
 }
 
-int queue_wait_change_timed(queue_t *q, struct timespec time) {
+size_t queue_push_n(queue_t *q, void **items, size_t n) {
+    return queue_push_n_custom(q, items, n, 1, 1);
+}
+
+size_t queue_pop_n_custom(queue_t *q, void **dest, size_t n, int notify, int lock) {
     assert(q != NULL && q->lock != NULL);
-    int ret = 0;
-    struct timespec waittime = time;
-    if((ret = (pthread_mutex_trylock(q->cond.cond_mutex) == 0))) {
-        ret = pthread_cond_timedwait(q->cond.cond, q->cond.cond_mutex, &waittime) == 0;
-        if (!ret) {
-            perror("queue_wait_change_timed -> cond_wait");
-        }
-        pthread_mutex_unlock(q->cond.cond_mutex);
+    assert(dest != NULL || n == 0);
+
+    size_t popped = 0;
+    if (q->type == QUEUE_LOCKFREE) {
+        while (popped < n && lf_dequeue(q->lockfree, dest + popped)) popped++;
+        if (popped > 0) queue_changed(q);
     } else {
-        perror("queue_wait_change -> trylock");
+        if (lock) pthread_rwlock_wrlock(q->lock);
+        while (popped < n && queue_take_front(q, dest + popped)) popped++;
+        if (lock) pthread_rwlock_unlock(q->lock);
+    }
+
+    if (notify && popped > 0) queue_notify(q);
+    ERRR("Pops %lu elements from the queue %p\n", popped, q);
+
+    return popped;
+}
+
+size_t queue_pop_n(queue_t *q, void **dest, size_t n) {
+    return queue_pop_n_custom(q, dest, n, 1, 1);
+}
+
+/* Empties the queue into dest (dest_len should be at least queue_size(q)), returns the number of elements moved */
+size_t queue_drain_into(queue_t *q, void **dest, size_t dest_len) {
+    return queue_pop_n_custom(q, dest, dest_len, 1, 1);
+}
+
+uint64_t queue_version(queue_t *q) {
+    assert(q != NULL);
+    return __atomic_load_n(&q->version, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Blocks until the version of the queue is greater than version and a notification was sent, or until the relative
+ * timeout expires (timeout NULL waits forever). Returns 1 if the version is greater than the given one.
+ */
+int queue_wait_version(queue_t *q, uint64_t version, const struct timespec *timeout) {
+    assert(q != NULL);
+
+    struct timespec deadline = {0, 0}, remaining = {0, 0};
+    if (timeout != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec + (deadline.tv_nsec + timeout->tv_nsec) / 1000000000L;
+        deadline.tv_nsec = (deadline.tv_nsec + timeout->tv_nsec) % 1000000000L;
+    }
+
+    __atomic_add_fetch(&q->event.waiters, 1, __ATOMIC_SEQ_CST);
+
+    int ret;
+    while (1) {
+        uint32_t seq = __atomic_load_n(&q->event.seq, __ATOMIC_SEQ_CST);
+        if ((ret = queue_version(q) > version)) break;
+
+        if (timeout != NULL) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000L;
+            }
+            if (remaining.tv_sec < 0) break;
+        }
+
+        event_wait(q, seq, timeout != NULL ? &remaining : NULL);
     }
 
+    __atomic_sub_fetch(&q->event.waiters, 1, __ATOMIC_SEQ_CST);
+
     return ret;
 }
 
+int queue_wait_change(queue_t *q) {
+    return queue_wait_version(q, queue_version(q), NULL);
+}
+
+/* time is relative */
+int queue_wait_change_timed(queue_t *q, struct timespec time) {
+    return queue_wait_version(q, queue_version(q), &time);
+}
+
 void queue_broadcast(queue_t *q) {
-    assert(q != NULL && q->cond.cond != NULL);
-    pthread_cond_broadcast(q->cond.cond);
+    assert(q != NULL);
+    queue_changed(q);
+    queue_notify(q);
 }
 
 static void generic_print(void *d) {
@@ -262,14 +821,21 @@ void queue_print(queue_t *q) {
     queue_print_func(q, generic_print);
 }
 
+static void print_func_adapter(void *d, void *print_func) {
+    ((void (*)(void *)) print_func)(d);
+}
+
 void queue_print_func(queue_t *q, void (*print_func)(void *)) {
     assert(q != NULL);
     assert(print_func != NULL);
 
-    pthread_rwlock_rdlock(q->lock);
-    for (item_t *i = q->head; i != NULL; i = i->next) {
-        print_func(i->d);
+    if (q->type == QUEUE_LOCKFREE) {
+        lf_for_each(q->lockfree, print_func_adapter, (void *) print_func);
+        return;
     }
+
+    pthread_rwlock_rdlock(q->lock);
+    queue_for_each(q, print_func_adapter, (void *) print_func);
     pthread_rwlock_unlock(q->lock);
 }
 
@@ -277,10 +843,13 @@ void queue_print_func_dump_custom(queue_t *q, void (*print_func)(void *, void *)
     assert(q != NULL);
     assert(print_func != NULL);
 
-    if (lock) pthread_rwlock_rdlock(q->lock);
-    for (item_t *i = q->head; i != NULL; i = i->next) {
-        print_func(i->d, dest);
+    if (q->type == QUEUE_LOCKFREE) {
+        lf_for_each(q->lockfree, print_func, dest);
+        return;
     }
+
+    if (lock) pthread_rwlock_rdlock(q->lock);
+    queue_for_each(q, print_func, dest);
     if (lock) pthread_rwlock_unlock(q->lock);
 }
 
@@ -288,83 +857,144 @@ void queue_print_func_dump(queue_t *q, void (*print_func)(void *, void *), void
     queue_print_func_dump_custom(q, print_func, dest, 1);
 }
 
-int queue_selective_remove(queue_t *q, int (*should_delete)(int, void *), int deallocate, int lock) {
-    assert(q != NULL);
-    assert(should_delete != NULL);
-
-    if (lock) pthread_rwlock_wrlock(q->lock);
-    int first_execution = 1;
+/* Unlinks in place the items accepted by should_delete, the caller must hold the queue lock */
+static int list_filter(queue_t *q, int (*should_delete)(void *, void *), void *ctx, int deallocate) {
     int deletions = 0;
-    void ** to_delete = deallocate ? calloc(q->size, sizeof(void *)) : NULL;
-    if(deallocate && to_delete == NULL) {
-        ERROR("Could not allocate list to deallocate elements:\n");
-        goto error;
-    }
-
-    int preserve = 0;
-    item_t **to_preserve = calloc(q->size, sizeof(item_t *));
-    if (to_preserve == NULL) {
-        ERROR("Could not allocate list to preserve elements:\n");
-        goto error;
+    item_t **link = &q->head;
+    q->tail = NULL;
+
+    while (*link != NULL) {
+        item_t *i = *link;
+        if (should_delete(i->d, ctx)) {
+            *link = i->next;
+            if (deallocate) free(i->d);
+            item_release(q, i);
+            deletions++;
+        } else {
+            q->tail = i;
+            link = &i->next;
+        }
     }
 
-    /* MODIFYING */
-
-    for(item_t * i = q->head; i != NULL; i = i->next) {
-        int delete = should_delete(first_execution, i->d);
+    return deletions;
+}
 
-        if (delete) {
-            if (deallocate) {
-                to_delete[deletions] = i->d;
-            }
+static void list_reverse(queue_t *q) {
+    item_t *previous = NULL, *next = NULL;
+    q->tail = q->head;
+    for (item_t *i = q->head; i != NULL; i = next) {
+        next = i->next;
+        i->next = previous;
+        previous = i;
+    }
+    q->head = previous;
+}
 
-            free(i);
+/*
+ * A singly linked list is only walked forward: it is reversed in place, then the items are visited from the back and
+ * the kept ones are linked again in their original order. The caller must hold the queue lock
+ */
+static int list_filter_from_back(queue_t *q, int (*should_delete)(void *, void *), void *ctx, int deallocate) {
+    int deletions = 0;
+    item_t *kept = NULL, *next = NULL;
+
+    list_reverse(q);
+    q->tail = NULL;
+    for (item_t *i = q->head; i != NULL; i = next) {
+        next = i->next;
+        if (should_delete(i->d, ctx)) {
+            if (deallocate) free(i->d);
+            item_release(q, i);
             deletions++;
         } else {
-            to_preserve[preserve++] = i;
+            if (kept == NULL) q->tail = i;
+            i->next = kept;
+            kept = i;
         }
-
-        first_execution = 0;
     }
+    q->head = kept;
 
-    item_t *i_ptr = q->head = to_preserve[0];
-    for(int i = 1; i < preserve; i++) {
-        i_ptr->next = to_preserve[i];
-        i_ptr = i_ptr->next;
-    }
-    q->tail = to_preserve[max(preserve-1, 0)];
-    if (q->tail != NULL) {
-        q->tail->next = NULL;
-    }
-    assert(preserve + deletions == q->size);
-    q->size = preserve;
+    return deletions;
+}
 
-    error:
-    if (lock) pthread_rwlock_unlock(q->lock);
+/*
+ * Removes the elements accepted by should_delete without allocating. The elements are visited from the front, or from
+ * the back when from_back is set, and ctx is given to every call of should_delete. A ring is filtered in a single
+ * pass in both directions, a list in a single pass from the front and in two from the back.
+ */
+int queue_selective_remove_custom(queue_t *q, int (*should_delete)(void *, void *), void *ctx, int deallocate,
+                                  int lock, int from_back) {
+    assert(q != NULL);
+    assert(should_delete != NULL);
 
-//    if (deletions > 0) {
-//        pthread_cond_broadcast(q->cond.cond);
-//    }
+    if (q->type == QUEUE_LOCKFREE) {
+        ERROR("selective remove is not supported by lock-free queue %p\n", q);
+        errno = ENOTSUP;
+        return -1;
+    }
 
-    if (deallocate && to_delete != NULL) {
-        for(int i = 0; i < deletions; i++) {
-            free(to_delete[i]);
+    if (lock) pthread_rwlock_wrlock(q->lock);
+
+    int deletions;
+    if (q->type == QUEUE_RING) {
+        assert(!deallocate); /* ids are not allocated */
+
+        size_t preserved = 0;
+        if (from_back) {
+            for (size_t i = q->size; i-- > 0;) {
+                uint32_t id = RING_AT(q, i);
+                if (!should_delete(RING_PTR(id), ctx)) {
+                    RING_AT(q, q->size - 1 - preserved++) = id;
+                }
+            }
+            q->ring.first = (q->ring.first + q->size - preserved) & (q->ring.capacity - 1);
+        } else {
+            for (size_t i = 0; i < q->size; i++) {
+                uint32_t id = RING_AT(q, i);
+                if (!should_delete(RING_PTR(id), ctx)) {
+                    RING_AT(q, preserved++) = id;
+                }
+            }
         }
-    }
 
-    if (to_delete != NULL) {
-        free(to_delete);
-    }
+        deletions = (int) (q->size - preserved);
+        q->size = preserved;
+    } else {
+        deletions = from_back ? list_filter_from_back(q, should_delete, ctx, deallocate) :
+                    list_filter(q, should_delete, ctx, deallocate);
 
-    if (to_preserve != NULL) {
-        free(to_preserve);
+        assert((size_t) deletions <= q->size);
+        q->size -= deletions;
     }
 
+    if (deletions > 0) queue_changed(q);
+
+    if (lock) pthread_rwlock_unlock(q->lock);
+
     return deletions;
 }
 
+struct selective_remove_first {
+    int (*should_delete)(int, void *);
+    int first;
+};
+
+static int selective_remove_first_adapter(void *d, void *ctx) {
+    struct selective_remove_first *c = (struct selective_remove_first *) ctx;
+    int r = c->should_delete(c->first, d);
+    c->first = 0;
+    return r;
+}
+
+int queue_selective_remove(queue_t *q, int (*should_delete)(int, void *), int deallocate, int lock) {
+    struct selective_remove_first ctx = {should_delete, 1};
+    return queue_selective_remove_custom(q, selective_remove_first_adapter, &ctx, deallocate, lock, 0);
+}
+
 size_t queue_size_custom(queue_t *q, int lock) {
     assert(q != NULL);
+    if (q->type == QUEUE_LOCKFREE) return lf_size(q->lockfree);
+
     if (lock) pthread_rwlock_rdlock(q->lock);
     int r = q->size;
     if (lock) pthread_rwlock_unlock(q->lock);
@@ -375,24 +1005,123 @@ size_t queue_size(queue_t *q) {
     return queue_size_custom(q, 1);
 }
 
+static void snapshot_collect(void *d, void *dest) {
+    queue_snapshot_t *s = (queue_snapshot_t *) dest;
+    s->items[s->size++] = d;
+}
+
+/* The caller must hold the queue lock */
+static queue_snapshot_t *snapshot_build(queue_t *q) {
+    queue_snapshot_t *s = (queue_snapshot_t *) malloc(sizeof(queue_snapshot_t) + q->size * sizeof(void *));
+    if (s == NULL) {
+        perror("queue snapshot malloc");
+        return NULL;
+    }
+
+    s->version = q->version;
+    s->size = 0;
+    s->items = (void **) (s + 1);
+    s->references = 1; /* reference of the queue cache */
+    queue_for_each(q, snapshot_collect, s);
+    assert(s->size == q->size);
+
+    return s;
+}
+
+/*
+ * Returns a read-only view of the queue that must be given back with queue_snapshot_release. The view is cached
+ * until the next modification, so consecutive readers of the same version share it without copying. Writers only
+ * bump the version and never wait for the readers of an older snapshot.
+ */
+queue_snapshot_t *queue_snapshot(queue_t *q) {
+    assert(q != NULL);
+
+    if (q->type == QUEUE_LOCKFREE) {
+        ERROR("snapshots are not supported by lock-free queue %p\n", q);
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    pthread_mutex_lock(q->snapshot.lock);
+    pthread_rwlock_rdlock(q->lock);
+    queue_snapshot_t *s = q->snapshot.cached;
+    if (s == NULL || s->version != q->version) {
+        s = snapshot_build(q);
+        if (s != NULL) {
+            if (q->snapshot.cached != NULL) queue_snapshot_release(q->snapshot.cached);
+            q->snapshot.cached = s;
+        }
+    }
+    pthread_rwlock_unlock(q->lock);
+
+    if (s != NULL) __atomic_add_fetch(&s->references, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(q->snapshot.lock);
+
+    return s;
+}
+
+void queue_snapshot_release(queue_snapshot_t *s) {
+    if (s == NULL) return;
+
+    if (__atomic_sub_fetch(&s->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(s);
+    }
+}
+
+void queue_set_pool_high_water(queue_t *q, size_t high_water) {
+    assert(q != NULL);
+    if (q->type == QUEUE_LOCKFREE) return; /* nodes of the lock-free backend are always recycled */
+
+    pthread_rwlock_wrlock(q->lock);
+    q->pool.high_water = high_water;
+    pool_trim(q, high_water);
+    pthread_rwlock_unlock(q->lock);
+}
+
+void queue_pool_stats(queue_t *q, size_t *hits, size_t *misses) {
+    assert(q != NULL);
+
+    if (q->type == QUEUE_LOCKFREE) {
+        if (hits != NULL) *hits = atomic_load_explicit(&q->lockfree->hits, memory_order_relaxed);
+        if (misses != NULL) *misses = atomic_load_explicit(&q->lockfree->misses, memory_order_relaxed);
+        return;
+    }
+
+    pthread_rwlock_rdlock(q->lock);
+    if (hits != NULL) *hits = q->pool.hits;
+    if (misses != NULL) *misses = q->pool.misses;
+    pthread_rwlock_unlock(q->lock);
+}
+
 void queue_destructor(queue_t *q, int deallocate) {
     assert(q != NULL);
 
     // XXX: maybe put a destruction state variable to say that is destroying the object?
 
-    while (!queue_is_empty(q)) {
-        if (deallocate != 0) {
-            free(queue_front(q));
+    if (q->type == QUEUE_LOCKFREE) {
+        lf_destructor(q->lockfree, deallocate);
+        q->lockfree = NULL;
+    } else {
+        while (!queue_is_empty(q)) {
+            if (deallocate != 0 && q->type != QUEUE_RING) {
+                free(queue_front(q));
+            }
+            queue_pop(q);
         }
-        queue_pop(q);
+        pool_trim(q, 0);
     }
 
+    free(q->ring.data);
+    queue_snapshot_release(q->snapshot.cached);
+
     pthread_rwlock_destroy(q->lock);
     pthread_cond_destroy(q->cond.cond);
     pthread_mutex_destroy(q->cond.cond_mutex);
+    pthread_mutex_destroy(q->snapshot.lock);
 
     free(q->cond.cond);
     free(q->cond.cond_mutex);
+    free(q->snapshot.lock);
     free(q->lock);
 
     free(q);
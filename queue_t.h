@@ -7,6 +7,7 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
@@ -17,7 +18,31 @@ typedef struct item {
     struct item *next;
 } item_t;
 
+/*
+ * QUEUE_LOCKFREE is a Michael & Scott queue whose nodes are recycled, never freed, until the destructor. Push, pop,
+ * front, back, size and the version/wait calls work on it, the walks (queue_print_func*) are weakly consistent.
+ * queue_snapshot (NULL) and queue_selective_remove* (-1) are not supported and fail with errno set to ENOTSUP.
+ */
+typedef enum {
+    QUEUE_LOCKED = 0, /* linked list guarded by the rwlock (default) */
+    QUEUE_LOCKFREE,   /* multi-producer/multi-consumer lock-free list, the lock argument of the *_custom calls is ignored */
+    QUEUE_RING,       /* growable circular array of uint32_t ids (cast from/to void *), guarded by the rwlock */
+} queue_type_t;
+
+#define QUEUE_POOL_HIGH_WATER 64 /* default number of released items kept for reuse by each queue */
+
+struct queue_lockfree;
+
+/* Immutable copy of the elements of a queue at a given version, shared by the readers until the queue is modified */
+typedef struct queue_snapshot {
+    uint64_t version;
+    size_t size;
+    void **items;
+    int references;
+} queue_snapshot_t;
+
 typedef struct {
+    queue_type_t type;
     size_t size;
     struct item *head;
     struct item *tail;
@@ -26,9 +51,32 @@ typedef struct {
         pthread_cond_t *cond;
         pthread_mutex_t *cond_mutex;
     } cond;
+    struct {
+        item_t *free_list;
+        size_t free_items;
+        size_t high_water;
+        size_t hits;
+        size_t misses;
+    } pool;
+    struct {
+        uint32_t *data;
+        size_t capacity; /* power of two */
+        size_t first;
+    } ring;
+    struct queue_lockfree *lockfree;
+    uint64_t version; /* incremented on every modification and broadcast */
+    struct {
+        uint32_t seq; /* futex word, incremented on every notification */
+        uint32_t waiters;
+    } event;
+    struct {
+        queue_snapshot_t *cached;
+        pthread_mutex_t *lock;
+    } snapshot;
 } queue_t;
 
 queue_t *queue_constructor();
+queue_t *queue_constructor_custom(queue_type_t type);
 int queue_is_empty(queue_t *q);
 int queue_is_empty_custom(queue_t *q, int lock);
 void *queue_front(queue_t *q);
@@ -41,6 +89,13 @@ void *queue_front_and_pop(queue_t *q);
 void *queue_front_and_pop_custom(queue_t *q, int notify, int lock);
 void queue_push(queue_t *q, void *d);
 void queue_push_custom(queue_t *q, void *d, int notify, int lock);
+size_t queue_push_n(queue_t *q, void **items, size_t n);
+size_t queue_push_n_custom(queue_t *q, void **items, size_t n, int notify, int lock);
+size_t queue_pop_n(queue_t *q, void **dest, size_t n);
+size_t queue_pop_n_custom(queue_t *q, void **dest, size_t n, int notify, int lock);
+size_t queue_drain_into(queue_t *q, void **dest, size_t dest_len);
+uint64_t queue_version(queue_t *q);
+int queue_wait_version(queue_t *q, uint64_t version, const struct timespec *timeout);
 int queue_wait_change(queue_t *q);
 int queue_wait_change_timed(queue_t *q, struct timespec time);
 void queue_broadcast(queue_t *q);
@@ -49,7 +104,13 @@ void queue_print_func(queue_t *q, void (*)(void *));
 void queue_print_func_dump(queue_t *q, void (*)(void *, void *), void *);
 void queue_print_func_dump_custom(queue_t *q, void (*print_func)(void *, void *), void *dest, int lock);
 int queue_selective_remove(queue_t *q, int (*)(int, void *), int deallocate, int lock);
+int queue_selective_remove_custom(queue_t *q, int (*should_delete)(void *, void *), void *ctx, int deallocate, int lock,
+                                  int from_back);
 size_t queue_size(queue_t *q);
+queue_snapshot_t *queue_snapshot(queue_t *q);
+void queue_snapshot_release(queue_snapshot_t *s);
+void queue_set_pool_high_water(queue_t *q, size_t high_water);
+void queue_pool_stats(queue_t *q, size_t *hits, size_t *misses);
 size_t queue_size_custom(queue_t *q, int lock);
 void queue_destructor(queue_t *q, int deallocate);
 
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* memmem */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -10,6 +12,8 @@ extern "C" {
 #include <stdlib.h>
 #include <math.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -17,21 +21,38 @@ extern "C" {
 
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#ifdef POET_IO_URING
+#include <liburing.h>
+#endif
 
 #endif
 
 #include "poet_common_definitions.h"
 
-#define SELECT_TIMEOUT {5,0} /* 5 seconds */
+#define SELECT_TIMEOUT 5000 /* 5 seconds */
 #define RETRIES_THRESHOLD 10
 #define ENDING_CHARACTER '\0'
 #define ENDING_STRING "\r\n"
+#define RX_INITIAL_CAPACITY (4 * BUFFER_SIZE)
+#define URING_SOCKET_ENTRIES 8 /* a socket has at most one multishot request in flight */
+#define URING_SEND_ENTRIES 1024 /* sockets sent to with a single io_uring_enter */
+#define URING_BUFFERS 64
+#define URING_BUFFER_SIZE (4 * BUFFER_SIZE)
+#define URING_BUFFER_GROUP 0
 
 #include "socket_t.h"
 #include "queue_t.h"
 
 #define DEFAULT_ADDRESS INADDR_ANY
 
+static void demux_reset(struct socket_demux *d);
+
 // TODO: set C preprocessor conditionals for SSL
 
 static int create_primitive_socket(int domain, int type, int protocol, int *opt) {
@@ -40,6 +61,8 @@ static int create_primitive_socket(int domain, int type, int protocol, int *opt)
     errsv = errno;
     if (fd == -1) goto error;
 
+    if (domain == AF_UNIX) return fd; /* neither option applies to paths, and SO_REUSEPORT is refused */
+
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, opt, sizeof(*opt))) {
         errsv = max(errsv, errno);
         goto error;
@@ -63,7 +86,289 @@ static int create_primitive_socket(int domain, int type, int protocol, int *opt)
     return -1;
 }
 
+/* Forgets the received bytes, the buffer is kept for the next connection */
+static void rx_reset(socket_t *soc) {
+    soc->rx.start = soc->rx.end = soc->rx.next = 0;
+    soc->rx.scanned = soc->rx.wanted = 0;
+    soc->rx.has_saved = 0;
+}
+
+/* ************************* IO_URING BACKEND ************************* */
+
+#ifdef POET_IO_URING
+
+struct socket_uring {
+    struct io_uring ring;
+    struct io_uring_buf_ring *buffers; /* registered buffers the multishot receive picks from */
+    char *buffer_memory;
+    int accept_armed;
+    int recv_armed;
+    int recv_supported;
+
+    /* buffer of the last receive completion, handed out over several socket_recv calls if needed */
+    int has_pending;
+    int pending_bid;
+    size_t pending_offset;
+    size_t pending_len;
+};
+
+static struct socket_uring *uring_constructor() {
+    struct socket_uring *u = (struct socket_uring *) calloc(1, sizeof(struct socket_uring));
+    if (u == NULL) {
+        perror("socket uring calloc");
+        return NULL;
+    }
+
+    int ret = io_uring_queue_init(URING_SOCKET_ENTRIES, &u->ring, 0);
+    if (ret < 0) { /* not supported by the kernel or forbidden by the sandbox */
+        free(u);
+        errno = -ret;
+        perror("io_uring_queue_init");
+        return NULL;
+    }
+
+    u->buffer_memory = (char *) malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if (u->buffer_memory == NULL) goto error;
+
+    u->buffers = io_uring_setup_buf_ring(&u->ring, URING_BUFFERS, URING_BUFFER_GROUP, 0, &ret);
+    if (u->buffers == NULL) { /* kernels before 5.19, which don't have multishot accept either */
+        errno = -ret;
+        goto error;
+    }
+
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        io_uring_buf_ring_add(u->buffers, u->buffer_memory + i * URING_BUFFER_SIZE, URING_BUFFER_SIZE, i,
+                              io_uring_buf_ring_mask(URING_BUFFERS), i);
+    }
+    io_uring_buf_ring_advance(u->buffers, URING_BUFFERS);
+    u->recv_supported = 1;
+
+    return u;
+
+    error:
+    perror("socket uring constructor");
+    io_uring_queue_exit(&u->ring);
+    free(u->buffer_memory);
+    free(u);
+    return NULL;
+}
+
+static void uring_destructor(struct socket_uring *u) {
+    if (u == NULL) return;
+
+    io_uring_free_buf_ring(&u->ring, u->buffers, URING_BUFFERS, URING_BUFFER_GROUP);
+    io_uring_queue_exit(&u->ring); /* cancels the multishot requests */
+    free(u->buffer_memory);
+    free(u);
+}
+
+/* Takes the next completion, waiting for it if wait is set. Returns 0 with errno EAGAIN when there is none */
+static int uring_next_cqe(struct io_uring *ring, int wait, int *res, uint32_t *flags, uint64_t *data) {
+    struct io_uring_cqe *cqe;
+    int ret;
+    do {
+        ret = wait ? io_uring_wait_cqe(ring, &cqe) : io_uring_peek_cqe(ring, &cqe);
+    } while (ret == -EINTR);
+
+    if (ret < 0) {
+        errno = -ret;
+        return 0;
+    }
+
+    *res = cqe->res;
+    *flags = cqe->flags;
+    if (data != NULL) *data = io_uring_cqe_get_data64(cqe);
+    io_uring_cqe_seen(ring, cqe);
+    return 1;
+}
+
+/* The kernel accepts every incoming connection from now on, each one is a completion of the ring */
+static int uring_arm_accept(socket_t *soc) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&soc->uring->ring);
+    assert(sqe != NULL);
+    io_uring_prep_multishot_accept(sqe, soc->socket_descriptor, NULL, NULL, 0);
+
+    int ret = io_uring_submit(&soc->uring->ring);
+    if (ret < 0) {
+        errno = -ret;
+        perror("io_uring multishot accept");
+        return 0;
+    }
+
+    soc->uring->accept_armed = 1;
+    return 1;
+}
+
+/* Descriptor of the next accepted connection, only waits for one when the listener is blocking */
+static int uring_accept(socket_t *soc) {
+    struct socket_uring *u = soc->uring;
+    if (!u->accept_armed && !uring_arm_accept(soc)) return -1;
+
+    int res;
+    uint32_t flags;
+    for (;;) {
+        int got = uring_next_cqe(&u->ring, 0, &res, &flags, NULL);
+        if (!got && errno == EAGAIN && !(fcntl(soc->socket_descriptor, F_GETFL, 0) & O_NONBLOCK)) {
+            got = uring_next_cqe(&u->ring, 1, &res, &flags, NULL);
+        }
+        if (!got) return -1;
+
+        if (!(flags & IORING_CQE_F_MORE)) {
+            u->accept_armed = 0;
+            if (!uring_arm_accept(soc)) return -1;
+        }
+
+        if (res >= 0) return res;
+
+        /* a failed accept doesn't stop the next ones, which may already be completed */
+        errno = -res;
+        perror("io_uring accept");
+    }
+}
+
+/*
+ * Copies the received bytes from the registered buffers: a single multishot request receives into the buffers as
+ * data arrives, and each buffer is given back once it has been copied.
+ */
+static int uring_recv(socket_t *soc, char *buffer, int buffer_len, int flags) {
+    struct socket_uring *u = soc->uring;
+
+    while (!u->has_pending) {
+        if (!u->recv_armed) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+            assert(sqe != NULL);
+            io_uring_prep_recv_multishot(sqe, soc->socket_descriptor, NULL, 0, 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUFFER_GROUP;
+
+            int ret = io_uring_submit(&u->ring);
+            if (ret < 0) {
+                errno = -ret;
+                return -1;
+            }
+            u->recv_armed = 1;
+        }
+
+        int res;
+        uint32_t cqe_flags;
+        if (!uring_next_cqe(&u->ring, !(flags & MSG_DONTWAIT), &res, &cqe_flags, NULL)) return -1;
+        if (!(cqe_flags & IORING_CQE_F_MORE)) u->recv_armed = 0;
+
+        if (res == -ENOBUFS) continue; /* every buffer was waiting to be copied, armed again */
+        if (res == -EINVAL && !(cqe_flags & IORING_CQE_F_MORE)) { /* kernels before 6.0 */
+            WARN("multishot receive is not supported, socket %d receives with recv\n", soc->socket_descriptor);
+            u->recv_supported = 0;
+            return recv(soc->socket_descriptor, buffer, buffer_len, flags);
+        }
+        if (res <= 0) {
+            errno = -res;
+            return res == 0 ? 0 : -1;
+        }
+
+        u->has_pending = 1;
+        u->pending_bid = (int) (cqe_flags >> IORING_CQE_BUFFER_SHIFT);
+        u->pending_offset = 0;
+        u->pending_len = res;
+    }
+
+    char *data = u->buffer_memory + (size_t) u->pending_bid * URING_BUFFER_SIZE;
+    size_t n = min((size_t) buffer_len, u->pending_len - u->pending_offset);
+    memcpy(buffer, data + u->pending_offset, n);
+    u->pending_offset += n;
+
+    if (u->pending_offset == u->pending_len) {
+        io_uring_buf_ring_add(u->buffers, data, URING_BUFFER_SIZE, u->pending_bid,
+                              io_uring_buf_ring_mask(URING_BUFFERS), 0);
+        io_uring_buf_ring_advance(u->buffers, 1);
+        u->has_pending = 0;
+    }
+
+    return (int) n;
+}
+
+#endif
+
+/* Falls back to SOCKET_BACKEND_POSIX when io_uring is not built in or not available in the kernel */
+static void backend_init(socket_t *s, socket_backend_t backend) {
+    s->backend = SOCKET_BACKEND_POSIX;
+    s->uring = NULL;
+    if (backend != SOCKET_BACKEND_IO_URING) return;
+
+#ifdef POET_IO_URING
+    s->uring = uring_constructor();
+    if (s->uring != NULL) {
+        s->backend = SOCKET_BACKEND_IO_URING;
+        return;
+    }
+    WARN("io_uring is not available, socket %d uses the posix backend\n", s->socket_descriptor);
+#else
+    ERR("built without POET_IO_URING, socket %d uses the posix backend\n", s->socket_descriptor);
+#endif
+}
+
+/* Descriptor that becomes readable when the socket has a connection to accept */
+static int poll_descriptor(socket_t *soc) {
+#ifdef POET_IO_URING
+    if (soc->uring != NULL && soc->uring->accept_armed) return soc->uring->ring.ring_fd;
+#endif
+    return soc->socket_descriptor;
+}
+
+/* peer_len is 0 when the address of the peer is not known */
+static int accept_descriptor(socket_t *soc, struct sockaddr_storage *peer, socklen_t *peer_len) {
+#ifdef POET_IO_URING
+    if (soc->uring != NULL) {
+        *peer_len = 0;
+        return uring_accept(soc);
+    }
+#endif
+    *peer_len = sizeof(*peer);
+    return accept(soc->socket_descriptor, (struct sockaddr *) peer, peer_len);
+}
+
+static int recv_descriptor(socket_t *soc, void *buffer, int buffer_len, int flags) {
+#ifdef POET_IO_URING
+    if (soc->uring != NULL && soc->uring->recv_supported) return uring_recv(soc, (char *) buffer, buffer_len, flags);
+#endif
+    return (int) recv(soc->socket_descriptor, buffer, buffer_len, flags);
+}
+
+/* ip is the path of AF_UNIX sockets (port is not used), NULL binds AF_INET sockets to every interface */
+static int address_init(socket_t *s, const char *ip, int port) {
+    if (s->domain == AF_UNIX) {
+        struct sockaddr_un *address = (struct sockaddr_un *) &(s->address);
+        if (ip == NULL || strlen(ip) >= sizeof(address->sun_path)) {
+            errno = ENAMETOOLONG;
+            return 0;
+        }
+
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, ip);
+        s->addrlen = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + strlen(ip) + 1);
+        return 1;
+    }
+
+    struct sockaddr_in *address = (struct sockaddr_in *) &(s->address);
+    address->sin_family = s->domain;
+    address->sin_port = htons(port);
+
+    if (ip != NULL) {
+        if (inet_pton(s->domain, ip, &(address->sin_addr)) != 1) return 0;
+    } else {
+        address->sin_addr.s_addr = DEFAULT_ADDRESS;
+    }
+
+    s->addrlen = sizeof(*address);
+    return 1;
+}
+
 socket_t *socket_constructor(int domain, int type, int protocol, const char *ip, int port) {
+    return socket_constructor_custom(domain, type, protocol, ip, port, SOCKET_BACKEND_POSIX);
+}
+
+/* The backend is used for the whole life of the socket and inherited by the accepted sockets */
+socket_t *socket_constructor_custom(int domain, int type, int protocol, const char *ip, int port,
+                                    socket_backend_t backend) {
     socket_t *s = (socket_t *) malloc(sizeof(socket_t));
     if (s == NULL) goto error;
 
@@ -77,21 +382,8 @@ socket_t *socket_constructor(int domain, int type, int protocol, const char *ip,
     s->socket_descriptor = create_primitive_socket(domain, type, protocol, &(s->opt));
     if (s->socket_descriptor == -1) goto error;
 
-    struct sockaddr_in *address = &(s->address);
-    address->sin_family = domain;
-    address->sin_port = htons(port);
-
-    if (ip != NULL) {
-        if (inet_pton(domain, ip, &(address->sin_addr)) != 1) goto error;
-    } else {
-        address->sin_addr.s_addr = DEFAULT_ADDRESS;
-    }
-
-    s->addrlen = sizeof(*address);
-    s->fd_set.is_parent = 1;
-    FD_ZERO(&s->fd_set.data.set);
-    FD_SET(s->socket_descriptor, &s->fd_set.data.set);
-    s->fd_set.close_queue = queue_constructor();
+    if (!address_init(s, ip, port)) goto error;
+    backend_init(s, backend);
 
     return s;
 
@@ -104,6 +396,20 @@ socket_t *socket_constructor(int domain, int type, int protocol, const char *ip,
     return NULL;
 }
 
+/*
+ * Returns 1 if nobody accepts connections on the socket path any more: it was left by a server that was not closed
+ * properly and can be removed
+ */
+static int unix_path_is_stale(socket_t *soc) {
+    int fd = socket(AF_UNIX, soc->type, 0);
+    if (fd < 0) return 0;
+
+    int stale = connect(fd, (struct sockaddr *) &(soc->address), soc->addrlen) < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+/* The path of an AF_UNIX socket is only taken over from a server that is not running any more (EADDRINUSE otherwise) */
 int socket_bind(socket_t *soc) {
     assert(soc != NULL);
 
@@ -113,7 +419,21 @@ int socket_bind(socket_t *soc) {
     }
 
     int ret;
-    if ((ret = bind(soc->socket_descriptor, (struct sockaddr *) &(soc->address), sizeof(soc->address))) < 0) goto error;
+    struct stat path_stat;
+    const char *path = ((struct sockaddr_un *) &(soc->address))->sun_path;
+    if (soc->domain == AF_UNIX && stat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+        if (!unix_path_is_stale(soc)) {
+            ERROR("the socket path %s is used by a running server\n", path);
+            errno = EADDRINUSE;
+            ret = -1;
+            goto error;
+        }
+        WARN("removing the stale socket path %s\n", path);
+        unlink(path);
+    }
+
+    if ((ret = bind(soc->socket_descriptor, (struct sockaddr *) &(soc->address), soc->addrlen)) < 0) goto error;
+    soc->owns_path = soc->domain == AF_UNIX;
     return ret;
 
     error:
@@ -130,12 +450,19 @@ int socket_listen(socket_t *soc, int max_connections) {
         return -1;
     }
 
-    max_connections = max(0, min(max_connections, FD_SETSIZE));
+    max_connections = max(0, min(max_connections, SOMAXCONN));
 
     int ret;
     if ((ret = listen(soc->socket_descriptor, max_connections)) < 0) goto error;
     soc->max_connections = max_connections;
 
+#ifdef POET_IO_URING
+    if (soc->uring != NULL && !soc->uring->accept_armed && !uring_arm_accept(soc)) {
+        ret = -1;
+        goto error;
+    }
+#endif
+
     return ret;
 
     error:
@@ -143,65 +470,48 @@ int socket_listen(socket_t *soc, int max_connections) {
     return ret;
 }
 
-static socket_t *get_parent(socket_t *soc) {
-    if (soc == NULL) return NULL;
-    if (soc->fd_set.is_parent == 0) {
-        return get_parent(soc->fd_set.data.parent);
-    }
-
-    return soc;
-}
-
-int socket_select_parent(socket_t *soc) {
+/* Waits until the socket is readable (or has an incoming connection), retrying on every timeout */
+int socket_select(socket_t *soc) {
     assert(soc != NULL);
-    socket_t *parent = get_parent(soc);
-    assert(parent != NULL);
-    struct timeval val = SELECT_TIMEOUT;
 
     if (soc->is_closed) {
         ERROR("socket is closed, not receiving anything ... \n");
         return 0;
     }
 
-    queue_t *q = parent->fd_set.close_queue;
-    if (soc->fd_set.is_parent == 1) {
-        while (!queue_is_empty(q)) {
-            int fd = queue_front(q);
-            queue_pop(q);
-            FD_CLR(fd, &parent->fd_set.data.set);
-        }
-    }
-
+    struct pollfd fd = {soc->socket_descriptor, POLLIN, 0};
+    int ret;
     int errsv = 0;
-    struct timeval tmp;
-    int status = 1;
 
     retry:
-    tmp = val;
-    fd_set read_fd_set = parent->fd_set.data.set;
-    if (select(parent->socket_descriptor+1, &read_fd_set, NULL, NULL, &tmp) < 0) {
+    ret = poll(&fd, 1, SELECT_TIMEOUT);
+    if (ret < 0) {
         errsv = errno;
-        perror("select");
-        status = 0;
-    }
-
-    if (status) {
-        if (FD_ISSET(parent->socket_descriptor, &parent->fd_set.data.set)) {
-            errno = errsv;
-            status = 1;
-        } else {
-            ERR("select timeout on socket %d reached, retrying ...\n", soc->socket_descriptor);
-            goto retry;
-        }
+        if (errsv == EINTR) goto retry;
+        perror("poll");
+    } else if (ret == 0) {
+        ERR("select timeout on socket %d reached, retrying ...\n", soc->socket_descriptor);
+        goto retry;
     }
 
     errno = errsv;
-    return status;
+    return ret > 0;
 }
 
-int socket_select(socket_t *soc) {
+int socket_set_nonblocking(socket_t *soc, int nonblocking) {
     assert(soc != NULL);
-    return socket_select_parent(soc);
+
+    int flags = fcntl(soc->socket_descriptor, F_GETFL, 0);
+    if (flags == -1) goto error;
+
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    if (fcntl(soc->socket_descriptor, F_SETFL, flags) == -1) goto error;
+
+    return 1;
+
+    error:
+    perror("socket_set_nonblocking");
+    return 0;
 }
 
 socket_t *socket_accept(socket_t *soc) {
@@ -212,20 +522,30 @@ socket_t *socket_accept(socket_t *soc) {
         return NULL;
     }
 
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
     int new_socket_fd;
-    if ((new_socket_fd = accept(soc->socket_descriptor, (struct sockaddr *) &(soc->address),
-                                (socklen_t *) &(soc->addrlen))) < 0)
+    if ((new_socket_fd = accept_descriptor(soc, &peer, &peer_len)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return NULL; /* non-blocking listener without connections */
         goto error;
+    }
 
     socket_t *new_socket = malloc(sizeof(socket_t));
-    if (new_socket == NULL) goto error;
+    if (new_socket == NULL) {
+        close(new_socket_fd);
+        goto error;
+    }
     memcpy(new_socket, soc, sizeof(socket_t));
     new_socket->socket_descriptor = new_socket_fd;
-    new_socket->fd_set.is_parent = 0;
-    new_socket->fd_set.data.parent = soc;
-
-    socket_t *parent = get_parent(soc);
-    FD_SET(new_socket->socket_descriptor, &parent->fd_set.data.set);
+    memset(&new_socket->rx, 0, sizeof(new_socket->rx));
+    memset(&new_socket->tx, 0, sizeof(new_socket->tx));
+    new_socket->uring = NULL; /* the ring stays with the listener, the backend is kept for the batched sends */
+    new_socket->demux = NULL;
+    new_socket->owns_path = 0;
+    if (peer_len > 0) {
+        memcpy(&new_socket->address, &peer, peer_len);
+        new_socket->addrlen = peer_len;
+    }
 
     return new_socket;
     error:
@@ -252,6 +572,8 @@ int socket_connect(socket_t *soc) {
             ERR("connect error code is: %d (%s)\n", errsv, strerror(errsv));
             goto error;
         }
+    } else {
+        demux_reset(soc->demux);
     }
 
     return ret;
@@ -284,6 +606,7 @@ int socket_connect_retry(socket_t *soc) {
             }
 
             soc->socket_descriptor = new_fd;
+            rx_reset(soc);
             sleep(1);
         }
         retries++;
@@ -310,11 +633,15 @@ int socket_recv(socket_t *soc, void *buffer, int buffer_len, int flags) {
     int valread;
     int empty_queue = 0;
     again:
-    valread = recv(soc->socket_descriptor, buffer, buffer_len, flags);
+    valread = recv_descriptor(soc, buffer, buffer_len, flags);
 
     if (valread < 0 && !empty_queue) {
         ERRR("first try on getting data is unsuccessfull\n");
         errsv = errno;
+        if ((flags & MSG_DONTWAIT) && (errsv == EAGAIN || errsv == EWOULDBLOCK)) {
+            errno = errsv; /* non-blocking caller, it waits for the next readiness event */
+            return valread;
+        }
         perror("socket recv");
         if (errsv == EINTR || errsv == EAGAIN) {
             empty_queue = 1;
@@ -333,122 +660,375 @@ int socket_recv(socket_t *soc, void *buffer, int buffer_len, int flags) {
     return valread;
 }
 
-static char *concat_buffers(queue_t *queue) {
-    size_t expected_size = queue_size(queue) * BUFFER_SIZE;
+void socket_set_framing(socket_t *soc, socket_framing_t framing) {
+    assert(soc != NULL);
+    soc->framing = framing;
+}
 
-    char *buffer = malloc(expected_size);
-    if (buffer == NULL) {
-        perror("malloc");
-        goto error;
+/* Makes room for at least needed bytes after rx.end, moving the pending bytes to the front of the buffer first */
+static int rx_reserve(socket_t *soc, size_t needed) {
+    if (soc->rx.start > 0) {
+        memmove(soc->rx.data, soc->rx.data + soc->rx.start, soc->rx.end - soc->rx.start);
+        soc->rx.end -= soc->rx.start;
+        soc->rx.start = 0;
     }
-    memset(buffer, ENDING_CHARACTER, expected_size);
 
-    unsigned char c;
-    size_t pos = 0;
-    while (!queue_is_empty(queue)) {
-        char *current_buffer = queue_front(queue);
-        queue_pop(queue);
+    if (soc->rx.capacity - soc->rx.end >= needed) return 1;
 
-        memcpy(buffer + (pos++ * BUFFER_SIZE), current_buffer, BUFFER_SIZE);
+    size_t capacity = max(soc->rx.capacity, (size_t) RX_INITIAL_CAPACITY);
+    while (capacity - soc->rx.end < needed) capacity *= 2;
 
-        free(current_buffer);
+    char *data = realloc(soc->rx.data, capacity);
+    if (data == NULL) {
+        perror("socket rx realloc");
+        return 0;
     }
 
-    assert(pos <= expected_size);
+    soc->rx.data = data;
+    soc->rx.capacity = capacity;
+    return 1;
+}
 
-    goto terminate;
+/* Looks for a complete frame in the pending bytes, returns 1 and sets rx.next once found */
+static int rx_parse_frame(socket_t *soc, char **frame, size_t *frame_len) {
+    char *pending = soc->rx.data + soc->rx.start;
+    size_t available = soc->rx.end - soc->rx.start;
 
-    error:
-    ERROR("Fatal error, can not proceed with receiving message\n");
-    if (buffer != NULL) {
-        free(buffer);
+    if (soc->framing == SOCKET_FRAMING_AUTO && available > 0) {
+        soc->framing = pending[0] == '{' ? SOCKET_FRAMING_TERMINATOR : SOCKET_FRAMING_LENGTH;
+        ERR("socket %d uses %s framing\n", soc->socket_descriptor,
+            soc->framing == SOCKET_FRAMING_LENGTH ? "length-prefixed" : "terminator");
+    }
+
+    if (soc->framing == SOCKET_FRAMING_LENGTH) {
+        if (available < MSG_BYTES_SIZE) return 0;
+
+        uint32_t header;
+        memcpy(&header, pending, MSG_BYTES_SIZE);
+        header = ntohl(header);
+        size_t header_len = header & MSG_CHANNEL_FLAG ? 2 * MSG_BYTES_SIZE : MSG_BYTES_SIZE;
+        size_t len = header & ~MSG_CHANNEL_FLAG;
+        if (len == 0 || len > MSG_MAX_FRAME_SIZE) {
+            ERROR("Invalid message length %lu on socket %d\n", len, soc->socket_descriptor);
+            return -1;
+        }
+
+        if (available < header_len + len) {
+            soc->rx.wanted = header_len + len;
+            return 0;
+        }
+
+        uint32_t channel = SOCKET_CHANNEL_DEFAULT;
+        if (header & MSG_CHANNEL_FLAG) {
+            memcpy(&channel, pending + MSG_BYTES_SIZE, MSG_BYTES_SIZE);
+            channel = ntohl(channel);
+        }
+        soc->rx.channel = channel;
+
+        /* the byte after the payload belongs to the next frame, it is restored on the next call */
+        soc->rx.next = soc->rx.start + header_len + len;
+        if (soc->rx.next < soc->rx.end) {
+            soc->rx.saved = soc->rx.data[soc->rx.next];
+            soc->rx.has_saved = 1;
+        }
+        *frame = pending + header_len;
+        *frame_len = len;
+    } else if (soc->framing == SOCKET_FRAMING_TERMINATOR) {
+        /* the bytes already scanned are not searched again, minus one for a terminator split between two reads */
+        size_t from = soc->rx.scanned > 0 ? soc->rx.scanned - 1 : 0;
+        if (available < strlen(ENDING_STRING) || from > available - strlen(ENDING_STRING)) {
+            soc->rx.scanned = available;
+            return 0;
+        }
+
+        char *end = memmem(pending + from, available - from, ENDING_STRING, strlen(ENDING_STRING));
+        if (end == NULL) {
+            soc->rx.scanned = available;
+            return 0;
+        }
+
+        *end = ENDING_CHARACTER;
+        soc->rx.channel = SOCKET_CHANNEL_DEFAULT; /* no room for a channel id */
+        *frame = pending;
+        *frame_len = end - pending;
+        soc->rx.next = soc->rx.start + *frame_len + strlen(ENDING_STRING);
+    } else {
+        return 0; /* AUTO without data */
     }
-    buffer = NULL;
 
-    terminate:
-    return buffer;
+    soc->rx.scanned = 0;
+    soc->rx.wanted = 0;
+    return 1;
 }
 
-int socket_get_message_custom(socket_t *soc, void **buffer, size_t *buff_size, int flags) {
+/*
+ * Receives the next message into the receive buffer of the socket and hands it out in place: frame points to the
+ * NUL terminated payload, valid until the next receive on this socket. Bytes received after the message are kept
+ * for the next call. Returns the length of the message, 0 when the connection is closed or on error. With
+ * MSG_DONTWAIT in flags it returns SOCKET_AGAIN instead of waiting for the rest of the message.
+ */
+int socket_get_frame_custom(socket_t *soc, char **frame, size_t *frame_len, int flags) {
     assert(soc != NULL);
-    assert(buffer != NULL);
-//    assert(*buffer == NULL);
-    assert(buff_size != NULL);
+    assert(frame != NULL);
+    assert(frame_len != NULL);
+
+    *frame = NULL;
+    *frame_len = 0;
 
     if (soc->is_closed) {
         ERROR("socket is closed, not receiving anything ... \n");
         return -1;
     }
 
-    queue_t *buffer_queue = queue_constructor();
-
-    size_t current_size = 0;
-    size_t received;
-    uint retries;
-    int errsv;
-
-    int finished = 0;
-    do {
-        char *current_buffer = malloc(BUFFER_SIZE);
-        if (current_buffer == NULL) {
-            perror("malloc");
-            goto error;
+    /* releases the previous frame */
+    if (soc->rx.has_saved) {
+        soc->rx.data[soc->rx.next] = soc->rx.saved;
+        soc->rx.has_saved = 0;
+    }
+    soc->rx.start = soc->rx.next;
+
+    int parsed;
+    while ((parsed = rx_parse_frame(soc, frame, frame_len)) == 0) {
+        size_t pending = soc->rx.end - soc->rx.start;
+        size_t needed = max((size_t) BUFFER_SIZE, soc->rx.wanted > pending ? soc->rx.wanted - pending : 0);
+        if (!rx_reserve(soc, needed + 1)) goto error; /* + 1 for the NUL of a length-prefixed frame */
+        soc->rx.next = soc->rx.start;
+
+        int received = socket_recv(soc, soc->rx.data + soc->rx.end, (int) (soc->rx.capacity - soc->rx.end - 1), flags);
+        if (received < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SOCKET_AGAIN; /* the partial message stays in the buffer */
         }
-        memset(current_buffer, 0, BUFFER_SIZE);
-        queue_push(buffer_queue, current_buffer);
-
-        retries = 0;
-        retry:
-        received = socket_recv(soc, current_buffer, BUFFER_SIZE, flags);
-        errsv = errno;
-        if (received < 0) {
-            ERROR("Error receiving part of the buffer, retrying...\n");
-            retries++;
-            if (retries < RETRIES_THRESHOLD && errsv == EAGAIN) {
-                goto retry;
-            } else {
-                errno = errsv;
-                perror("socket get message -> retry");
-                goto error;
-            }
-        } else if (received == 0) {
+        if (received <= 0) {
             ERROR("Error, seems that the connection is closed.\n");
             goto error;
         }
+        soc->rx.end += received;
+    }
 
-        char *end_of_message = strstr(current_buffer, "\r\n");
-        if (end_of_message != NULL) { /* The message have been all received */
-            *end_of_message = '\0';
-            received = strlen(current_buffer);
-            finished = 1;
-        }
-
-        current_size += received;
-    } while (finished == 0);
+    if (parsed < 0) goto error;
 
-    *buffer = (void *) concat_buffers(buffer_queue);
-    *buff_size = strlen(*buffer);
+    (*frame)[*frame_len] = ENDING_CHARACTER;
+    if (soc->rx.next == soc->rx.end) {
+        soc->rx.start = soc->rx.end = soc->rx.next = 0; /* all consumed, the next message is received at the front */
+    }
 
-    goto terminate;
+    return (int) *frame_len;
 
     error:
     ERROR("Fatal error, can not proceed with receiving message\n");
-    if (*buffer != NULL) {
-        free(*buffer);
+    *frame = NULL;
+    *frame_len = 0;
+    return 0;
+}
+
+int socket_get_frame(socket_t *soc, char **frame, size_t *frame_len) {
+    return socket_get_frame_custom(soc, frame, frame_len, 0);
+}
+
+static char *frame_copy(const char *frame, size_t len) {
+    char *copy = malloc(len + 1);
+    if (copy == NULL) {
+        perror("malloc");
+        ERROR("Fatal error, can not proceed with receiving message\n");
+        return NULL;
+    }
+
+    memcpy(copy, frame, len + 1);
+    return copy;
+}
+
+/*
+ * Same as socket_get_frame, but the message is copied into a new buffer that the caller must free. With channels
+ * enabled it is the next message of SOCKET_CHANNEL_DEFAULT, and flags are ignored.
+ */
+int socket_get_message_custom(socket_t *soc, void **buffer, size_t *buff_size, int flags) {
+    assert(soc != NULL);
+    assert(buffer != NULL);
+    assert(buff_size != NULL);
+
+    if (soc->demux != NULL) {
+        return socket_get_message_channel(soc, SOCKET_CHANNEL_DEFAULT, buffer, buff_size);
     }
+
+    char *frame;
+    size_t len;
+    int ret = socket_get_frame_custom(soc, &frame, &len, flags);
+
     *buffer = NULL;
     *buff_size = 0;
-    current_size = 0;
+    if (ret <= 0) return ret;
 
-    terminate:
-    queue_destructor(buffer_queue, 1);
-    return current_size;
+    char *copy = frame_copy(frame, len);
+    if (copy == NULL) return 0;
+
+    *buffer = copy;
+    *buff_size = len;
+    return ret;
 }
 
 int socket_get_message(socket_t *soc, void **buffer, size_t *buff_size) {
     return socket_get_message_custom(soc, buffer, buff_size, MSG_DONTWAIT & 0);
 }
 
+/* ************************* CHANNELS ************************* */
+
+struct demux_message {
+    char *data;
+    size_t len;
+};
+
+struct socket_demux {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int receiving; /* a thread is receiving from the socket on behalf of every channel */
+    int closed;
+    queue_t *pending[SOCKET_MAX_CHANNELS]; /* messages received for another channel than the receiving one */
+};
+
+static void demux_clear(struct socket_demux *d) {
+    for (int i = 0; i < SOCKET_MAX_CHANNELS; i++) {
+        struct demux_message *m;
+        while ((m = (struct demux_message *) queue_front_and_pop_custom(d->pending[i], 0, 0)) != NULL) {
+            free(m->data);
+            free(m);
+        }
+    }
+    d->closed = 0;
+}
+
+/* A new connection, the messages of the previous one are discarded */
+static void demux_reset(struct socket_demux *d) {
+    if (d == NULL) return;
+
+    pthread_mutex_lock(&d->lock);
+    demux_clear(d);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void demux_destructor(struct socket_demux *d) {
+    if (d == NULL) return;
+
+    demux_clear(d);
+    for (int i = 0; i < SOCKET_MAX_CHANNELS; i++) {
+        if (d->pending[i] != NULL) queue_destructor(d->pending[i], 0);
+    }
+    pthread_cond_destroy(&d->changed);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+/*
+ * Lets several threads receive different kinds of messages from the same connection: the messages carry a channel
+ * id (socket_send_channel_iov) and socket_get_message_channel only returns those of the given channel. Needs
+ * length-prefixed framing.
+ */
+int socket_enable_channels(socket_t *soc) {
+    assert(soc != NULL);
+    if (soc->demux != NULL) return 1;
+
+    struct socket_demux *d = (struct socket_demux *) calloc(1, sizeof(struct socket_demux));
+    if (d == NULL) goto error;
+
+    for (int i = 0; i < SOCKET_MAX_CHANNELS; i++) {
+        d->pending[i] = queue_constructor();
+        if (d->pending[i] == NULL) goto error;
+    }
+
+    if (pthread_mutex_init(&d->lock, NULL) != 0 || pthread_cond_init(&d->changed, NULL) != 0) goto error;
+
+    soc->demux = d;
+    return 1;
+
+    error:
+    perror("socket enable channels");
+    if (d != NULL) {
+        for (int i = 0; i < SOCKET_MAX_CHANNELS; i++) {
+            if (d->pending[i] != NULL) queue_destructor(d->pending[i], 0);
+        }
+        free(d);
+    }
+    return 0;
+}
+
+/*
+ * Next message of the channel, copied into a new buffer that the caller must free. One of the threads waiting
+ * receives from the socket at a time and keeps the messages of the other channels for their threads. Returns the
+ * length of the message, or 0 when the connection is closed or on error (for every channel).
+ */
+int socket_get_message_channel(socket_t *soc, uint32_t channel, void **buffer, size_t *buff_size) {
+    assert(soc != NULL);
+    assert(buffer != NULL);
+    assert(buff_size != NULL);
+
+    *buffer = NULL;
+    *buff_size = 0;
+
+    if (soc->demux == NULL) { /* a single channel */
+        return socket_get_message_custom(soc, buffer, buff_size, 0);
+    }
+    assert(channel < SOCKET_MAX_CHANNELS);
+
+    struct socket_demux *d = soc->demux;
+    int ret = 0;
+
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        struct demux_message *m = (struct demux_message *) queue_front_and_pop_custom(d->pending[channel], 0, 0);
+        if (m != NULL) {
+            *buffer = m->data;
+            *buff_size = m->len;
+            ret = (int) m->len;
+            free(m);
+            break;
+        }
+
+        if (d->closed) break;
+
+        if (d->receiving) {
+            pthread_cond_wait(&d->changed, &d->lock);
+            continue;
+        }
+
+        d->receiving = 1;
+        pthread_mutex_unlock(&d->lock);
+
+        char *frame;
+        size_t len;
+        int received = socket_get_frame(soc, &frame, &len);
+        uint32_t frame_channel = soc->rx.channel;
+        char *copy = received > 0 ? frame_copy(frame, len) : NULL;
+
+        pthread_mutex_lock(&d->lock);
+        d->receiving = 0;
+        pthread_cond_broadcast(&d->changed);
+
+        if (copy == NULL) {
+            d->closed = 1; /* the other channels don't wait for a message that won't come */
+            break;
+        }
+
+        if (frame_channel == channel) {
+            *buffer = copy;
+            *buff_size = len;
+            ret = received;
+            break;
+        }
+
+        m = frame_channel < SOCKET_MAX_CHANNELS ? (struct demux_message *) malloc(sizeof(struct demux_message)) : NULL;
+        if (m == NULL) {
+            WARN("dropping message of channel %u on socket %d\n", frame_channel, soc->socket_descriptor);
+            free(copy);
+            continue;
+        }
+        m->data = copy;
+        m->len = len;
+        queue_push_custom(d->pending[frame_channel], m, 0, 0);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return ret;
+}
+
 int socket_send(socket_t *soc, const void *buffer, size_t buffer_len, int flags) {
     assert(soc != NULL);
     assert(buffer != NULL);
@@ -473,66 +1053,507 @@ int socket_send(socket_t *soc, const void *buffer, size_t buffer_len, int flags)
     return val;
 }
 
-int socket_send_message_custom(socket_t *soc, void *buffer, size_t buffer_len, int flags) {
+/* ************************* TRANSMIT BUFFER ************************* */
+
+/* Sends of a socket with a transmit buffer never block: what the kernel does not take right away is kept in the
+ * buffer, in order, and written by socket_flush when the socket becomes writable again. */
+
+int socket_enable_tx_buffer(socket_t *soc) {
     assert(soc != NULL);
-    assert(buffer != NULL);
-    assert(buffer_len > 0);
+    if (soc->tx.lock != NULL) return 1;
+
+    soc->tx.lock = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (soc->tx.lock == NULL || pthread_mutex_init(soc->tx.lock, NULL) != 0) {
+        perror("socket tx lock");
+        free(soc->tx.lock);
+        soc->tx.lock = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/* Skips the first sent bytes of the iovecs, the partially sent one is modified */
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t sent) {
+    while (*iovcnt > 0 && sent >= (*iov)->iov_len) {
+        sent -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + sent;
+        (*iov)->iov_len -= sent;
+    }
+}
+
+/* Writes as much as the socket takes without blocking, returns the number of bytes written or -1 */
+static ssize_t send_iov_nonblocking(socket_t *soc, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    ssize_t total_sent = 0;
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = min(iovcnt, IOV_MAX);
+        ssize_t sent = sendmsg(soc->socket_descriptor, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("socket send nonblocking");
+            return -1;
+        }
+
+        total_sent += sent;
+        iov_advance(&iov, &iovcnt, sent);
+    }
+
+    return total_sent;
+}
+
+/* The caller must hold the tx lock */
+static int tx_append(socket_t *soc, const struct iovec *iov, int iovcnt, size_t skip) {
+    size_t len = iov_length(iov, iovcnt) - skip;
+    if (len == 0) return 1;
+
+    if (soc->tx.start > 0 && soc->tx.capacity - soc->tx.end < len) {
+        memmove(soc->tx.data, soc->tx.data + soc->tx.start, soc->tx.end - soc->tx.start);
+        soc->tx.end -= soc->tx.start;
+        soc->tx.start = 0;
+    }
+
+    if (soc->tx.capacity - soc->tx.end < len) {
+        size_t capacity = max(soc->tx.capacity, (size_t) RX_INITIAL_CAPACITY);
+        while (capacity - soc->tx.end < len) capacity *= 2;
+
+        char *data = realloc(soc->tx.data, capacity);
+        if (data == NULL) {
+            perror("socket tx realloc");
+            return 0;
+        }
+        soc->tx.data = data;
+        soc->tx.capacity = capacity;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t part_skip = min(skip, iov[i].iov_len);
+        skip -= part_skip;
+        memcpy(soc->tx.data + soc->tx.end, (char *) iov[i].iov_base + part_skip, iov[i].iov_len - part_skip);
+        soc->tx.end += iov[i].iov_len - part_skip;
+    }
+
+    return 1;
+}
+
+/* Queues the iovecs behind the pending bytes, writing directly when nothing is pending */
+static int tx_send_iov(socket_t *soc, const struct iovec *iov, int iovcnt) {
+    pthread_mutex_lock(soc->tx.lock);
+
+    size_t sent = 0;
+    if (soc->tx.start == soc->tx.end) {
+        struct iovec copy[iovcnt];
+        memcpy(copy, iov, iovcnt * sizeof(struct iovec));
+        ssize_t r = send_iov_nonblocking(soc, copy, iovcnt);
+        if (r < 0) {
+            pthread_mutex_unlock(soc->tx.lock);
+            return -1;
+        }
+        sent = r;
+    }
+
+    int ok = tx_append(soc, iov, iovcnt, sent);
+    pthread_mutex_unlock(soc->tx.lock);
+
+    return ok ? 1 : -1;
+}
+
+/* Writes the pending bytes, returns 1 once everything is written, 0 if some are left or -1 on error */
+int socket_flush(socket_t *soc) {
+    assert(soc != NULL);
+    if (soc->tx.lock == NULL) return 1;
+
+    pthread_mutex_lock(soc->tx.lock);
+
+    int ret = 1;
+    if (soc->tx.start < soc->tx.end) {
+        struct iovec pending = {soc->tx.data + soc->tx.start, soc->tx.end - soc->tx.start};
+        ssize_t sent = send_iov_nonblocking(soc, &pending, 1);
+        if (sent < 0) {
+            ret = -1;
+        } else {
+            soc->tx.start += sent;
+            ret = soc->tx.start == soc->tx.end;
+        }
+    }
+
+    if (soc->tx.start == soc->tx.end) {
+        soc->tx.start = soc->tx.end = 0;
+    }
+
+    pthread_mutex_unlock(soc->tx.lock);
+    return ret;
+}
+
+/* Bytes waiting in the transmit buffer for the socket to be writable */
+size_t socket_tx_pending(socket_t *soc) {
+    assert(soc != NULL);
+    if (soc->tx.lock == NULL) return 0;
+
+    pthread_mutex_lock(soc->tx.lock);
+    size_t pending = soc->tx.end - soc->tx.start;
+    pthread_mutex_unlock(soc->tx.lock);
+    return pending;
+}
+
+/*
+ * Sends every byte of the iovecs with as few sendmsg calls as possible: partial writes resume from the first byte
+ * not sent, and a full non-blocking socket is waited on. The iovecs are modified. Returns the number of bytes sent or
+ * -1 on error.
+ */
+int socket_send_iov(socket_t *soc, struct iovec *iov, int iovcnt, int flags) {
+    assert(soc != NULL);
+    assert(iov != NULL || iovcnt == 0);
 
-    ERRR("Message to be sent: [%.*s] on socket %d\n", (int) buffer_len, buffer, soc->socket_descriptor);
     if (soc->is_closed) {
         ERROR("socket is closed, not sending anything ... \n");
         return -1;
     }
 
-    int sent, total_sent = 0;
-    int retries;
-    int errsv;
-    do {
-        retries = 0;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
 
-        retry:
-        sent = socket_send(soc, buffer + total_sent, min(buffer_len - total_sent, BUFFER_SIZE), flags);
-        errsv = errno;
+    ssize_t total_sent = 0;
+    int errsv = 0;
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = min(iovcnt, IOV_MAX);
+        ssize_t sent = sendmsg(soc->socket_descriptor, &msg, MSG_NOSIGNAL | flags);
         if (sent < 0) {
-            perror("socket send message");
-            retries++;
-            if (retries < RETRIES_THRESHOLD && errsv == EAGAIN) {
-                ERROR("Error sending part of the buffer, retrying ...\n");
-                goto retry;
-            } else {
-                ERROR("Fatal error sending part of the buffer, aborting ... \n");
-                goto error;
+            errsv = errno;
+            if (errsv == EINTR) continue;
+            if (errsv == EAGAIN || errsv == EWOULDBLOCK) {
+                struct pollfd fd = {soc->socket_descriptor, POLLOUT, 0};
+                if (poll(&fd, 1, SELECT_TIMEOUT) >= 0) continue;
+                errsv = errno;
             }
-        } else if (sent == 0) {
-            ERROR("Error sending part of the buffer, seems that the connection is closed. Closing socket ...\n");
-            socket_close(soc);
-            goto error;
+            errno = errsv;
+            perror("socket send iov");
+            return -1;
         }
+
         total_sent += sent;
-    } while (total_sent < buffer_len && retries < RETRIES_THRESHOLD);
+        iov_advance(&iov, &iovcnt, sent);
+    }
 
-    sent = socket_send(soc, ENDING_STRING, strlen(ENDING_STRING), flags);
-    if (sent < strlen(ENDING_STRING)) {
-        ERROR("Error sending ending of message\n");
-        goto error;
+    errno = errsv;
+    return (int) total_sent;
+}
+
+/*
+ * Frames the parts as a message of soc: iov (room for nparts + 1 elements) gets the header or terminator around the
+ * parts, header (two elements) is the storage of the length header and channel id. Returns the number of iovecs, 0
+ * if the message can not be sent.
+ */
+static int message_iov(socket_t *soc, uint32_t channel, const struct iovec *parts, int nparts, uint32_t *header,
+                       struct iovec *iov) {
+    size_t payload_len = 0;
+    for (int i = 0; i < nparts; i++) {
+        payload_len += parts[i].iov_len;
+    }
+    assert(payload_len > 0);
+
+    int length_prefixed = soc->framing == SOCKET_FRAMING_LENGTH;
+    if (length_prefixed && payload_len > MSG_MAX_FRAME_SIZE) {
+        ERROR("message of %lu bytes is too large to be sent\n", payload_len);
+        return 0;
+    }
+
+    if (!length_prefixed && channel != SOCKET_CHANNEL_DEFAULT) {
+        ERROR("channel %u needs length-prefixed framing on socket %d\n", channel, soc->socket_descriptor);
+        return 0;
+    }
+
+    int iovcnt = 0;
+    if (length_prefixed) {
+        int has_channel = channel != SOCKET_CHANNEL_DEFAULT; /* the default channel is compatible without channels */
+        header[0] = htonl((uint32_t) payload_len | (has_channel ? MSG_CHANNEL_FLAG : 0));
+        header[1] = htonl(channel);
+        iov[iovcnt].iov_base = header;
+        iov[iovcnt++].iov_len = has_channel ? 2 * MSG_BYTES_SIZE : MSG_BYTES_SIZE;
+    }
+    memcpy(iov + iovcnt, parts, nparts * sizeof(struct iovec));
+    iovcnt += nparts;
+    if (!length_prefixed) {
+        iov[iovcnt].iov_base = (void *) ENDING_STRING;
+        iov[iovcnt++].iov_len = strlen(ENDING_STRING);
+    }
+
+    return iovcnt;
+}
+
+/*
+ * Sends the parts as a single message: the framing header (or terminator) is gathered with the parts so the whole
+ * message goes out in one syscall for most sizes. Returns the number of payload bytes sent, 0 on error.
+ */
+int socket_send_message_iov(socket_t *soc, const struct iovec *parts, int nparts, int flags) {
+    return socket_send_channel_iov(soc, SOCKET_CHANNEL_DEFAULT, parts, nparts, flags);
+}
+
+/* Same as socket_send_message_iov on a channel of the receiver (see socket_enable_channels) */
+int socket_send_channel_iov(socket_t *soc, uint32_t channel, const struct iovec *parts, int nparts, int flags) {
+    assert(soc != NULL);
+    assert(parts != NULL && nparts > 0);
+
+    if (soc->is_closed) {
+        ERROR("socket is closed, not sending anything ... \n");
+        return -1;
+    }
+
+    uint32_t header[2];
+    struct iovec iov[nparts + 1];
+    int iovcnt = message_iov(soc, channel, parts, nparts, header, iov);
+    if (iovcnt == 0) return 0;
+
+    size_t expected = iov_length(iov, iovcnt);
+    size_t payload_len = iov_length(parts, nparts);
+
+    if (soc->tx.lock != NULL) {
+        if (tx_send_iov(soc, iov, iovcnt) < 0) {
+            ERROR("Error queueing the message, closing socket ...\n");
+            socket_close(soc);
+            return 0;
+        }
+        return (int) payload_len;
+    }
+
+    int sent = socket_send_iov(soc, iov, iovcnt, flags);
+    if (sent < 0 || (size_t) sent != expected) {
+        ERROR("Error sending the message, seems that the connection is closed. Closing socket ...\n");
+        socket_close(soc);
+        return 0;
+    }
+
+    ERRR("Message sent: %lu bytes on socket %d\n", payload_len, soc->socket_descriptor);
+
+    return (int) payload_len;
+}
+
+#ifdef POET_IO_URING
+
+static pthread_key_t send_ring_key;
+static pthread_once_t send_ring_once = PTHREAD_ONCE_INIT;
+static int send_ring_unavailable = 0;
+
+static void send_ring_destructor(void *ring) {
+    io_uring_queue_exit((struct io_uring *) ring);
+    free(ring);
+}
+
+static void send_ring_key_create() {
+    pthread_key_create(&send_ring_key, send_ring_destructor);
+}
+
+/* Ring of the calling thread for the batched sends, NULL when io_uring is not available */
+static struct io_uring *send_ring() {
+    if (send_ring_unavailable) return NULL;
+
+    pthread_once(&send_ring_once, send_ring_key_create);
+    struct io_uring *ring = (struct io_uring *) pthread_getspecific(send_ring_key);
+    if (ring != NULL) return ring;
+
+    ring = (struct io_uring *) malloc(sizeof(struct io_uring));
+    int ret = ring == NULL ? -ENOMEM : io_uring_queue_init(URING_SEND_ENTRIES, ring, 0);
+    if (ret < 0) {
+        errno = -ret;
+        perror("io_uring send ring");
+        free(ring);
+        send_ring_unavailable = 1;
+        return NULL;
     }
-//    total_sent += sent;
 
-#ifdef DEBUG2
-    ERRR("Message sent: [%.*s] on socket %d\n", total_sent, buffer, soc->socket_descriptor);
-    if (total_sent < buffer_len) {
-        WARN("sent buffer is smaller than intended (%d < %lu)\n", total_sent, buffer_len);
+    pthread_setspecific(send_ring_key, ring);
+    return ring;
+}
+
+/*
+ * One sendmsg per socket, each chunk of URING_SEND_ENTRIES sockets is submitted and waited in one io_uring_enter. A
+ * socket with a transmit buffer is only part of the batch while nothing is pending in it, and is never waited for: what
+ * its socket buffer could not take is queued in the transmit buffer
+ */
+static int uring_send_channel_batch(struct io_uring *ring, socket_t **sockets, int nsockets, uint32_t channel,
+                                    const struct iovec *parts, int nparts) {
+    int stride = nparts + 1;
+    struct iovec *iovs = (struct iovec *) malloc(URING_SEND_ENTRIES * stride * sizeof(struct iovec));
+    struct msghdr *msgs = (struct msghdr *) calloc(URING_SEND_ENTRIES, sizeof(struct msghdr));
+    if (iovs == NULL || msgs == NULL) {
+        perror("socket send batch malloc");
+        free(iovs);
+        free(msgs);
+        return -1;
     }
+
+    uint32_t header[2];
+    int delivered = 0;
+    for (int first = 0; first < nsockets; first += URING_SEND_ENTRIES) {
+        int count = min(URING_SEND_ENTRIES, nsockets - first);
+        int queued = 0;
+        memset(msgs, 0, count * sizeof(struct msghdr));
+
+        for (int i = 0; i < count; i++) {
+            socket_t *soc = sockets[first + i];
+            if (soc->is_closed) continue;
+
+            /* behind the pending bytes of its transmit buffer, or not meant to be sent to in batches */
+            if (soc->backend != SOCKET_BACKEND_IO_URING || socket_tx_pending(soc) > 0) {
+                delivered += socket_send_channel_iov(soc, channel, parts, nparts, 0) > 0;
+                continue;
+            }
+
+            struct iovec *iov = iovs + i * stride;
+            msgs[i].msg_iov = iov;
+            msgs[i].msg_iovlen = message_iov(soc, channel, parts, nparts, header, iov);
+            if (msgs[i].msg_iovlen == 0) continue;
+
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            assert(sqe != NULL); /* count is not larger than the submission queue */
+            io_uring_prep_sendmsg(sqe, soc->socket_descriptor, &msgs[i],
+                                  MSG_NOSIGNAL | (soc->tx.lock != NULL ? MSG_DONTWAIT : 0));
+            io_uring_sqe_set_data64(sqe, i);
+            queued++;
+        }
+
+        if (queued == 0) continue;
+
+        int ret;
+        do {
+            ret = io_uring_submit_and_wait(ring, queued);
+        } while (ret == -EINTR);
+
+        if (ret < 0) {
+            errno = -ret;
+            perror("io_uring send batch submit");
+
+            /* the entries are discarded with the ring, the rest is sent without io_uring */
+            pthread_setspecific(send_ring_key, NULL);
+            send_ring_destructor(ring);
+            send_ring_unavailable = 1;
+            for (int i = 0; i < count; i++) {
+                if (msgs[i].msg_iovlen > 0) {
+                    delivered += socket_send_channel_iov(sockets[first + i], channel, parts, nparts, 0) > 0;
+                }
+            }
+            for (int i = first + count; i < nsockets; i++) {
+                if (!sockets[i]->is_closed) {
+                    delivered += socket_send_channel_iov(sockets[i], channel, parts, nparts, 0) > 0;
+                }
+            }
+            break;
+        }
+
+        for (int n = 0; n < queued; n++) {
+            int res;
+            uint32_t flags;
+            uint64_t i;
+            if (!uring_next_cqe(ring, 1, &res, &flags, &i)) {
+                perror("io_uring send batch wait");
+                break;
+            }
+
+            socket_t *soc = sockets[first + i];
+            struct iovec *iov = msgs[i].msg_iov;
+            int iovcnt = (int) msgs[i].msg_iovlen;
+            size_t expected = iov_length(iov, iovcnt);
+
+            /* the rest of a partial send (full socket buffer) is queued, or sent directly without a transmit buffer */
+            if (soc->tx.lock != NULL && (res >= 0 || res == -EAGAIN)) {
+                pthread_mutex_lock(soc->tx.lock);
+                int queued_rest = tx_append(soc, iov, iovcnt, res > 0 ? (size_t) res : 0);
+                pthread_mutex_unlock(soc->tx.lock);
+                res = queued_rest ? (int) expected : -1;
+            } else if (res >= 0 && (size_t) res < expected) {
+                iov_advance(&iov, &iovcnt, res);
+                int sent = socket_send_iov(soc, iov, iovcnt, 0);
+                res = sent < 0 ? sent : res + sent;
+            }
+
+            if (res < 0 || (size_t) res != expected) {
+                ERROR("Error sending the message, seems that the connection is closed. Closing socket %d ...\n",
+                      soc->socket_descriptor);
+                socket_close(soc);
+            } else {
+                delivered++;
+            }
+        }
+    }
+
+    free(iovs);
+    free(msgs);
+    return delivered;
+}
+
 #endif
 
-    goto terminate;
+/*
+ * Sends the same message to every socket. The sockets with SOCKET_BACKEND_IO_URING are sent to together (a single
+ * io_uring_enter for up to URING_SEND_ENTRIES sockets), the others one after the other. The sockets that fail are
+ * closed. Returns the number of sockets the message was delivered to.
+ */
+int socket_send_message_batch(socket_t **sockets, int nsockets, const struct iovec *parts, int nparts) {
+    return socket_send_channel_batch(sockets, nsockets, SOCKET_CHANNEL_DEFAULT, parts, nparts);
+}
 
-    error:
-    ERROR("Fatal error, can not proceed with sending message\n");
-    total_sent = 0;
+/* Same as socket_send_message_batch on a channel of the receivers (see socket_enable_channels) */
+int socket_send_channel_batch(socket_t **sockets, int nsockets, uint32_t channel, const struct iovec *parts,
+                              int nparts) {
+    assert(sockets != NULL || nsockets == 0);
+    assert(parts != NULL && nparts > 0);
+
+#ifdef POET_IO_URING
+    struct io_uring *ring = nsockets > 0 ? send_ring() : NULL;
+    if (ring != NULL) {
+        int delivered = uring_send_channel_batch(ring, sockets, nsockets, channel, parts, nparts);
+        if (delivered >= 0) return delivered;
+    }
+#endif
 
-    terminate:
-    return total_sent;
+    int delivered = 0;
+    for (int i = 0; i < nsockets; i++) {
+        if (!sockets[i]->is_closed) {
+            delivered += socket_send_channel_iov(sockets[i], channel, parts, nparts, 0) > 0;
+        }
+    }
+
+    return delivered;
+}
+
+int socket_send_message_custom(socket_t *soc, void *buffer, size_t buffer_len, int flags) {
+    assert(soc != NULL);
+    assert(buffer != NULL);
+    assert(buffer_len > 0);
+
+    ERRR("Message to be sent: [%.*s] on socket %d\n", (int) buffer_len, buffer, soc->socket_descriptor);
+
+    struct iovec part = {buffer, buffer_len};
+    return socket_send_message_iov(soc, &part, 1, flags);
 }
 
 int socket_send_message(socket_t *soc, void *buffer, size_t buffer_len) {
@@ -553,8 +1574,9 @@ void socket_close(socket_t *soc) {
         ERROR("Error trying to close socket %d\n", soc->socket_descriptor);
     }
 
-    socket_t *parent = get_parent(soc);
-    queue_push(parent->fd_set.close_queue, (void *) soc->socket_descriptor);
+    if (soc->owns_path && unlink(((struct sockaddr_un *) &(soc->address))->sun_path) == -1) {
+        perror("socket_close unlink");
+    }
 
     soc->is_closed = 1;
 }
@@ -566,13 +1588,160 @@ void socket_destructor(socket_t *soc) {
         socket_close(soc);
     }
 
-    if (soc->fd_set.is_parent == 1) {
-        queue_destructor(soc->fd_set.close_queue, 0);
+    if (soc->tx.lock != NULL) {
+        pthread_mutex_destroy(soc->tx.lock);
+        free(soc->tx.lock);
     }
 
+#ifdef POET_IO_URING
+    uring_destructor(soc->uring);
+#endif
+
+    demux_destructor(soc->demux);
+    free(soc->tx.data);
+    free(soc->rx.data);
     free(soc);
 }
 
+/* ************************* REACTOR ************************* */
+
+static uint32_t reactor_to_epoll(uint32_t events) {
+    uint32_t e = EPOLLET | EPOLLRDHUP;
+    if (events & SOCKET_EVENT_READ) e |= EPOLLIN;
+    if (events & SOCKET_EVENT_WRITE) e |= EPOLLOUT;
+    return e;
+}
+
+static uint32_t epoll_to_reactor(uint32_t e) {
+    uint32_t events = 0;
+    if (e & EPOLLIN) events |= SOCKET_EVENT_READ;
+    if (e & EPOLLOUT) events |= SOCKET_EVENT_WRITE;
+    if (e & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) events |= SOCKET_EVENT_CLOSE;
+    return events;
+}
+
+socket_reactor_t *socket_reactor_constructor() {
+    socket_reactor_t *r = (socket_reactor_t *) malloc(sizeof(socket_reactor_t));
+    if (r == NULL) goto error;
+
+    r->wake_fd = -1;
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd == -1) goto error;
+
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake_fd == -1) goto error;
+
+    struct epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLIN | EPOLLET;
+    e.data.ptr = r; /* never the data of a socket */
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &e) == -1) goto error;
+
+    return r;
+
+    error:
+    perror("socket reactor constructor");
+    if (r != NULL) {
+        if (r->epoll_fd != -1) close(r->epoll_fd);
+        if (r->wake_fd != -1) close(r->wake_fd);
+        free(r);
+    }
+    return NULL;
+}
+
+static int reactor_control(socket_reactor_t *r, int op, socket_t *soc, uint32_t events, void *data) {
+    assert(r != NULL && soc != NULL);
+
+    if (soc->is_closed) {
+        ERROR("socket is closed, not registering it ... \n");
+        return 0;
+    }
+
+    struct epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = reactor_to_epoll(events);
+    e.data.ptr = data;
+
+    if (epoll_ctl(r->epoll_fd, op, poll_descriptor(soc), &e) == -1) {
+        perror("socket reactor epoll_ctl");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Registers soc for the given events, data is returned with each of its events */
+int socket_reactor_add(socket_reactor_t *r, socket_t *soc, uint32_t events, void *data) {
+    return reactor_control(r, EPOLL_CTL_ADD, soc, events, data);
+}
+
+int socket_reactor_modify(socket_reactor_t *r, socket_t *soc, uint32_t events, void *data) {
+    return reactor_control(r, EPOLL_CTL_MOD, soc, events, data);
+}
+
+/* Must be called before closing the socket */
+int socket_reactor_remove(socket_reactor_t *r, socket_t *soc) {
+    assert(r != NULL && soc != NULL);
+
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, poll_descriptor(soc), NULL) == -1) {
+        perror("socket reactor remove");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Returns the number of events written in events, 0 on timeout (timeout_ms -1 waits forever) or -1 on error */
+int socket_reactor_wait(socket_reactor_t *r, socket_event_t *events, int max_events, int timeout_ms) {
+    assert(r != NULL && events != NULL && max_events > 0);
+
+    struct epoll_event ready[max_events];
+    int n;
+    do {
+        n = epoll_wait(r->epoll_fd, ready, max_events, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        perror("socket reactor wait");
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (ready[i].data.ptr == r) {
+            uint64_t wakes;
+            while (read(r->wake_fd, &wakes, sizeof(wakes)) > 0); /* the wakes since the last wait are reported once */
+            events[i].data = NULL;
+            events[i].events = SOCKET_EVENT_WAKE;
+            continue;
+        }
+
+        events[i].data = ready[i].data.ptr;
+        events[i].events = epoll_to_reactor(ready[i].events);
+    }
+
+    return n;
+}
+
+/* Makes a thread blocked in socket_reactor_wait (or the next one to call it) return a SOCKET_EVENT_WAKE event */
+int socket_reactor_wake(socket_reactor_t *r) {
+    assert(r != NULL);
+
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("socket reactor wake");
+        return 0;
+    }
+
+    return 1;
+}
+
+void socket_reactor_destructor(socket_reactor_t *r) {
+    assert(r != NULL);
+    close(r->wake_fd);
+    close(r->epoll_fd);
+    free(r);
+}
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
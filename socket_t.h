@@ -6,7 +6,10 @@ extern "C" {
 #endif
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "queue_t.h"
 #ifdef __WIN32
@@ -14,13 +17,35 @@ extern "C" {
 typedef int socklen_t;
 #else
 #include <netinet/in.h>
+#include <sys/un.h>
 #endif
 
-#define MSG_BYTES_SIZE 4
+#define MSG_BYTES_SIZE 4 /* length header of SOCKET_FRAMING_LENGTH, unsigned in network byte order */
 #define MSG_BYTES_SIZE_CSTR STR(MSG_BYTES_SIZE)
+#define MSG_MAX_FRAME_SIZE (64 * 1024 * 1024)
+#define MSG_CHANNEL_FLAG 0x80000000u /* set in the length header when a MSG_BYTES_SIZE channel id follows it */
+#define SOCKET_CHANNEL_DEFAULT 0 /* requests and their responses, sent without channel id */
+#define SOCKET_CHANNEL_NOTIFICATIONS 1 /* messages pushed by the server */
+#define SOCKET_MAX_CHANNELS 4
+#define SOCKET_AGAIN (-2) /* returned by the non-blocking receives when the message is not complete yet */
+#define SOCKET_IOV_LITERAL(s) {(void *) (s), sizeof(s) - 1} /* iovec of a string literal without its NUL */
+
+typedef enum {
+    SOCKET_FRAMING_TERMINATOR = 0, /* messages end with "\r\n" (default) */
+    SOCKET_FRAMING_LENGTH,         /* messages start with a MSG_BYTES_SIZE length header */
+    SOCKET_FRAMING_AUTO,           /* chosen on the first message received: '{' means terminator, otherwise length */
+} socket_framing_t;
+
+typedef enum {
+    SOCKET_BACKEND_POSIX = 0, /* one system call per accept, receive and send */
+    SOCKET_BACKEND_IO_URING,  /* multishot accept and receive, batched sends (needs POET_IO_URING and Linux 6.0) */
+} socket_backend_t;
+
+struct socket_uring; /* io_uring state of a socket, only defined with POET_IO_URING */
+struct socket_demux; /* messages received for the channels nobody is receiving on yet */
 
 struct socket_t {
-    struct sockaddr_in address;
+    struct sockaddr_storage address; /* sockaddr_in, or sockaddr_un with the path of AF_UNIX sockets */
     socklen_t addrlen;
     int socket_descriptor;
     int domain;
@@ -29,35 +54,98 @@ struct socket_t {
     int opt;
     int is_closed;
     int max_connections;
+    int owns_path; /* bound AF_UNIX socket, its path is removed when it is closed */
+    socket_framing_t framing; /* inherited by the accepted sockets */
+    socket_backend_t backend; /* inherited by the accepted sockets, which are sent to in batches */
+    struct socket_uring *uring; /* ring of the constructed sockets with SOCKET_BACKEND_IO_URING */
+
+    /* Receive buffer reused by every message of the connection, it grows geometrically */
+    struct {
+        char *data;
+        size_t capacity;
+        size_t start;   /* first byte of the current message */
+        size_t end;     /* end of the received bytes */
+        size_t next;    /* first byte after the message handed out */
+        size_t scanned; /* bytes after start already searched for the terminator */
+        size_t wanted;  /* length of the incomplete length-prefixed message, header included */
+        char saved;     /* byte overwritten by the NUL after a length-prefixed message */
+        int has_saved;
+        uint32_t channel; /* channel of the message handed out */
+    } rx;
 
+    struct socket_demux *demux; /* set by socket_enable_channels */
+
+    /* Transmit buffer, only used once enabled by socket_enable_tx_buffer */
     struct {
-        int is_parent;
-        union {
-            fd_set set;
-            struct socket_t *parent;
-        } data;
-        queue_t *close_queue;
-    } fd_set;
+        char *data;
+        size_t capacity;
+        size_t start;
+        size_t end;
+        pthread_mutex_t *lock;
+    } tx;
 };
 
 typedef struct socket_t socket_t;
 
+/* Events of the reactor */
+#define SOCKET_EVENT_READ 0x1
+#define SOCKET_EVENT_WRITE 0x2
+#define SOCKET_EVENT_CLOSE 0x4 /* hang up or error, only reported */
+#define SOCKET_EVENT_WAKE 0x8 /* socket_reactor_wake was called, reported with NULL data */
+
+typedef struct {
+    void *data; /* user data given at registration */
+    uint32_t events;
+} socket_event_t;
+
+/* Edge-triggered readiness notification (epoll) for any number of sockets. A readiness event is only reported again
+ * after the socket returned EAGAIN, so the sockets registered should be non-blocking and drained on every event. */
+typedef struct {
+    int epoll_fd;
+    int wake_fd; /* eventfd written by socket_reactor_wake */
+} socket_reactor_t;
+
 socket_t *socket_constructor(int domain, int type, int protocol, const char *ip, int port);
+socket_t *socket_constructor_custom(int domain, int type, int protocol, const char *ip, int port,
+                                    socket_backend_t backend);
 int socket_bind(socket_t *soc);
 int socket_listen(socket_t *soc, int max_connections);
 int socket_select(socket_t *soc);
+int socket_set_nonblocking(socket_t *soc, int nonblocking);
+void socket_set_framing(socket_t *soc, socket_framing_t framing);
 socket_t *socket_accept(socket_t *soc);
 int socket_connect(socket_t *soc);
 int socket_connect_retry(socket_t *soc);
 int socket_recv(socket_t *soc, void *buffer, int buffer_len, int flags);
+int socket_get_frame(socket_t *soc, char **frame, size_t *frame_len);
+int socket_get_frame_custom(socket_t *soc, char **frame, size_t *frame_len, int flags);
 int socket_get_message(socket_t *soc, void **buffer, size_t *buff_size);
 int socket_get_message_custom(socket_t *soc, void **buffer, size_t *buff_size, int flags);
+int socket_enable_channels(socket_t *soc);
+int socket_get_message_channel(socket_t *soc, uint32_t channel, void **buffer, size_t *buff_size);
 int socket_send(socket_t *soc, const void *buffer, size_t buffer_len, int flags);
 int socket_send_message(socket_t *soc, void *buffer, size_t buffer_len);
 int socket_send_message_custom(socket_t *soc, void *buffer, size_t buff_size, int flags);
+int socket_send_iov(socket_t *soc, struct iovec *iov, int iovcnt, int flags);
+int socket_send_message_iov(socket_t *soc, const struct iovec *parts, int nparts, int flags);
+int socket_send_channel_iov(socket_t *soc, uint32_t channel, const struct iovec *parts, int nparts, int flags);
+int socket_send_message_batch(socket_t **sockets, int nsockets, const struct iovec *parts, int nparts);
+int socket_send_channel_batch(socket_t **sockets, int nsockets, uint32_t channel, const struct iovec *parts,
+                              int nparts);
+int socket_enable_tx_buffer(socket_t *soc);
+int socket_flush(socket_t *soc);
+size_t socket_tx_pending(socket_t *soc);
 void socket_close(socket_t *soc);
 void socket_destructor(socket_t *soc);
 
+socket_reactor_t *socket_reactor_constructor();
+int socket_reactor_add(socket_reactor_t *r, socket_t *soc, uint32_t events, void *data);
+int socket_reactor_modify(socket_reactor_t *r, socket_t *soc, uint32_t events, void *data);
+int socket_reactor_remove(socket_reactor_t *r, socket_t *soc);
+int socket_reactor_wait(socket_reactor_t *r, socket_event_t *events, int max_events, int timeout_ms);
+int socket_reactor_wake(socket_reactor_t *r);
+void socket_reactor_destructor(socket_reactor_t *r);
+
 #ifdef __cplusplus
 }
 #endif
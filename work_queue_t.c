@@ -0,0 +1,230 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <errno.h>
+#include "work_queue_t.h"
+
+#define WQ_AT(wq, i) ((wq)->items[((wq)->first + (i)) % (wq)->capacity])
+
+/* Converts a relative timeout into an absolute time of the clock used by the conditions */
+static struct timespec deadline_from(const struct timespec *timeout) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout->tv_sec + (deadline.tv_nsec + timeout->tv_nsec) / 1000000000L;
+    deadline.tv_nsec = (deadline.tv_nsec + timeout->tv_nsec) % 1000000000L;
+    return deadline;
+}
+
+/* Returns 0 when the deadline expired */
+static int cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *deadline) {
+    if (deadline == NULL) {
+        pthread_cond_wait(cond, lock);
+        return 1;
+    }
+
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static int cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    int ret = pthread_condattr_init(&attr) == 0;
+    ret = ret && pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0;
+    ret = ret && pthread_cond_init(cond, &attr) == 0;
+    pthread_condattr_destroy(&attr);
+    return ret;
+}
+
+work_queue_t *work_queue_constructor(size_t capacity, work_queue_policy_t policy) {
+    return work_queue_constructor_custom(capacity, policy, NULL);
+}
+
+/* drop is called (outside of the lock) on the elements discarded by WORK_QUEUE_DROP_OLDEST, it can be NULL */
+work_queue_t *work_queue_constructor_custom(size_t capacity, work_queue_policy_t policy, void (*drop)(void *)) {
+    assert(capacity > 0);
+
+    work_queue_t *wq = (work_queue_t *) calloc(1, sizeof(work_queue_t));
+    if (wq == NULL) {
+        perror("work queue constructor calloc");
+        goto error;
+    }
+
+    wq->capacity = capacity;
+    wq->policy = policy;
+    wq->drop = drop;
+
+    wq->items = (void **) calloc(capacity, sizeof(void *));
+    wq->lock = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    wq->not_empty = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+    wq->not_full = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+    if (wq->items == NULL || wq->lock == NULL || wq->not_empty == NULL || wq->not_full == NULL) {
+        perror("work queue constructor malloc");
+        goto error;
+    }
+
+    if (pthread_mutex_init(wq->lock, NULL) != 0) {
+        perror("work_queue_lock init");
+        goto error;
+    }
+
+    if (!cond_init(wq->not_empty) || !cond_init(wq->not_full)) {
+        perror("work_queue_cond init");
+        goto error;
+    }
+
+    ERRR("Created work queue %p (capacity: %lu)\n", wq, capacity);
+
+    return wq;
+
+    error:
+    if (wq != NULL) {
+        free(wq->items);
+        free(wq->lock);
+        free(wq->not_empty);
+        free(wq->not_full);
+        free(wq);
+    }
+    return NULL;
+}
+
+/* Returns 1 if the element was inserted, 0 if it was refused (full with WORK_QUEUE_REJECT, timeout or closed) */
+int work_queue_put_timed(work_queue_t *wq, void *d, const struct timespec *timeout) {
+    assert(wq != NULL);
+
+    struct timespec deadline;
+    if (timeout != NULL) deadline = deadline_from(timeout);
+
+    void *dropped = NULL;
+    int inserted = 0, has_dropped = 0;
+
+    pthread_mutex_lock(wq->lock);
+
+    if (!wq->closed && wq->size == wq->capacity) {
+        switch (wq->policy) {
+            case WORK_QUEUE_DROP_OLDEST:
+                dropped = WQ_AT(wq, 0);
+                has_dropped = 1;
+                wq->first = (wq->first + 1) % wq->capacity;
+                wq->size--;
+                wq->stats.dropped++;
+                break;
+            case WORK_QUEUE_BLOCK:
+                wq->stats.blocked++;
+                while (!wq->closed && wq->size == wq->capacity &&
+                       cond_wait_until(wq->not_full, wq->lock, timeout != NULL ? &deadline : NULL));
+                break;
+            case WORK_QUEUE_REJECT:
+                break;
+        }
+    }
+
+    if (!wq->closed && wq->size < wq->capacity) {
+        WQ_AT(wq, wq->size) = d;
+        wq->size++;
+        wq->stats.puts++;
+        if (wq->size > wq->stats.max_depth) wq->stats.max_depth = wq->size;
+        inserted = 1;
+        pthread_cond_signal(wq->not_empty);
+    } else {
+        wq->stats.rejected++;
+    }
+
+    pthread_mutex_unlock(wq->lock);
+
+    if (has_dropped && wq->drop != NULL) {
+        wq->drop(dropped);
+    }
+
+    if (!inserted) {
+        WARN("work queue %p refused an element\n", wq);
+    }
+
+    return inserted;
+}
+
+int work_queue_put(work_queue_t *wq, void *d) {
+    return work_queue_put_timed(wq, d, NULL);
+}
+
+/* Returns 1 and the oldest element in d, or 0 if the timeout expired or the queue was closed and is empty */
+int work_queue_take_timed(work_queue_t *wq, void **d, const struct timespec *timeout) {
+    assert(wq != NULL && d != NULL);
+
+    struct timespec deadline;
+    if (timeout != NULL) deadline = deadline_from(timeout);
+
+    pthread_mutex_lock(wq->lock);
+
+    while (!wq->closed && wq->size == 0 &&
+           cond_wait_until(wq->not_empty, wq->lock, timeout != NULL ? &deadline : NULL));
+
+    int taken = wq->size > 0;
+    if (taken) {
+        *d = WQ_AT(wq, 0);
+        wq->first = (wq->first + 1) % wq->capacity;
+        wq->size--;
+        wq->stats.takes++;
+        pthread_cond_signal(wq->not_full);
+    }
+
+    pthread_mutex_unlock(wq->lock);
+
+    return taken;
+}
+
+/* Blocks until there is an element, returns NULL once the queue is closed and empty */
+void *work_queue_take(work_queue_t *wq) {
+    void *d = NULL;
+    work_queue_take_timed(wq, &d, NULL);
+    return d;
+}
+
+size_t work_queue_size(work_queue_t *wq) {
+    assert(wq != NULL);
+    pthread_mutex_lock(wq->lock);
+    size_t size = wq->size;
+    pthread_mutex_unlock(wq->lock);
+    return size;
+}
+
+void work_queue_get_stats(work_queue_t *wq, work_queue_stats_t *stats) {
+    assert(wq != NULL && stats != NULL);
+    pthread_mutex_lock(wq->lock);
+    *stats = wq->stats;
+    stats->depth = wq->size;
+    pthread_mutex_unlock(wq->lock);
+}
+
+/* Refuses new elements and wakes every waiting thread, the remaining elements can still be taken */
+void work_queue_close(work_queue_t *wq) {
+    assert(wq != NULL);
+    pthread_mutex_lock(wq->lock);
+    wq->closed = 1;
+    pthread_cond_broadcast(wq->not_empty);
+    pthread_cond_broadcast(wq->not_full);
+    pthread_mutex_unlock(wq->lock);
+}
+
+void work_queue_destructor(work_queue_t *wq, int deallocate) {
+    assert(wq != NULL);
+
+    if (deallocate) {
+        for (size_t i = 0; i < wq->size; i++) {
+            free(WQ_AT(wq, i));
+        }
+    }
+
+    pthread_mutex_destroy(wq->lock);
+    pthread_cond_destroy(wq->not_empty);
+    pthread_cond_destroy(wq->not_full);
+
+    free(wq->items);
+    free(wq->lock);
+    free(wq->not_empty);
+    free(wq->not_full);
+    free(wq);
+}
+
+#ifdef __cplusplus
+}
+#endif
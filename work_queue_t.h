@@ -0,0 +1,61 @@
+#ifndef POET_CODE_WORK_QUEUE_T_H
+#define POET_CODE_WORK_QUEUE_T_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "poet_common_definitions.h"
+
+/* What work_queue_put does when the queue is full */
+typedef enum {
+    WORK_QUEUE_BLOCK = 0,   /* wait until a consumer takes an element (or the timeout expires) */
+    WORK_QUEUE_DROP_OLDEST, /* discard the oldest element (given to the drop function) and insert the new one */
+    WORK_QUEUE_REJECT,      /* return right away without inserting, the caller answers with a busy reply */
+} work_queue_policy_t;
+
+typedef struct {
+    size_t depth;     /* current number of elements */
+    size_t max_depth; /* highest number of elements seen */
+    size_t puts;
+    size_t takes;
+    size_t blocked;   /* puts that had to wait for room */
+    size_t rejected;  /* puts refused by the policy, the timeout or the closing of the queue */
+    size_t dropped;   /* elements discarded by WORK_QUEUE_DROP_OLDEST */
+} work_queue_stats_t;
+
+/* Bounded multi-producer/multi-consumer queue used to hand work to a fixed set of threads */
+typedef struct {
+    void **items;
+    size_t capacity;
+    size_t first;
+    size_t size;
+    work_queue_policy_t policy;
+    void (*drop)(void *);
+    int closed;
+    pthread_mutex_t *lock;
+    pthread_cond_t *not_empty;
+    pthread_cond_t *not_full;
+    work_queue_stats_t stats;
+} work_queue_t;
+
+work_queue_t *work_queue_constructor(size_t capacity, work_queue_policy_t policy);
+work_queue_t *work_queue_constructor_custom(size_t capacity, work_queue_policy_t policy, void (*drop)(void *));
+int work_queue_put(work_queue_t *wq, void *d);
+int work_queue_put_timed(work_queue_t *wq, void *d, const struct timespec *timeout);
+void *work_queue_take(work_queue_t *wq);
+int work_queue_take_timed(work_queue_t *wq, void **d, const struct timespec *timeout);
+size_t work_queue_size(work_queue_t *wq);
+void work_queue_get_stats(work_queue_t *wq, work_queue_stats_t *stats);
+void work_queue_close(work_queue_t *wq);
+void work_queue_destructor(work_queue_t *wq, int deallocate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //POET_CODE_WORK_QUEUE_T_H